@@ -1,49 +1,170 @@
 #define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <errno.h>
+#include <math.h>
 
 #include "debug.h"
 #include "config.h"
 #include "setup_ib.h"
 #include "ib.h"
+#include "transport.h"
+#include "stats.h"
 #include "client.h"
+#include "rpc.h"
+#include "rndv.h"
+#include "trace.h"
+
+static inline uint64_t xorshift64 (uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/* open loop: requests arrive on a schedule of their own, whether */
+/* or not the echoes of earlier ones are back                     */
+struct Arrivals {
+    uint64_t  start_ns;
+    double    offset_ns;        /* arrival time of the next request */
+    double    gap_ns;           /* mean gap between arrivals */
+    bool      poisson;
+    uint64_t  rand_state;
+    int       next_peer;        /* arrivals go to the peers round-robin */
+    int      *num_inflight;     /* per peer, bounded by the window */
+};
+
+static inline uint64_t next_arrival_ns (struct Arrivals *a)
+{
+    return a->start_ns + (uint64_t)a->offset_ns;
+}
+
+/* exponential gaps: -ln(u) * mean with u uniform in (0, 1]; */
+/* (log) is libm's, not the log macro of debug.h              */
+static inline void advance_arrival (struct Arrivals *a)
+{
+    double u = 0.0;
+
+    if (a->poisson != true) {
+	a->offset_ns += a->gap_ns;
+	return;
+    }
+    u = (double)((xorshift64 (&a->rand_state) >> 11) + 1) / (double)(1ULL << 53);
+    a->offset_ns -= (log) (u) * a->gap_ns;
+}
+
+/* rpc: one slot per request in flight; req_id is the slot in its */
+/* low 32 bits and the number of times the slot was used above    */
+struct RPCSlot {
+    uint64_t  req_id;
+    uint64_t  issue_ns;
+};
+
+/* the next opcode of the rpc_ops cycle, into the slot's buffer */
+static inline void issue_rpc (struct RPCSlot *slots, uint32_t slot, char *msg,
+			      int msg_size, long *seq)
+{
+    uint16_t opcode = config_info.rpc_ops[*seq % config_info.num_rpc_ops];
+
+    *seq += 1;
+    slots[slot].req_id   = (slots[slot].req_id + (1ULL << 32)) | slot;
+    slots[slot].issue_ns = get_time_ns ();
+    rpc_init_request (msg, msg_size, opcode, slots[slot].req_id);
+}
+
+/* drop our references and invalidate before the memory goes away */
+static void release_app_sources (struct MRCache *cache, char *buf,
+				 struct MRCacheEntry **ent, int num, int msg_size)
+{
+    int i = 0;
+
+    for (i = 0; (ent != NULL) && (i < num); i++) {
+	if (ent[i] != NULL) {
+	    mrcache_put (cache, ent[i]);
+	}
+    }
+    if (buf != NULL) {
+	mrcache_invalidate (cache, buf, (size_t)num * msg_size);
+	free (buf);
+    }
+    free (ent);
+}
 
 void *client_thread_func (void *arg)
 {
     int         ret		 = 0, n = 0, i = 0, j = 0;
     long	thread_id	 = (long) arg;
     int         msg_size	 = config_info.msg_size;
+    long        num_warmup_ops   = config_info.num_warmup_ops;
     int         num_concurr_msgs = config_info.num_concurr_msgs;
-    int         num_peers        = ib_res.num_qps;
+    struct ThreadRes *tres       = &ib_res.thread_res[thread_id];
+    int         num_peers        = tres->num_peers;
+    int        *peers            = tres->peers;
 
     pthread_t   self;
     cpu_set_t   cpuset;
 
-    int                  num_wc		= 20;
-    struct ibv_qp	**qp		= ib_res.qp;
-    struct ibv_cq       *cq		= ib_res.cq;
-    struct ibv_srq      *srq            = ib_res.srq;
+    int                  num_wc		= config_info.batch_size;
+    struct ibv_cq       *cq		= tres->cq;
     struct ibv_wc       *wc		= NULL;
-    uint32_t             lkey           = ib_res.mr->lkey;
+    struct QPSendState  *sq_state       = ib_res.sq_state;
+    struct SendBacklog   backlog        = {0};
+    struct PostBatch     batch          = {0};
+    struct CQWaiter      waiter         = {.epfd = -1};
+    uint32_t             rank           = config_info.rank;
 
-    char		*buf_ptr	= ib_res.ib_buf;
-    char		*buf_base	= ib_res.ib_buf;
+    char		*buf_ptr	= tres->buf;
+    char		*buf_base	= tres->buf;
     int			 buf_offset	= 0;
-    size_t               buf_size	= ib_res.ib_buf_size;
+    size_t               buf_size	= tres->buf_size;
     
+    bool                 lat_mode       = (config_info.mode == MODE_LATENCY);
+    bool                 write_mode     = (config_info.transport == TRANSPORT_WRITE);
+    bool                 ud_mode        = (config_info.transport == TRANSPORT_UD);
+    uint32_t             recv_size      = ib_res.recv_size;
+    struct PeerRing     *rings          = ib_res.rings;
+    struct RemoteBuf    *remote_buf     = ib_res.remote_buf;
+    size_t               slot_size      = ib_res.ring_slot_size;
+    int                  window         = num_concurr_msgs;
+    struct LatHist      *lat_hist       = NULL;
+    bool                 open_loop      = (config_info.arrival != ARRIVAL_CLOSED);
+    struct Arrivals      arrivals       = {0};
+    uint64_t             now            = 0;
+    bool                 rpc_mode       = (config_info.num_rpc_ops > 0);
+    struct RPCSlot      *rpc_slots      = NULL;
+    struct RPCStats     *rpc_stats      = NULL;
+    long                 rpc_seq        = 0;
+    bool                 rndv           = rndv_enabled (msg_size);
+    uint32_t             send_size      = rndv ? sizeof(struct RndvDesc) : msg_size;
+    struct PoolBuf     **rndv_src       = NULL;
+    struct MRCache      *mr_cache       = &tres->mr_cache;
+    bool                 app_src        = rndv && (config_info.mr_cache > 0);
+    char                *app_buf        = NULL;
+    struct MRCacheEntry **app_ent       = NULL;
+    char                *req_buf        = NULL;
+    int                  num_req_bufs   = config_info.batch_size + 1;
+    int                  req_seq        = 0;
+
     uint32_t		imm_data	= 0;
     int			num_acked_peers = 0;
     bool		start_sending	= false;
     bool		stop		= false;
     struct timeval      start, end;
     long                ops_count	= 0;
+    uint64_t            cpu_start       = 0, cpu_end = 0;
     double              duration	= 0.0;
     double              throughput	= 0.0;
 
     /* set thread affinity */
     CPU_ZERO (&cpuset);
-    CPU_SET  ((int)thread_id, &cpuset);
+    CPU_SET  (tres->cpu, &cpuset);
     self = pthread_self ();
     ret  = pthread_setaffinity_np (self, sizeof(cpu_set_t), &cpuset);
     check (ret == 0, "thread[%ld]: failed to set thread affinity", thread_id);
@@ -51,20 +172,101 @@ void *client_thread_func (void *arg)
     /* pre-post recvs */    
     wc = (struct ibv_wc *) calloc (num_wc, sizeof(struct ibv_wc));
     check (wc != NULL, "thread[%ld]: failed to allocate wc.", thread_id);
+    log_thread_placement (thread_id, wc);
+    trace_thread_start (thread_id);
 
-    for (i = 0; i < num_peers; i++) {
-	for (j = 0; j < num_concurr_msgs; j++) {
-	    ret = post_srq_recv (msg_size, lkey, (uint64_t)buf_ptr, srq, buf_ptr);
-	    buf_offset = (buf_offset + msg_size) % buf_size;
-	    buf_ptr = buf_base + buf_offset;
+    ret = init_thread_cq_waiter (&waiter, thread_id);
+    check (ret == 0, "thread[%ld]: failed to init cq waiter", thread_id);
+
+    /* open loop: each thread offers its share of arrival_rate; */
+    /* the window only bounds what is in flight per peer        */
+    if (open_loop) {
+	arrivals.gap_ns     = 1e6 * ib_res.num_threads / config_info.arrival_rate;
+	arrivals.poisson    = (config_info.arrival == ARRIVAL_POISSON);
+	arrivals.rand_state = 0x9E3779B97F4A7C15ULL ^
+	    ((uint64_t)config_info.rank << 32) ^ (uint64_t)(thread_id + 1);
+	arrivals.num_inflight = (int *) calloc (num_peers, sizeof(int));
+	check (arrivals.num_inflight != NULL,
+	       "thread[%ld]: failed to allocate num_inflight", thread_id);
+    }
+
+    /* latency mode: per-peer histograms followed by the thread total */
+    if (lat_mode) {
+	window   = open_loop ? num_concurr_msgs : config_info.latency_window;
+	lat_hist = (struct LatHist *) malloc ((num_peers + 1) * sizeof(struct LatHist));
+	check (lat_hist != NULL, "thread[%ld]: failed to allocate lat_hist", thread_id);
+	for (i = 0; i <= num_peers; i++) {
+	    hist_init (&lat_hist[i]);
 	}
+	tres->lat_hist = lat_hist;
     }
 
-    /* wait for start signal */
+    ret = init_send_backlog (&backlog, num_peers * num_concurr_msgs);
+    check (ret == 0, "thread[%ld]: failed to allocate send backlog", thread_id);
+
+    /* new requests are built here and echoes go back from the buffer */
+    /* they arrived in; inline sends are copied only when the chain   */
+    /* is posted, so a request gets one of max_wr + 1 buffers          */
+    req_buf = (char *) calloc (num_req_bufs, recv_size);
+    check (req_buf != NULL, "thread[%ld]: failed to allocate request buffer", thread_id);
+
+    /* rendezvous: request i * window + j to peer i describes source */
+    /* buffer i * window + j, which the server reads from            */
+    if (rndv && (app_src != true)) {
+	rndv_src = (struct PoolBuf **) calloc (num_peers * window, sizeof(struct PoolBuf *));
+	check (rndv_src != NULL, "thread[%ld]: failed to allocate rendezvous sources",
+	       thread_id);
+	for (i = 0; i < num_peers * window; i++) {
+	    rndv_src[i] = pool_get (&tres->pool, msg_size);
+	    check (rndv_src[i] != NULL, "thread[%ld]: failed to get a %d-byte source",
+		   thread_id, msg_size);
+	}
+    }
+
+    /* mr_cache: the sources are plain application memory, looked up */
+    /* in the registration cache every time a descriptor goes out     */
+    if (app_src) {
+	app_buf = (char *) malloc ((size_t)num_peers * window * msg_size);
+	app_ent = (struct MRCacheEntry **) calloc (num_peers * window,
+						   sizeof(struct MRCacheEntry *));
+	check ((app_buf != NULL) && (app_ent != NULL),
+	       "thread[%ld]: failed to allocate application sources", thread_id);
+    }
+
+    /* rpc: slot i * window + j carries the j-th request to peer i */
+    if (rpc_mode) {
+	rpc_slots = (struct RPCSlot *) calloc (num_peers * window, sizeof(struct RPCSlot));
+	check (rpc_slots != NULL, "thread[%ld]: failed to allocate rpc slots", thread_id);
+	rpc_stats = (struct RPCStats *) malloc (RPC_MAX_OPS * sizeof(struct RPCStats));
+	check (rpc_stats != NULL, "thread[%ld]: failed to allocate rpc stats", thread_id);
+	rpc_init_stats (rpc_stats);
+	tres->rpc_stats = rpc_stats;
+    }
+
+    ret = transport->init_batch (&batch, thread_id);
+    check (ret == 0, "thread[%ld]: failed to allocate post batch", thread_id);
+    sq_state = batch.sq_state;
+
+    /* every buffer of the slice stays posted across runs; */
+    /* setup_ib already posted them, see post_client_recvs  */
+    for (j = 0; (tres->recvs_posted != true) && (j < buf_size / recv_size); j++) {
+	ret = transport->recv (&batch, recv_size, buf_ptr);
+	check (ret == 0, "thread[%ld]: failed to pre-post recv", thread_id);
+	buf_offset = (buf_offset + recv_size) % buf_size;
+	buf_ptr = buf_base + buf_offset;
+    }
+    ret = transport->flush (&batch);
+    check (ret == 0, "thread[%ld]: failed to pre-post recvs", thread_id);
+    tres->recvs_posted = true;
+
+    /* wait for start signal; some may have come in with the last run */
+    num_acked_peers        = tres->num_early_starts;
+    tres->num_early_starts = 0;
+    start_sending          = (num_acked_peers == num_peers);
     while (start_sending != true) {
         do {
-            n = ibv_poll_cq (cq, num_wc, wc);
-        } while (n < 1);
+            n = transport->poll (&batch, &waiter, num_wc, wc);
+        } while (n == 0);
         check (n > 0, "thread[%ld]: failed to poll cq", thread_id);
 
         for (i = 0; i < n; i++) {
@@ -74,7 +276,8 @@ void *client_thread_func (void *arg)
             }
             if (wc[i].opcode == IBV_WC_RECV) {
                 /* post a receive */
-                post_srq_recv (msg_size, lkey, wc[i].wr_id, srq, (char *)wc[i].wr_id);
+                ret = transport->recv (&batch, recv_size, (char *)wc[i].wr_id);
+                check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
                 
                 if (ntohl(wc[i].imm_data) == MSG_CTL_START) {
 		    num_acked_peers += 1;
@@ -85,25 +288,111 @@ void *client_thread_func (void *arg)
                 }
             }
         }
+
+        ret = transport->flush (&batch);
+        check (ret == 0, "thread[%ld]: failed to flush post batch", thread_id);
     }
     log ("thread[%ld]: ready to send", thread_id);
 
-    /* pre-post sends */
-    buf_offset = 0;
-    debug ("buf_ptr = %"PRIx64"", (uint64_t)buf_ptr);
-    for (i = 0; i < num_peers; i++) {
-	for (j = 0; j < num_concurr_msgs; j++) {
-	    ret = post_send (msg_size, lkey, (uint64_t)buf_ptr, (uint32_t)i, qp[i], buf_ptr);
+    /* pre-post sends; open loop starts its schedule instead */
+    arrivals.start_ns = get_time_ns ();
+    for (i = 0; (open_loop != true) && (i < num_peers); i++) {
+	for (j = 0; j < window; j++) {
+	    if (write_mode) {
+		struct PeerRing *ring = &rings[peers[i]];
+		size_t           off  = ring_slot_offset (ring->send_seq,
+							  num_concurr_msgs, slot_size);
+		char            *slot = ring->send_ring + off;
+
+		if (lat_mode) {
+		    *(uint64_t *)slot = get_time_ns ();
+		}
+		*ring_slot_seq (slot, slot_size) = ring->send_seq + 1;
+		ret = batch_write (&batch, slot_size, peers[i], slot,
+				   remote_buf[peers[i]].addr + off,
+				   remote_buf[peers[i]].rkey);
+		check (ret == 0, "thread[%ld]: failed to post write", thread_id);
+		ring->send_seq += 1;
+		continue;
+	    }
+
+	    char *payload = req_buf + (size_t)(req_seq++ % num_req_bufs) * recv_size;
+
+	    /* the server acks with the descriptor, which is then */
+	    /* sent again as is                                    */
+	    if (rndv && (app_src != true)) {
+		struct RndvDesc *desc = (struct RndvDesc *)payload;
+		struct PoolBuf  *src  = rndv_src[i * window + j];
+
+		desc->tag  = 0;
+		desc->addr = (uint64_t)src->addr;
+		desc->rkey = src->mr->rkey;
+		desc->len  = msg_size;
+	    }
+	    if (app_src) {
+		struct RndvDesc *desc = (struct RndvDesc *)payload;
+		int              s    = i * window + j;
+		char            *src  = app_buf + (size_t)s * msg_size;
+
+		app_ent[s] = mrcache_get (mr_cache, src, msg_size);
+		check (app_ent[s] != NULL, "thread[%ld]: failed to register source",
+		       thread_id);
+		desc->tag  = 0;
+		desc->addr = (uint64_t)src;
+		desc->rkey = app_ent[s]->mr->rkey;
+		desc->len  = msg_size;
+	    }
+	    if (lat_mode) {
+		*(uint64_t *)payload = get_time_ns ();
+	    }
+	    if (rpc_mode) {
+		issue_rpc (rpc_slots, i * window + j, payload, msg_size, &rpc_seq);
+	    }
+	    ret = transport->send (&batch, send_size, rank, peers[i], payload);
 	    check (ret == 0, "thread[%ld]: failed to post send", thread_id);
-	    buf_offset = (buf_offset + msg_size) % buf_size;
-	    buf_ptr = buf_base + buf_offset;
 	}
     }
+    ret = transport->flush (&batch);
+    check (ret == 0, "thread[%ld]: failed to pre-post sends", thread_id);
 
     num_acked_peers = 0;
     while (stop != true) {
+        /* retry echoes deferred for lack of send credits */
+        if (backlog.num > 0) {
+            ret = flush_send_backlog (&backlog, &batch, recv_size);
+            check (ret == 0, "thread[%ld]: failed to flush send backlog", thread_id);
+        }
+
+        /* open loop: issue every request whose arrival time has */
+        /* passed, stamped with that time rather than the time it */
+        /* goes out, so waiting for a free window slot or a send  */
+        /* credit counts toward its latency                       */
+        now = get_time_ns ();
+        while (open_loop && (stop != true) && (next_arrival_ns (&arrivals) <= now)) {
+            int   p       = arrivals.next_peer;
+            char *payload = req_buf + (size_t)(req_seq++ % num_req_bufs) * recv_size;
+
+            for (j = 0; (j < num_peers) && (arrivals.num_inflight[p] >= window); j++) {
+                p = (p + 1) % num_peers;
+            }
+            if (j == num_peers) {
+                break;
+            }
+
+            *(uint64_t *)payload = next_arrival_ns (&arrivals);
+            ret = transport->send (&batch, msg_size, rank, peers[p], payload);
+            if (ret == EAGAIN) {
+                break;
+            }
+            check (ret == 0, "thread[%ld]: failed to post send", thread_id);
+
+            arrivals.num_inflight[p] += 1;
+            arrivals.next_peer = (p + 1) % num_peers;
+            advance_arrival (&arrivals);
+        }
+
         /* poll cq */
-        n = ibv_poll_cq (cq, num_wc, wc);
+        n = transport->poll (&batch, &waiter, num_wc, wc);
         if (n < 0) {
             check (0, "thread[%ld]: Failed to poll cq", thread_id);
         }
@@ -119,33 +408,212 @@ void *client_thread_func (void *arg)
                 }
             }
 
+            if (wc[i].opcode == IBV_WC_SEND) {
+                retire_send (sq_state, wc[i].wr_id);
+                continue;
+            }
+
 	    if (wc[i].opcode == IBV_WC_RECV) {
                 ops_count += 1;
                 debug ("ops_count = %ld", ops_count);
 
-                if (ops_count == NUM_WARMING_UP_OPS) {
+                if (ops_count == num_warmup_ops) {
                     gettimeofday (&start, NULL);
+                    cpu_start = get_thread_cpu_ns ();
                 }
 
-		imm_data = ntohl(wc[i].imm_data);
+		imm_data = batch_take_credits (&batch, ntohl(wc[i].imm_data));
 		char *msg_ptr = (char *)wc[i].wr_id;
+		char *payload = msg_ptr + batch.grh_size;
 
                 if (imm_data == MSG_CTL_STOP) {
 		    num_acked_peers += 1;
 		    if (num_acked_peers == num_peers) {
 			gettimeofday (&end, NULL);
+			cpu_end = get_thread_cpu_ns ();
 			stop = true;
+			ret = transport->recv (&batch, recv_size, msg_ptr);
+			check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
 			break;
 		    }
                 } else {
-		    /* echo the message back */
-		    post_send (msg_size, lkey, 0, imm_data, qp[imm_data], msg_ptr);
+		    /* ud names the server by its source address and qp */
+		    if (ud_mode) {
+			int peer = ud_lookup_peer (&wc[i], msg_ptr);
+			check (peer >= 0, "thread[%ld]: datagram from unknown qp %"PRIu32"",
+			       thread_id, wc[i].src_qp);
+			imm_data = peer;
+		    }
+
+		    /* the payload carries the send timestamp of the request */
+		    if (lat_mode) {
+			now = get_time_ns ();
+			if (ops_count > num_warmup_ops) {
+			    hist_record (&lat_hist[peer_local_index (imm_data)],
+					 now - *(uint64_t *)payload);
+			}
+			*(uint64_t *)payload = now;
+		    }
+
+		    /* rpc: match the reply to its request by req_id and */
+		    /* issue the next request of the slot in its buffer   */
+		    if (rpc_mode) {
+			struct RPCHeader *hdr  = (struct RPCHeader *)payload;
+			uint32_t          slot = (uint32_t)hdr->req_id;
+
+			check ((slot < num_peers * window) &&
+			       (rpc_slots[slot].req_id == hdr->req_id) &&
+			       (hdr->opcode < RPC_MAX_OPS),
+			       "thread[%ld]: reply to unknown request %"PRIx64"",
+			       thread_id, hdr->req_id);
+			if (ops_count > num_warmup_ops) {
+			    struct RPCStats *st = &rpc_stats[hdr->opcode];
+
+			    st->count      += 1;
+			    st->num_errors += (hdr->status != RPC_STATUS_OK);
+			    hist_record (&st->lat_hist,
+					 get_time_ns () - rpc_slots[slot].issue_ns);
+			}
+			issue_rpc (rpc_slots, slot, payload, msg_size, &rpc_seq);
+		    }
+
+		    /* the server is done with the source: hand it back to the */
+		    /* cache and look it up again for the next descriptor      */
+		    if (app_src) {
+			struct RndvDesc *desc = (struct RndvDesc *)payload;
+			int              s    = (desc->addr - (uint64_t)app_buf) / msg_size;
+
+			check ((desc->addr >= (uint64_t)app_buf) && (s < num_peers * window),
+			       "thread[%ld]: ack for unknown source %"PRIx64"",
+			       thread_id, desc->addr);
+			mrcache_put (mr_cache, app_ent[s]);
+			app_ent[s] = mrcache_get (mr_cache, (char *)desc->addr, msg_size);
+			check (app_ent[s] != NULL, "thread[%ld]: failed to register source",
+			       thread_id);
+			desc->rkey = app_ent[s]->mr->rkey;
+		    }
+
+		    /* open loop: the echo only frees its window slot */
+		    if (open_loop) {
+			arrivals.num_inflight[peer_local_index (imm_data)] -= 1;
+			ret = transport->recv (&batch, recv_size, msg_ptr);
+			check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
+			batch_grant (&batch, imm_data);
+			continue;
+		    }
+
+		    /* echo the message back; imm_data is the server rank */
+		    ret = transport->send (&batch, send_size, rank, imm_data, payload);
+		    if (ret == EAGAIN) {
+			/* the recv buffer is reposted once the echo goes out */
+			push_send_backlog (&backlog, msg_ptr, imm_data, rank, send_size);
+			continue;
+		    }
+		    check (ret == 0, "thread[%ld]: failed to echo to peer[%"PRIu32"]",
+			   thread_id, imm_data);
 		}
 
-                /* post a new receive */
-		ret = post_srq_recv (msg_size, lkey, wc[i].wr_id, srq, msg_ptr);
+                /* post a new receive; control msgs come out of the */
+                /* reserve and earn the server no credit            */
+		ret = transport->recv (&batch, recv_size, msg_ptr);
+		check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
+		if (imm_data != MSG_CTL_STOP) {
+		    batch_grant (&batch, imm_data);
+		}
             }
         } /* loop through all wc */
+
+        /* write transport: consume at most one echo per peer ring and */
+        /* pass and answer it through the matching send ring slot      */
+        for (i = 0; write_mode && (stop != true) && (i < num_peers); i++) {
+            struct PeerRing *ring     = &rings[peers[i]];
+            char            *slot     = ring->recv_ring +
+                ring_slot_offset (ring->recv_seq, num_concurr_msgs, slot_size);
+            size_t           send_off = ring_slot_offset (ring->send_seq,
+                                                          num_concurr_msgs, slot_size);
+            char            *send_slot = ring->send_ring + send_off;
+            uint64_t         now       = 0;
+
+            if (!ring_slot_ready (slot, slot_size, ring->recv_seq)) {
+                continue;
+            }
+
+            memcpy (send_slot, slot, msg_size);
+            if (lat_mode) {
+                now = get_time_ns ();
+                *(uint64_t *)send_slot = now;
+            }
+            *ring_slot_seq (send_slot, slot_size) = ring->send_seq + 1;
+
+            /* out of credits: the echo stays unconsumed until next pass */
+            ret = batch_write (&batch, slot_size, peers[i], send_slot,
+                               remote_buf[peers[i]].addr + send_off,
+                               remote_buf[peers[i]].rkey);
+            if (ret == EAGAIN) {
+                continue;
+            }
+            check (ret == 0, "thread[%ld]: failed to write to peer[%d]",
+                   thread_id, peers[i]);
+
+            ops_count += 1;
+            if (ops_count == num_warmup_ops) {
+                gettimeofday (&start, NULL);
+                cpu_start = get_thread_cpu_ns ();
+            }
+            if (lat_mode && (ops_count > num_warmup_ops)) {
+                hist_record (&lat_hist[i], now - *(uint64_t *)slot);
+            }
+            ring->recv_seq += 1;
+            ring->send_seq += 1;
+        }
+
+        /* one doorbell per qp and one for the srq per poll batch */
+        ret = transport->flush (&batch);
+        check (ret == 0, "thread[%ld]: failed to flush post batch", thread_id);
+    }
+
+    /* echoes still waiting for credits are dropped */
+    ret = discard_send_backlog (&backlog, &batch, recv_size);
+    check (ret == 0, "thread[%ld]: failed to discard send backlog", thread_id);
+
+    /* DONE goes out behind our last request on every qp, once it */
+    /* completed nothing of this run is left in flight            */
+    for (i = 0; i < num_peers; i++) {
+	ret = transport->ctl_send (&batch, peers[i], IB_WR_ID_STOP, MSG_CTL_DONE);
+	check (ret == 0, "thread[%ld]: failed to tell server[%d] we are done",
+	       thread_id, peers[i]);
+    }
+
+    num_acked_peers = 0;
+    while (num_acked_peers < num_peers) {
+	n = transport->poll (&batch, &waiter, num_wc, wc);
+	check (n >= 0, "thread[%ld]: Failed to poll cq", thread_id);
+
+	for (i = 0; i < n; i++) {
+	    check (wc[i].status == IBV_WC_SUCCESS, "thread[%ld]: wc failed status: %s.",
+		   thread_id, ibv_wc_status_str(wc[i].status));
+
+	    if (wc[i].opcode == IBV_WC_SEND) {
+		if (wc[i].wr_id == IB_WR_ID_STOP) {
+		    num_acked_peers += 1;
+		} else {
+		    retire_send (sq_state, wc[i].wr_id);
+		}
+		continue;
+	    }
+
+	    /* the server may already be starting the next run */
+	    if (wc[i].opcode == IBV_WC_RECV) {
+		if (ntohl(wc[i].imm_data) == MSG_CTL_START) {
+		    tres->num_early_starts += 1;
+		}
+		ret = transport->recv (&batch, recv_size, (char *)wc[i].wr_id);
+		check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
+	    }
+	}
+
+	ret = transport->flush (&batch);
+	check (ret == 0, "thread[%ld]: failed to flush post batch", thread_id);
     }
 
     /* dump statistics */
@@ -153,22 +621,389 @@ void *client_thread_func (void *arg)
 			  (end.tv_usec - start.tv_usec));
     throughput = (double)(ops_count) / duration;
     log ("thread[%ld]: throughput = %f (Mops/s)",  thread_id, throughput);
+    if (open_loop) {
+	log ("thread[%ld]: offered = %f (Mops/s)", thread_id,
+	     1000.0 / arrivals.gap_ns);
+    }
+    if (rpc_mode) {
+	char name[32];
+
+	sprintf (name, "thread[%ld]", thread_id);
+	rpc_set_duration (rpc_stats, duration);
+	rpc_log_stats (name, rpc_stats);
+    }
+    log_thread_cpu (thread_id, cpu_end - cpu_start, duration,
+		    ops_count - num_warmup_ops, &waiter);
+
+    log_post_batch (thread_id, &batch);
+    if (rndv && (app_src != true)) {
+	log ("thread[%ld]: rendezvous pool: %ld buffers, %zu bytes registered",
+	     thread_id, tres->pool.num_bufs, tres->pool.num_bytes);
+    }
+    if (app_src) {
+	char name[32];
+
+	sprintf (name, "thread[%ld]", thread_id);
+	mrcache_log (name, mr_cache);
+    }
+
+    if (lat_mode) {
+	char name[64];
+
+	for (i = 0; i < num_peers; i++) {
+	    sprintf (name, "thread[%ld]: server[%d] latency", thread_id, peers[i]);
+	    hist_log (name, &lat_hist[i]);
+	    hist_merge (&lat_hist[num_peers], &lat_hist[i]);
+	}
+	sprintf (name, "thread[%ld]: latency", thread_id);
+	hist_log (name, &lat_hist[num_peers]);
+    }
+
+    tres->ops_count  = ops_count;
+    tres->throughput = throughput;
 
     free (wc);
+    free (req_buf);
+    free (arrivals.num_inflight);
+    free (rpc_slots);
+    for (i = 0; (rndv_src != NULL) && (i < num_peers * window); i++) {
+	pool_put (&tres->pool, rndv_src[i]);
+    }
+    free (rndv_src);
+    release_app_sources (mr_cache, app_buf, app_ent, num_peers * window, msg_size);
+    destroy_cq_waiter (&waiter, cq);
+    destroy_send_backlog (&backlog);
+    destroy_post_batch (&batch);
     pthread_exit ((void *)0);
 
  error:
     if (wc != NULL) {
     	free (wc);
     }
+    if (req_buf != NULL) {
+	free (req_buf);
+    }
+    if (arrivals.num_inflight != NULL) {
+	free (arrivals.num_inflight);
+    }
+    if (rpc_slots != NULL) {
+	free (rpc_slots);
+    }
+    if (rndv_src != NULL) {
+	for (i = 0; i < num_peers * window; i++) {
+	    if (rndv_src[i] != NULL) {
+		pool_put (&tres->pool, rndv_src[i]);
+	    }
+	}
+	free (rndv_src);
+    }
+    release_app_sources (mr_cache, app_buf, app_ent, num_peers * window, msg_size);
+    destroy_cq_waiter (&waiter, cq);
+    destroy_send_backlog (&backlog);
+    destroy_post_batch (&batch);
+    pthread_exit ((void *)-1);
+}
+
+static int issue_onesided_op (struct PostBatch *b, int workload, int msg_size,
+			      uint32_t peer, uint16_t slot, char *buf,
+			      uint64_t remote_addr, uint32_t rkey,
+			      uint64_t expected)
+{
+    switch (workload) {
+    case WORKLOAD_READ:
+	return batch_read (b, msg_size, peer, slot, buf, remote_addr, rkey);
+    case WORKLOAD_FETCH_ADD:
+	return batch_atomic (b, IBV_WR_ATOMIC_FETCH_AND_ADD, peer, slot, buf,
+			     remote_addr, rkey, 1, 0);
+    default:
+	return batch_atomic (b, IBV_WR_ATOMIC_CMP_AND_SWP, peer, slot, buf,
+			     remote_addr, rkey, expected, expected + 1);
+    }
+}
+
+/*
+ *  client_onesided_thread_func:
+ *       drive read, fetch_add or cmp_swp against the servers' target
+ *       buffers; every op is signaled, carries its slot in the wr_id
+ *       and the slot is reissued as soon as the op completes
+ */
+void *client_onesided_thread_func (void *arg)
+{
+    int         ret		 = 0, n = 0, i = 0, j = 0;
+    long	thread_id	 = (long) arg;
+    int         msg_size	 = config_info.msg_size;
+    long        num_ops          = config_info.num_ops;
+    long        num_warmup_ops   = config_info.num_warmup_ops;
+    int         num_concurr_msgs = config_info.num_concurr_msgs;
+    int         workload         = config_info.workload;
+    int         num_counters     = config_info.num_counters;
+    struct ThreadRes *tres       = &ib_res.thread_res[thread_id];
+    int         num_peers        = tres->num_peers;
+    int        *peers            = tres->peers;
+
+    pthread_t   self;
+    cpu_set_t   cpuset;
+
+    int                  num_wc		= config_info.batch_size;
+    struct ibv_qp	**qp		= ib_res.qp;
+    struct ibv_cq       *cq		= tres->cq;
+    struct ibv_srq      *srq            = tres->srq;
+    struct ibv_wc       *wc		= NULL;
+    uint32_t             lkey           = tres->rail->mr->lkey;
+    struct QPSendState  *sq_state       = ib_res.sq_state;
+    struct RemoteBuf    *remote_buf     = ib_res.remote_buf;
+    size_t               stride         = ib_res.target_stride;
+    struct PostBatch     batch          = {0};
+    struct CQWaiter      waiter         = {.epfd = -1};
+
+    bool                 lat_mode       = (config_info.mode == MODE_LATENCY);
+    int                  window         = num_concurr_msgs;
+    struct LatHist      *lat_hist       = NULL;
+    uint64_t            *op_ts          = NULL;  /* per slot issue time */
+    uint32_t            *op_target      = NULL;  /* per slot counter index */
+    uint64_t            *last_seen      = NULL;  /* cmp_swp: per peer and counter */
+    uint64_t             rand_state     = 0x9E3779B97F4A7C15ULL ^
+	((uint64_t)config_info.rank << 32) ^ (uint64_t)(thread_id + 1);
+    long                 num_cas_ok     = 0;
+
+    char		*buf_base	= tres->buf;
+    int			num_acked_peers = 0;
+    bool		start_sending	= false;
+    bool		issuing		= true;
+    bool		stop		= false;
+    struct timeval      start, end;
+    long                ops_count	= 0;
+    uint64_t            cpu_start       = 0, cpu_end = 0;
+    double              duration	= 0.0;
+    double              throughput	= 0.0;
+
+    /* set thread affinity */
+    CPU_ZERO (&cpuset);
+    CPU_SET  (tres->cpu, &cpuset);
+    self = pthread_self ();
+    ret  = pthread_setaffinity_np (self, sizeof(cpu_set_t), &cpuset);
+    check (ret == 0, "thread[%ld]: failed to set thread affinity", thread_id);
+
+    wc = (struct ibv_wc *) calloc (num_wc, sizeof(struct ibv_wc));
+    check (wc != NULL, "thread[%ld]: failed to allocate wc.", thread_id);
+    log_thread_placement (thread_id, wc);
+    trace_thread_start (thread_id);
+
+    ret = init_thread_cq_waiter (&waiter, thread_id);
+    check (ret == 0, "thread[%ld]: failed to init cq waiter", thread_id);
+
+    if (lat_mode) {
+	window = config_info.latency_window;
+    }
+
+    lat_hist  = (struct LatHist *) malloc ((num_peers + 1) * sizeof(struct LatHist));
+    op_ts     = (uint64_t *) calloc (num_peers * num_concurr_msgs, sizeof(uint64_t));
+    op_target = (uint32_t *) calloc (num_peers * num_concurr_msgs, sizeof(uint32_t));
+    last_seen = (uint64_t *) calloc (num_peers * num_counters, sizeof(uint64_t));
+    check ((lat_hist != NULL) && (op_ts != NULL) && (op_target != NULL) &&
+	   (last_seen != NULL), "thread[%ld]: failed to allocate op state", thread_id);
+    for (i = 0; i <= num_peers; i++) {
+	hist_init (&lat_hist[i]);
+    }
+    tres->lat_hist = lat_hist;
+
+    ret = init_post_batch (&batch, config_info.batch_size, lkey,
+			   ib_res.inline_threshold, qp, sq_state,
+			   ib_res.num_qps, srq);
+    check (ret == 0, "thread[%ld]: failed to allocate post batch", thread_id);
+
+    /* pre-post recvs for the control messages */
+    for (i = 0; i < num_peers; i++) {
+	ret = batch_recv (&batch, msg_size, buf_base + i * num_concurr_msgs * msg_size);
+	check (ret == 0, "thread[%ld]: failed to pre-post recv", thread_id);
+    }
+    ret = flush_post_batch (&batch);
+    check (ret == 0, "thread[%ld]: failed to pre-post recvs", thread_id);
+
+    /* wait for start signal */
+    while (start_sending != true) {
+	n = wait_poll_cq (&waiter, cq, num_wc, wc);
+	check (n >= 0, "thread[%ld]: failed to poll cq", thread_id);
+
+	for (i = 0; i < n; i++) {
+	    check (wc[i].status == IBV_WC_SUCCESS, "thread[%ld]: wc failed status: %s.",
+		   thread_id, ibv_wc_status_str(wc[i].status));
+	    if ((wc[i].opcode == IBV_WC_RECV) &&
+		(ntohl(wc[i].imm_data) == MSG_CTL_START)) {
+		num_acked_peers += 1;
+	    }
+	}
+	start_sending = (num_acked_peers == num_peers);
+    }
+    log ("thread[%ld]: ready to send", thread_id);
+
+    /* slot j of the i-th peer lands its result at */
+    /* buf_base + (i * num_concurr_msgs + j) * msg_size */
+    for (i = 0; i < num_peers; i++) {
+	for (j = 0; j < window; j++) {
+	    int slot = i * num_concurr_msgs + j;
+
+	    op_target[slot] = xorshift64 (&rand_state) % num_counters;
+	    op_ts[slot]     = get_time_ns ();
+	    ret = issue_onesided_op (&batch, workload, msg_size, peers[i], j,
+				     buf_base + slot * msg_size,
+				     remote_buf[peers[i]].addr + op_target[slot] * stride,
+				     remote_buf[peers[i]].rkey,
+				     last_seen[i * num_counters + op_target[slot]]);
+	    check (ret == 0, "thread[%ld]: failed to issue op", thread_id);
+	}
+    }
+    ret = flush_post_batch (&batch);
+    check (ret == 0, "thread[%ld]: failed to issue ops", thread_id);
+
+    num_acked_peers = 0;
+    while (stop != true) {
+	n = wait_poll_cq (&waiter, cq, num_wc, wc);
+	check (n >= 0, "thread[%ld]: Failed to poll cq", thread_id);
+	TRACE_POLL (wc, n);
+
+	for (i = 0; i < n; i++) {
+	    check (wc[i].status == IBV_WC_SUCCESS,
+		   "thread[%ld]: wc failed status: %s; wr_id = %"PRIx64"",
+		   thread_id, ibv_wc_status_str(wc[i].status), wc[i].wr_id);
+
+	    if (wc[i].opcode == IBV_WC_SEND) {
+		if (wc[i].wr_id == IB_WR_ID_STOP) {
+		    num_acked_peers += 1;
+		    stop = (num_acked_peers == num_peers);
+		}
+		continue;
+	    }
+	    if ((wc[i].opcode != IBV_WC_RDMA_READ) &&
+		(wc[i].opcode != IBV_WC_FETCH_ADD) &&
+		(wc[i].opcode != IBV_WC_COMP_SWAP)) {
+		continue;
+	    }
+
+	    retire_send (sq_state, wc[i].wr_id);
+
+	    uint32_t peer  = IB_WR_ID_SIG_PEER(wc[i].wr_id);
+	    int      local = peer_local_index (peer);
+	    int      slot  = local * num_concurr_msgs + IB_WR_ID_SIG_SLOT(wc[i].wr_id);
+	    char    *buf   = buf_base + slot * msg_size;
+	    uint64_t now   = get_time_ns ();
+
+	    ops_count += 1;
+	    if (ops_count == num_warmup_ops) {
+		gettimeofday (&start, NULL);
+		cpu_start = get_thread_cpu_ns ();
+	    }
+	    if (ops_count > num_warmup_ops) {
+		hist_record (&lat_hist[local], now - op_ts[slot]);
+	    }
+
+	    /* cmp_swp succeeded iff the old value matched the compare value */
+	    if (workload == WORKLOAD_CMP_SWP) {
+		uint64_t *seen = &last_seen[local * num_counters + op_target[slot]];
+		uint64_t  old  = *(uint64_t *)buf;
+
+		if (old == *seen) {
+		    num_cas_ok += 1;
+		    *seen = old + 1;
+		} else {
+		    *seen = old;
+		}
+	    }
+
+	    if (ops_count == num_ops) {
+		gettimeofday (&end, NULL);
+		cpu_end = get_thread_cpu_ns ();
+		issuing = false;
+
+		/* ops re-issued earlier in this pass still sit in the */
+		/* batch; ring them first so that each stop send       */
+		/* completes after every op queued before it           */
+		ret = flush_post_batch (&batch);
+		check (ret == 0, "thread[%ld]: failed to flush post batch", thread_id);
+		for (j = 0; j < num_peers; j++) {
+		    ret = post_send (0, lkey, IB_WR_ID_STOP, MSG_CTL_STOP,
+				     qp[peers[j]], buf_base);
+		    check (ret == 0, "thread[%ld]: failed to signal server to stop",
+			   thread_id);
+		}
+	    }
+	    if (issuing != true) {
+		continue;
+	    }
+
+	    op_target[slot] = xorshift64 (&rand_state) % num_counters;
+	    op_ts[slot]     = now;
+	    ret = issue_onesided_op (&batch, workload, msg_size, peer,
+				     IB_WR_ID_SIG_SLOT(wc[i].wr_id), buf,
+				     remote_buf[peer].addr + op_target[slot] * stride,
+				     remote_buf[peer].rkey,
+				     last_seen[local * num_counters + op_target[slot]]);
+	    check (ret == 0, "thread[%ld]: failed to issue op", thread_id);
+	}
+
+	ret = flush_post_batch (&batch);
+	check (ret == 0, "thread[%ld]: failed to flush post batch", thread_id);
+    }
+
+    /* dump statistics */
+    duration   = (double)((end.tv_sec - start.tv_sec) * 1000000 +
+			  (end.tv_usec - start.tv_usec));
+    throughput = (double)(ops_count) / duration;
+    log ("thread[%ld]: throughput = %f (Mops/s)",  thread_id, throughput);
+    log_thread_cpu (thread_id, cpu_end - cpu_start, duration,
+		    ops_count - num_warmup_ops, &waiter);
+    if (workload == WORKLOAD_CMP_SWP) {
+	log ("thread[%ld]: cmp_swp succeeded %ld of %ld (%.2f%%)", thread_id,
+	     num_cas_ok, ops_count, 100.0 * num_cas_ok / ops_count);
+    }
+
+    if (lat_mode) {
+	char name[64];
+
+	for (i = 0; i < num_peers; i++) {
+	    sprintf (name, "thread[%ld]: server[%d] latency", thread_id, peers[i]);
+	    hist_log (name, &lat_hist[i]);
+	}
+    }
+    for (i = 0; i < num_peers; i++) {
+	hist_merge (&lat_hist[num_peers], &lat_hist[i]);
+    }
+    if (lat_mode) {
+	char name[64];
+
+	sprintf (name, "thread[%ld]: latency", thread_id);
+	hist_log (name, &lat_hist[num_peers]);
+    }
+
+    tres->ops_count  = ops_count;
+    tres->throughput = throughput;
+
+    free (wc);
+    destroy_cq_waiter (&waiter, cq);
+    free (op_ts);
+    free (op_target);
+    free (last_seen);
+    destroy_post_batch (&batch);
+    pthread_exit ((void *)0);
+
+ error:
+    if (wc != NULL) {
+	free (wc);
+    }
+    destroy_cq_waiter (&waiter, cq);
+    free (op_ts);
+    free (op_target);
+    free (last_seen);
+    destroy_post_batch (&batch);
     pthread_exit ((void *)-1);
 }
 
 int run_client ()
 {
     int		ret	    = 0;
-    long	num_threads = 1;
+    long	num_threads = ib_res.num_threads;
     long	i	    = 0;
+    double	tot_throughput = 0.0;
     
     pthread_t	   *client_threads = NULL;
     pthread_attr_t  attr;
@@ -184,8 +1019,13 @@ int run_client ()
     check (client_threads != NULL, "Failed to allocate client_threads.");
 
     for (i = 0; i < num_threads; i++) {
-	ret = pthread_create (&client_threads[i], &attr, 
-			      client_thread_func, (void *)i);
+	if (config_info.workload == WORKLOAD_ECHO) {
+	    ret = pthread_create (&client_threads[i], &attr, 
+				  client_thread_func, (void *)i);
+	} else {
+	    ret = pthread_create (&client_threads[i], &attr,
+				  client_onesided_thread_func, (void *)i);
+	}
 	check (ret == 0, "Failed to create client_thread[%ld]", i);
     }
 
@@ -203,6 +1043,31 @@ int run_client ()
         goto error;
     }
 
+    for (i = 0; i < num_threads; i++) {
+	tot_throughput += ib_res.thread_res[i].throughput;
+    }
+    log ("aggregate: %ld threads, throughput = %f (Mops/s)",
+	 num_threads, tot_throughput);
+    log_aggregate_rails ();
+    log_rnr_events ();
+    log_aggregate_cpu ();
+    if (config_info.num_rpc_ops > 0) {
+	log_aggregate_rpc ();
+    }
+
+    if (config_info.mode == MODE_LATENCY) {
+	struct LatHist *tot_hist = (struct LatHist *) malloc (sizeof(struct LatHist));
+	check (tot_hist != NULL, "Failed to allocate tot_hist.");
+
+	hist_init (tot_hist);
+	for (i = 0; i < num_threads; i++) {
+	    struct ThreadRes *tres = &ib_res.thread_res[i];
+	    hist_merge (tot_hist, &tres->lat_hist[tres->num_peers]);
+	}
+	hist_log ("aggregate: latency", tot_hist);
+	free (tot_hist);
+    }
+
     pthread_attr_destroy (&attr);
     free (client_threads);
     return 0;
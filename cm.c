@@ -0,0 +1,223 @@
+#include <netdb.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "config.h"
+#include "stats.h"
+#include "cm.h"
+
+struct CMRes cm_res;
+
+/* blocking; the caller acks the event */
+int cm_get_event (struct rdma_cm_event **event)
+{
+    int ret = rdma_get_cm_event (cm_res.channel, event);
+
+    check (ret == 0, "Failed to get cm event");
+    return 0;
+ error:
+    return -1;
+}
+
+/* server: listen on every device; requests are checked against */
+/* the first device, the same one the socket bootstrap opens    */
+static int cm_listen ()
+{
+    int                 ret  = 0;
+    struct sockaddr_in  addr = {
+	.sin_family      = AF_INET,
+	.sin_port        = htons ((uint16_t) atoi (config_info.sock_port)),
+	.sin_addr.s_addr = htonl (INADDR_ANY),
+    };
+
+    ret = rdma_create_id (cm_res.channel, &cm_res.listen_id, NULL, RDMA_PS_TCP);
+    check (ret == 0, "Failed to create cm listen id");
+
+    ret = rdma_bind_addr (cm_res.listen_id, (struct sockaddr *)&addr);
+    check (ret == 0, "Failed to bind cm listen id to port %s", config_info.sock_port);
+
+    ret = rdma_listen (cm_res.listen_id, SOMAXCONN);
+    check (ret == 0, "Failed to listen on cm id");
+
+    return 0;
+ error:
+    return -1;
+}
+
+/* client: resolve the address and route of every server at once; */
+/* the event loop advances whichever resolution finishes first     */
+static int cm_resolve ()
+{
+    int               ret          = 0, i = 0;
+    int               num_resolved = 0;
+    uint64_t          start_ns     = get_time_ns ();
+    struct addrinfo   hints        = {
+	.ai_family   = AF_INET,
+	.ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo      *result = NULL;
+    struct rdma_cm_event *event  = NULL;
+
+    for (i = 0; i < cm_res.num_ids; i++) {
+	ret = rdma_create_id (cm_res.channel, &cm_res.ids[i],
+			      (void *)(intptr_t)i, RDMA_PS_TCP);
+	check (ret == 0, "Failed to create cm id[%d]", i);
+
+	ret = getaddrinfo (config_info.servers[i], config_info.sock_port,
+			   &hints, &result);
+	check (ret == 0, "Failed to resolve %s: %s", config_info.servers[i],
+	       gai_strerror (ret));
+
+	ret = rdma_resolve_addr (cm_res.ids[i], NULL, result->ai_addr,
+				 CM_RESOLVE_TIMEOUT_MS);
+	freeaddrinfo (result);
+	check (ret == 0, "Failed to start address resolution of server[%d]", i);
+    }
+
+    while (num_resolved < cm_res.num_ids) {
+	ret = cm_get_event (&event);
+	check (ret == 0, "Failed to get cm event");
+
+	enum rdma_cm_event_type type = event->event;
+	struct rdma_cm_id      *id   = event->id;
+
+	rdma_ack_cm_event (event);
+	i = (int)(intptr_t)id->context;
+
+	if (type == RDMA_CM_EVENT_ADDR_RESOLVED) {
+	    ret = rdma_resolve_route (id, CM_RESOLVE_TIMEOUT_MS);
+	    check (ret == 0, "Failed to start route resolution of server[%d]", i);
+	} else if (type == RDMA_CM_EVENT_ROUTE_RESOLVED) {
+	    num_resolved += 1;
+	} else {
+	    check (0, "Failed to resolve server[%d]: %s", i, rdma_event_str (type));
+	}
+    }
+
+    cm_res.resolve_ns = get_time_ns () - start_ns;
+    return 0;
+ error:
+    return -1;
+}
+
+/*
+ *  cm_open_device:
+ *       set up rdma_cm and return the device context and port the
+ *       qps have to be created on; the context belongs to rdma_cm
+ *       and is released by cm_close, not ibv_close_device
+ */
+int cm_open_device (struct ibv_context **ctx, uint8_t *port_num)
+{
+    int ret         = 0, i = 0;
+    int num_devices = 0;
+
+    memset (&cm_res, 0, sizeof(struct CMRes));
+
+    cm_res.channel = rdma_create_event_channel ();
+    check (cm_res.channel != NULL, "Failed to create cm event channel");
+
+    cm_res.devices = rdma_get_devices (&num_devices);
+    check ((cm_res.devices != NULL) && (num_devices > 0),
+	   "Failed to get rdma_cm device list");
+
+    if (config_info.is_server) {
+	cm_res.num_ids = config_info.num_clients;
+    } else {
+	cm_res.num_ids = config_info.num_servers;
+    }
+    cm_res.ids = (struct rdma_cm_id **) calloc (cm_res.num_ids,
+						sizeof(struct rdma_cm_id *));
+    check (cm_res.ids != NULL, "Failed to allocate cm ids");
+
+    if (config_info.is_server) {
+	ret = cm_listen ();
+	check (ret == 0, "Failed to listen for clients");
+
+	*ctx      = cm_res.devices[0];
+	*port_num = IB_PORT;
+    } else {
+	ret = cm_resolve ();
+	check (ret == 0, "Failed to resolve servers");
+
+	/* all qps share one pd and the threads' cqs */
+	for (i = 1; i < cm_res.num_ids; i++) {
+	    check ((cm_res.ids[i]->verbs == cm_res.ids[0]->verbs) &&
+		   (cm_res.ids[i]->port_num == cm_res.ids[0]->port_num),
+		   "Failed to reach server[%d] through the port of server[0]", i);
+	}
+	*ctx      = cm_res.ids[0]->verbs;
+	*port_num = cm_res.ids[0]->port_num;
+    }
+
+    log ("rdma_cm: device %s, port %"PRIu8"", ibv_get_device_name ((*ctx)->device),
+	 *port_num);
+    return 0;
+ error:
+    return -1;
+}
+
+/*
+ *  cm_modify_qp_to_rts:
+ *       INIT, RTR and RTS with the path, psns and rd_atomic limits
+ *       the cm negotiated for id; a qp created outside rdma_cm is
+ *       only granted remote write and read, atomics are added here
+ */
+int cm_modify_qp_to_rts (struct rdma_cm_id *id, struct ibv_qp *qp)
+{
+    int                 ret   = 0, i = 0;
+    int                 mask  = 0;
+    struct ibv_qp_attr  qp_attr;
+    enum ibv_qp_state   state[] = {IBV_QPS_INIT, IBV_QPS_RTR, IBV_QPS_RTS};
+
+    for (i = 0; i < 3; i++) {
+	memset (&qp_attr, 0, sizeof(struct ibv_qp_attr));
+	qp_attr.qp_state = state[i];
+
+	ret = rdma_init_qp_attr (id, &qp_attr, &mask);
+	check (ret == 0, "Failed to get qp attributes from cm (state %d)", state[i]);
+
+	if (state[i] == IBV_QPS_INIT) {
+	    qp_attr.qp_access_flags |= IBV_ACCESS_LOCAL_WRITE |
+		                       IBV_ACCESS_REMOTE_READ |
+		                       IBV_ACCESS_REMOTE_WRITE |
+		                       IBV_ACCESS_REMOTE_ATOMIC;
+	}
+
+	ret = ibv_modify_qp (qp, &qp_attr, mask);
+	check (ret == 0, "Failed to modify qp (state %d)", state[i]);
+    }
+
+    return 0;
+ error:
+    return -1;
+}
+
+void cm_close ()
+{
+    int i = 0;
+
+    if (cm_res.ids != NULL) {
+	for (i = 0; i < cm_res.num_ids; i++) {
+	    if (cm_res.ids[i] != NULL) {
+		rdma_disconnect (cm_res.ids[i]);
+		rdma_destroy_id (cm_res.ids[i]);
+	    }
+	}
+	free (cm_res.ids);
+    }
+
+    if (cm_res.listen_id != NULL) {
+	rdma_destroy_id (cm_res.listen_id);
+    }
+
+    if (cm_res.devices != NULL) {
+	rdma_free_devices (cm_res.devices);
+    }
+
+    if (cm_res.channel != NULL) {
+	rdma_destroy_event_channel (cm_res.channel);
+    }
+}
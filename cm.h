@@ -0,0 +1,32 @@
+#ifndef CM_H_
+#define CM_H_
+
+#include <inttypes.h>
+#include <rdma/rdma_cma.h>
+
+#include "ib.h"
+
+#define CM_RESOLVE_TIMEOUT_MS	2000
+
+/* rdma_cm only carries the connections; the qps are created by */
+/* setup_ib on the device and port the cm resolved, and moved   */
+/* to rts with the attributes the cm hands out                  */
+struct CMRes {
+    struct rdma_event_channel	*channel;
+    struct rdma_cm_id		*listen_id;  /* server only */
+    struct rdma_cm_id	       **ids;        /* one per peer, by peer index */
+    int                          num_ids;
+    struct ibv_context	       **devices;    /* from rdma_get_devices */
+    uint64_t                     resolve_ns; /* client: address and route resolution */
+};
+
+extern struct CMRes cm_res;
+
+int  cm_open_device (struct ibv_context **ctx, uint8_t *port_num);
+void cm_close       ();
+
+int  cm_modify_qp_to_rts (struct rdma_cm_id *id, struct ibv_qp *qp);
+
+int  cm_get_event (struct rdma_cm_event **event);
+
+#endif /* CM_H_ */
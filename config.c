@@ -6,6 +6,10 @@
 
 #include "debug.h"
 #include "config.h"
+#include "ib.h"
+#include "rpc.h"
+#include "rndv.h"
+#include "topo.h"
 
 struct ConfigInfo config_info;
 
@@ -89,6 +93,52 @@ int parse_node_list (char *line, char ***node_list)
     return -1;
 }
 
+/*
+ *  parse_int_list:
+ *       get a comma separated list of positive integers
+ *
+ *  return value:
+ *       the number of integers in the list, -1 on error
+ */
+int parse_int_list (char *line, int **list)
+{
+    int   num  = 1, k = 0;
+    char *i    = line;
+    char *next = NULL;
+
+    for (i = line; *i != 0; i++) {
+        if (*i == ',') {
+            num += 1;
+        }
+    }
+
+    *list = (int *) calloc (num, sizeof(int));
+    check (*list != NULL, "Failed to allocate int list");
+
+    i = line;
+    for (k = 0; k < num; k++) {
+        (*list)[k] = (int) strtol (i, &next, 10);
+        check ((next != i) && ((*list)[k] > 0), "Invalid list entry: %s", i);
+        i = next + 1;
+    }
+
+    return num;
+ error:
+    return -1;
+}
+
+static int int_list_max (int *list, int num)
+{
+    int i = 0, max = 0;
+
+    for (i = 0; i < num; i++) {
+        if (list[i] > max) {
+            max = list[i];
+        }
+    }
+    return max;
+}
+
 int get_rank ()
 {
     int			ret	    = 0;
@@ -104,6 +154,13 @@ int get_rank ()
 
     strncpy (hostname, utsname_buf.nodename, sizeof(hostname));
 
+    /* several roles on one host, as the shm backend runs: the node */
+    /* name in the environment stands in for the hostname           */
+    if (getenv ("RDMA_TUTORIAL_NODE") != NULL) {
+        strncpy (hostname, getenv ("RDMA_TUTORIAL_NODE"), sizeof(hostname));
+    }
+    hostname[sizeof(hostname) - 1] = '\0';
+
     config_info.rank = -1;
     for (i = 0; i < num_servers; i++) {
         if (strstr(hostname, config_info.servers[i])) {
@@ -142,6 +199,34 @@ int parse_config_file (char *fname)
     fp = fopen (fname, "r");
     check (fp != NULL, "Failed to open config file %s", fname);
 
+    /* default values */
+    config_info.num_threads  = 1;
+    config_info.sig_interval = SIG_INTERVAL;
+    config_info.batch_size   = 20;
+    config_info.inline_threshold = -1;
+    config_info.mode             = MODE_THROUGHPUT;
+    config_info.latency_window   = 1;
+    config_info.transport        = TRANSPORT_SEND;
+    config_info.workload         = WORKLOAD_ECHO;
+    config_info.num_counters     = 1;
+    config_info.poll_mode        = POLL_BUSY;
+    config_info.poll_budget_us   = 50;
+    config_info.num_ops          = TOT_NUM_OPS;
+    config_info.num_warmup_ops   = NUM_WARMING_UP_OPS;
+    config_info.eager_threshold  = 0;
+    config_info.mr_cache         = 0;
+    config_info.flow_control     = -1;	/* derived below */
+    config_info.arrival          = ARRIVAL_CLOSED;
+    config_info.arrival_rate     = 0;
+    config_info.sweep_format     = SWEEP_CSV;
+    config_info.hugepages        = HUGEPAGES_NONE;
+    config_info.sq_depth         = 0;
+    config_info.srq_depth        = 0;
+    config_info.cq_depth         = 0;
+    config_info.connect_mode     = CONNECT_SOCK;
+    config_info.gid_index        = -1;
+    config_info.backend          = BACKEND_IB;
+
     while (fgets(line, 128, fp) != NULL) {
         // skip comments
         if (strstr(line, "#") != NULL) {
@@ -162,6 +247,105 @@ int parse_config_file (char *fname)
         } else if (strstr (line, "num_concurr_msgs:")) {
             attr = ATTR_NUM_CONCURR_MSGS;
             continue;
+        } else if (strstr (line, "num_threads:")) {
+            attr = ATTR_NUM_THREADS;
+            continue;
+        } else if (strstr (line, "sig_interval:")) {
+            attr = ATTR_SIG_INTERVAL;
+            continue;
+        } else if (strstr (line, "batch_size:")) {
+            attr = ATTR_BATCH_SIZE;
+            continue;
+        } else if (strstr (line, "inline_threshold:")) {
+            attr = ATTR_INLINE_THRESHOLD;
+            continue;
+        } else if (strstr (line, "latency_window:")) {
+            attr = ATTR_LATENCY_WINDOW;
+            continue;
+        } else if (strstr (line, "workload:")) {
+            attr = ATTR_WORKLOAD;
+            continue;
+        } else if (strstr (line, "num_counters:")) {
+            attr = ATTR_NUM_COUNTERS;
+            continue;
+        } else if (strstr (line, "num_warmup_ops:")) {
+            attr = ATTR_NUM_WARMUP_OPS;
+            continue;
+        } else if (strstr (line, "num_ops:")) {
+            attr = ATTR_NUM_OPS;
+            continue;
+        } else if (strstr (line, "sweep_msg_sizes:")) {
+            attr = ATTR_SWEEP_MSG_SIZES;
+            continue;
+        } else if (strstr (line, "sweep_windows:")) {
+            attr = ATTR_SWEEP_WINDOWS;
+            continue;
+        } else if (strstr (line, "eager_threshold:")) {
+            attr = ATTR_EAGER_THRESHOLD;
+            continue;
+        } else if (strstr (line, "mr_cache:")) {
+            attr = ATTR_MR_CACHE;
+            continue;
+        } else if (strstr (line, "flow_control:")) {
+            attr = ATTR_FLOW_CONTROL;
+            continue;
+        } else if (strstr (line, "rpc_ops:")) {
+            attr = ATTR_RPC_OPS;
+            continue;
+        } else if (strstr (line, "sweep_rates:")) {
+            attr = ATTR_SWEEP_RATES;
+            continue;
+        } else if (strstr (line, "arrival_rate:")) {
+            attr = ATTR_ARRIVAL_RATE;
+            continue;
+        } else if (strstr (line, "arrival:")) {
+            attr = ATTR_ARRIVAL;
+            continue;
+        } else if (strstr (line, "sweep_format:")) {
+            attr = ATTR_SWEEP_FORMAT;
+            continue;
+        } else if (strstr (line, "srq_depth:")) {
+            attr = ATTR_SRQ_DEPTH;
+            continue;
+        } else if (strstr (line, "sq_depth:")) {
+            attr = ATTR_SQ_DEPTH;
+            continue;
+        } else if (strstr (line, "cq_depth:")) {
+            attr = ATTR_CQ_DEPTH;
+            continue;
+        } else if (strstr (line, "hugepages:")) {
+            attr = ATTR_HUGEPAGES;
+            continue;
+        } else if (strstr (line, "poll_mode:")) {
+            attr = ATTR_POLL_MODE;
+            continue;
+        } else if (strstr (line, "poll_budget_us:")) {
+            attr = ATTR_POLL_BUDGET_US;
+            continue;
+        } else if (strstr (line, "backend:")) {
+            attr = ATTR_BACKEND;
+            continue;
+        } else if (strstr (line, "gid_index:")) {
+            attr = ATTR_GID_INDEX;
+            continue;
+        } else if (strstr (line, "cpus:")) {
+            attr = ATTR_CPUS;
+            continue;
+        } else if (strstr (line, "ib_devices:")) {
+            attr = ATTR_IB_DEVICES;
+            continue;
+        } else if (strstr (line, "trace_file:")) {
+            attr = ATTR_TRACE_FILE;
+            continue;
+        } else if (strstr (line, "connect_mode:")) {
+            attr = ATTR_CONNECT_MODE;
+            continue;
+        } else if (strstr (line, "transport:")) {
+            attr = ATTR_TRANSPORT;
+            continue;
+        } else if (strstr (line, "mode:")) {
+            attr = ATTR_MODE;
+            continue;
         }
 
 	if (attr == ATTR_SERVERS) {
@@ -182,11 +366,404 @@ int parse_config_file (char *fname)
             check (config_info.num_concurr_msgs > 0,
                    "Invalid Value: num_concurr_msgs = %d",
                    config_info.num_concurr_msgs);
+        } else if (attr == ATTR_NUM_THREADS) {
+            config_info.num_threads = atoi(line);
+            check (config_info.num_threads > 0,
+                   "Invalid Value: num_threads = %d",
+                   config_info.num_threads);
+        } else if (attr == ATTR_SIG_INTERVAL) {
+            config_info.sig_interval = atoi(line);
+            check (config_info.sig_interval > 0,
+                   "Invalid Value: sig_interval = %d",
+                   config_info.sig_interval);
+        } else if (attr == ATTR_BATCH_SIZE) {
+            config_info.batch_size = atoi(line);
+            check (config_info.batch_size > 0,
+                   "Invalid Value: batch_size = %d",
+                   config_info.batch_size);
+        } else if (attr == ATTR_INLINE_THRESHOLD) {
+            config_info.inline_threshold = atoi(line);
+            check (config_info.inline_threshold >= -1,
+                   "Invalid Value: inline_threshold = %d",
+                   config_info.inline_threshold);
+        } else if (attr == ATTR_MODE) {
+            if (strcmp (line, "throughput") == 0) {
+                config_info.mode = MODE_THROUGHPUT;
+            } else if (strcmp (line, "latency") == 0) {
+                config_info.mode = MODE_LATENCY;
+            } else {
+                check (0, "Invalid Value: mode = %s", line);
+            }
+        } else if (attr == ATTR_TRANSPORT) {
+            if (strcmp (line, "send") == 0) {
+                config_info.transport = TRANSPORT_SEND;
+            } else if (strcmp (line, "write") == 0) {
+                config_info.transport = TRANSPORT_WRITE;
+            } else if (strcmp (line, "ud") == 0) {
+                config_info.transport = TRANSPORT_UD;
+            } else {
+                check (0, "Invalid Value: transport = %s", line);
+            }
+        } else if (attr == ATTR_WORKLOAD) {
+            if (strcmp (line, "echo") == 0) {
+                config_info.workload = WORKLOAD_ECHO;
+            } else if (strcmp (line, "read") == 0) {
+                config_info.workload = WORKLOAD_READ;
+            } else if (strcmp (line, "fetch_add") == 0) {
+                config_info.workload = WORKLOAD_FETCH_ADD;
+            } else if (strcmp (line, "cmp_swp") == 0) {
+                config_info.workload = WORKLOAD_CMP_SWP;
+            } else {
+                check (0, "Invalid Value: workload = %s", line);
+            }
+        } else if (attr == ATTR_NUM_COUNTERS) {
+            config_info.num_counters = atoi(line);
+            check (config_info.num_counters > 0,
+                   "Invalid Value: num_counters = %d",
+                   config_info.num_counters);
+        } else if (attr == ATTR_POLL_MODE) {
+            if (strcmp (line, "busy") == 0) {
+                config_info.poll_mode = POLL_BUSY;
+            } else if (strcmp (line, "event") == 0) {
+                config_info.poll_mode = POLL_EVENT;
+            } else if (strcmp (line, "hybrid") == 0) {
+                config_info.poll_mode = POLL_HYBRID;
+            } else {
+                check (0, "Invalid Value: poll_mode = %s", line);
+            }
+        } else if (attr == ATTR_POLL_BUDGET_US) {
+            config_info.poll_budget_us = atoi(line);
+            check (config_info.poll_budget_us >= 0,
+                   "Invalid Value: poll_budget_us = %d",
+                   config_info.poll_budget_us);
+        } else if (attr == ATTR_NUM_OPS) {
+            config_info.num_ops = atol(line);
+            check (config_info.num_ops > 0,
+                   "Invalid Value: num_ops = %ld", config_info.num_ops);
+        } else if (attr == ATTR_NUM_WARMUP_OPS) {
+            config_info.num_warmup_ops = atol(line);
+            check (config_info.num_warmup_ops > 0,
+                   "Invalid Value: num_warmup_ops = %ld",
+                   config_info.num_warmup_ops);
+        } else if (attr == ATTR_SWEEP_MSG_SIZES) {
+            ret = parse_int_list (line, &config_info.sweep_sizes);
+            check (ret > 0, "Invalid Value: sweep_msg_sizes = %s", line);
+            config_info.num_sweep_sizes = ret;
+        } else if (attr == ATTR_SWEEP_WINDOWS) {
+            ret = parse_int_list (line, &config_info.sweep_windows);
+            check (ret > 0, "Invalid Value: sweep_windows = %s", line);
+            config_info.num_sweep_windows = ret;
+        } else if (attr == ATTR_EAGER_THRESHOLD) {
+            config_info.eager_threshold = atoi(line);
+            check (config_info.eager_threshold >= 0,
+                   "Invalid Value: eager_threshold = %d", config_info.eager_threshold);
+        } else if (attr == ATTR_MR_CACHE) {
+            config_info.mr_cache = atoi(line);
+            check (config_info.mr_cache >= 0,
+                   "Invalid Value: mr_cache = %d", config_info.mr_cache);
+        } else if (attr == ATTR_FLOW_CONTROL) {
+            if (strcmp (line, "credit") == 0) {
+                config_info.flow_control = FLOW_CREDIT;
+            } else if (strcmp (line, "rnr") == 0) {
+                config_info.flow_control = FLOW_RNR;
+            } else {
+                check (0, "Invalid Value: flow_control = %s", line);
+            }
+        } else if (attr == ATTR_RPC_OPS) {
+            ret = parse_int_list (line, &config_info.rpc_ops);
+            check (ret > 0, "Invalid Value: rpc_ops = %s", line);
+            config_info.num_rpc_ops = ret;
+        } else if (attr == ATTR_SWEEP_RATES) {
+            ret = parse_int_list (line, &config_info.sweep_rates);
+            check (ret > 0, "Invalid Value: sweep_rates = %s", line);
+            config_info.num_sweep_rates = ret;
+        } else if (attr == ATTR_ARRIVAL) {
+            if (strcmp (line, "closed") == 0) {
+                config_info.arrival = ARRIVAL_CLOSED;
+            } else if (strcmp (line, "fixed") == 0) {
+                config_info.arrival = ARRIVAL_FIXED;
+            } else if (strcmp (line, "poisson") == 0) {
+                config_info.arrival = ARRIVAL_POISSON;
+            } else {
+                check (0, "Invalid Value: arrival = %s", line);
+            }
+        } else if (attr == ATTR_ARRIVAL_RATE) {
+            config_info.arrival_rate = atoi(line);
+            check (config_info.arrival_rate > 0,
+                   "Invalid Value: arrival_rate = %d", config_info.arrival_rate);
+        } else if (attr == ATTR_SWEEP_FORMAT) {
+            if (strcmp (line, "csv") == 0) {
+                config_info.sweep_format = SWEEP_CSV;
+            } else if (strcmp (line, "json") == 0) {
+                config_info.sweep_format = SWEEP_JSON;
+            } else {
+                check (0, "Invalid Value: sweep_format = %s", line);
+            }
+        } else if (attr == ATTR_SQ_DEPTH) {
+            config_info.sq_depth = atoi(line);
+            check (config_info.sq_depth >= 0,
+                   "Invalid Value: sq_depth = %d", config_info.sq_depth);
+        } else if (attr == ATTR_SRQ_DEPTH) {
+            config_info.srq_depth = atoi(line);
+            check (config_info.srq_depth >= 0,
+                   "Invalid Value: srq_depth = %d", config_info.srq_depth);
+        } else if (attr == ATTR_CQ_DEPTH) {
+            config_info.cq_depth = atoi(line);
+            check (config_info.cq_depth >= 0,
+                   "Invalid Value: cq_depth = %d", config_info.cq_depth);
+        } else if (attr == ATTR_HUGEPAGES) {
+            if (strcmp (line, "none") == 0) {
+                config_info.hugepages = HUGEPAGES_NONE;
+            } else if (strcmp (line, "2m") == 0) {
+                config_info.hugepages = HUGEPAGES_2M;
+            } else if (strcmp (line, "1g") == 0) {
+                config_info.hugepages = HUGEPAGES_1G;
+            } else {
+                check (0, "Invalid Value: hugepages = %s", line);
+            }
+        } else if (attr == ATTR_BACKEND) {
+            if (strcmp (line, "ib") == 0) {
+                config_info.backend = BACKEND_IB;
+            } else if (strcmp (line, "shm") == 0) {
+                config_info.backend = BACKEND_SHM;
+            } else {
+                check (0, "Invalid Value: backend = %s", line);
+            }
+        } else if (attr == ATTR_GID_INDEX) {
+            config_info.gid_index = atoi(line);
+            check (config_info.gid_index >= -1,
+                   "Invalid Value: gid_index = %d", config_info.gid_index);
+        } else if (attr == ATTR_CPUS) {
+            ret = parse_cpu_list (line, &config_info.cpus);
+            check (ret > 0, "Invalid Value: cpus = %s", line);
+            config_info.num_cpus = ret;
+        } else if (attr == ATTR_IB_DEVICES) {
+            check (strlen (line) > 0, "Invalid Value: ib_devices is empty");
+            config_info.ib_devices = strdup (line);
+            check (config_info.ib_devices != NULL, "Failed to allocate ib_devices");
+        } else if (attr == ATTR_TRACE_FILE) {
+            check (strlen (line) > 0, "Invalid Value: trace_file is empty");
+            config_info.trace_file = strdup (line);
+            check (config_info.trace_file != NULL, "Failed to allocate trace_file");
+        } else if (attr == ATTR_CONNECT_MODE) {
+            if (strcmp (line, "sock") == 0) {
+                config_info.connect_mode = CONNECT_SOCK;
+            } else if (strcmp (line, "cm") == 0) {
+                config_info.connect_mode = CONNECT_CM;
+            } else {
+                check (0, "Invalid Value: connect_mode = %s", line);
+            }
+        } else if (attr == ATTR_LATENCY_WINDOW) {
+            config_info.latency_window = atoi(line);
+            check (config_info.latency_window > 0,
+                   "Invalid Value: latency_window = %d",
+                   config_info.latency_window);
         }
 
         attr = 0;
     }
 
+    check (config_info.num_warmup_ops < config_info.num_ops,
+           "Invalid Value: num_warmup_ops = %ld, must be below num_ops = %ld",
+           config_info.num_warmup_ops, config_info.num_ops);
+
+    /* open loop: requests are timestamped with their arrival time, */
+    /* the client spins between arrivals instead of sleeping        */
+    if (config_info.arrival != ARRIVAL_CLOSED) {
+        check ((config_info.workload == WORKLOAD_ECHO) &&
+               (config_info.transport != TRANSPORT_WRITE) &&
+               (config_info.poll_mode == POLL_BUSY),
+               "Invalid Value: open-loop arrival needs workload = echo, "
+               "transport = send or ud and poll_mode = busy");
+        check ((config_info.arrival_rate > 0) || (config_info.num_sweep_rates > 0),
+               "Invalid Value: open-loop arrival needs arrival_rate or sweep_rates");
+        config_info.mode = MODE_LATENCY;
+    } else {
+        check (config_info.num_sweep_rates == 0,
+               "Invalid Value: sweep_rates needs arrival = fixed or poisson");
+    }
+
+    /* a sweep sizes every buffer for its largest point; an axis */
+    /* that is not swept keeps the single configured value      */
+    if ((config_info.num_sweep_sizes > 0) || (config_info.num_sweep_windows > 0) ||
+        (config_info.num_sweep_rates > 0)) {
+        check (config_info.workload == WORKLOAD_ECHO,
+               "Invalid Value: sweeps only support workload = echo");
+        if (config_info.num_sweep_sizes == 0) {
+            config_info.sweep_sizes = (int *) calloc (1, sizeof(int));
+            check (config_info.sweep_sizes != NULL, "Failed to allocate sweep_sizes");
+            config_info.sweep_sizes[0]  = config_info.msg_size;
+            config_info.num_sweep_sizes = 1;
+        }
+        if (config_info.num_sweep_windows == 0) {
+            config_info.sweep_windows = (int *) calloc (1, sizeof(int));
+            check (config_info.sweep_windows != NULL, "Failed to allocate sweep_windows");
+            config_info.sweep_windows[0]  = config_info.num_concurr_msgs;
+            config_info.num_sweep_windows = 1;
+        }
+        if (config_info.num_sweep_rates == 0) {
+            config_info.sweep_rates = (int *) calloc (1, sizeof(int));
+            check (config_info.sweep_rates != NULL, "Failed to allocate sweep_rates");
+            config_info.sweep_rates[0]  = config_info.arrival_rate;
+            config_info.num_sweep_rates = 1;
+        }
+        config_info.msg_size = int_list_max (config_info.sweep_sizes,
+                                             config_info.num_sweep_sizes);
+        config_info.num_concurr_msgs = int_list_max (config_info.sweep_windows,
+                                                     config_info.num_sweep_windows);
+    }
+
+    /* rpc: every message starts with a header, replies are matched */
+    /* by req_id and timed per opcode in either mode                */
+    if (config_info.num_rpc_ops > 0) {
+        int i = 0;
+
+        check ((config_info.workload == WORKLOAD_ECHO) &&
+               (config_info.transport != TRANSPORT_WRITE) &&
+               (config_info.arrival == ARRIVAL_CLOSED) &&
+               (config_info.mode == MODE_THROUGHPUT),
+               "Invalid Value: rpc_ops needs workload = echo, transport = send "
+               "or ud, arrival = closed and mode = throughput");
+        for (i = 0; i < config_info.num_rpc_ops; i++) {
+            check ((config_info.rpc_ops[i] >= 0) && rpc_has_op (config_info.rpc_ops[i]),
+                   "Invalid Value: rpc_ops, no handler for opcode %d",
+                   config_info.rpc_ops[i]);
+        }
+        for (i = 0; i < config_info.num_sweep_sizes; i++) {
+            check (config_info.sweep_sizes[i] >= sizeof(struct RPCHeader),
+                   "Invalid Value: sweep_msg_sizes = %d, rpc needs %zu bytes",
+                   config_info.sweep_sizes[i], sizeof(struct RPCHeader));
+        }
+        check (config_info.msg_size >= sizeof(struct RPCHeader),
+               "Invalid Value: msg_size = %d, rpc needs %zu bytes",
+               config_info.msg_size, sizeof(struct RPCHeader));
+    }
+
+    /* rendezvous: the server pulls the client's payload with READs */
+    /* tagged by an entry of its table in the 16-bit wr_id slot     */
+    if (rndv_enabled (config_info.msg_size)) {
+        check ((config_info.workload == WORKLOAD_ECHO) &&
+               (config_info.transport == TRANSPORT_SEND) &&
+               (config_info.backend == BACKEND_IB) &&
+               (config_info.arrival == ARRIVAL_CLOSED) &&
+               (config_info.num_rpc_ops == 0),
+               "Invalid Value: msg_size above eager_threshold needs workload = echo, "
+               "transport = send, backend = ib, arrival = closed and no rpc_ops");
+        check ((long)config_info.num_clients * config_info.num_concurr_msgs <=
+               IB_WR_ID_MAX_SLOTS,
+               "Invalid Value: num_concurr_msgs = %d, rendezvous allows %d reads "
+               "in flight per server thread", config_info.num_concurr_msgs,
+               IB_WR_ID_MAX_SLOTS);
+        check (config_info.msg_size <= (1L << POOL_MAX_SHIFT),
+               "Invalid Value: msg_size = %d, rendezvous allows %ld bytes",
+               config_info.msg_size, 1L << POOL_MAX_SHIFT);
+    }
+
+    /* only rendezvous sends straight from application memory */
+    if (config_info.mr_cache > 0) {
+        check (rndv_enabled (config_info.msg_size),
+               "Invalid Value: mr_cache = %d needs msg_size above eager_threshold",
+               config_info.mr_cache);
+    }
+
+    if (config_info.latency_window > config_info.num_concurr_msgs) {
+        config_info.latency_window = config_info.num_concurr_msgs;
+    }
+    if (config_info.mode == MODE_LATENCY) {
+        check (config_info.msg_size >= sizeof(uint64_t),
+               "Invalid Value: msg_size = %d, latency mode needs %zu bytes",
+               config_info.msg_size, sizeof(uint64_t));
+    }
+
+    if ((config_info.workload == WORKLOAD_FETCH_ADD) ||
+        (config_info.workload == WORKLOAD_CMP_SWP)) {
+        check (config_info.msg_size >= sizeof(uint64_t),
+               "Invalid Value: msg_size = %d, atomics need %zu bytes",
+               config_info.msg_size, sizeof(uint64_t));
+    }
+    /* the slot of a one-sided op travels in 16 bits of its wr_id */
+    if (config_info.workload != WORKLOAD_ECHO) {
+        check (config_info.num_concurr_msgs <= IB_WR_ID_MAX_SLOTS,
+               "Invalid Value: num_concurr_msgs = %d, one-sided workloads allow %d",
+               config_info.num_concurr_msgs, IB_WR_ID_MAX_SLOTS);
+    }
+    /* ring writes raise no completion at the target, a sleeping */
+    /* thread would never see them                               */
+    if (config_info.poll_mode != POLL_BUSY) {
+        check (config_info.transport != TRANSPORT_WRITE,
+               "Invalid Value: transport = write needs poll_mode = busy");
+    }
+    /* datagrams carry two-sided sends only */
+    if (config_info.transport == TRANSPORT_UD) {
+        check (config_info.workload == WORKLOAD_ECHO,
+               "Invalid Value: transport = ud only supports workload = echo");
+    }
+
+    /* the cm bootstrap connects rc qps only */
+    if (config_info.connect_mode == CONNECT_CM) {
+        check (config_info.transport != TRANSPORT_UD,
+               "Invalid Value: connect_mode = cm does not support transport = ud");
+    }
+
+    /* one worker per listed cpu */
+    if (config_info.num_cpus > 0) {
+        check (config_info.num_cpus >= config_info.num_threads,
+               "Invalid Value: cpus lists %d cpus for %d threads",
+               config_info.num_cpus, config_info.num_threads);
+    }
+
+    /* striping opens its ports itself and gives every ud qp's */
+    /* peers one address space, which only a single rail has    */
+    if (config_info.ib_devices != NULL) {
+        check ((config_info.connect_mode == CONNECT_SOCK) &&
+               (config_info.transport != TRANSPORT_UD) &&
+               (config_info.backend == BACKEND_IB),
+               "Invalid Value: ib_devices needs connect_mode = sock, "
+               "backend = ib and transport = send or write");
+    }
+
+    /* the trace hooks sit in the verbs paths and are only */
+    /* compiled into a make trace build                     */
+    if (config_info.trace_file != NULL) {
+#ifdef TRACE
+        check (config_info.backend == BACKEND_IB,
+               "Invalid Value: trace_file needs backend = ib");
+#else
+        check (0, "Invalid Value: trace_file needs a build with make trace");
+#endif
+    }
+
+    /* shm carries two-sided echoes between busy-polling threads */
+    if (config_info.backend == BACKEND_SHM) {
+        check ((config_info.transport == TRANSPORT_SEND) &&
+               (config_info.workload == WORKLOAD_ECHO) &&
+               (config_info.poll_mode == POLL_BUSY),
+               "Invalid Value: backend = shm needs transport = send, "
+               "workload = echo and poll_mode = busy");
+    }
+
+    /* credits guard the srq of rc echoes; ud drops rather than */
+    /* naks, rings have their own slots and shm its own rings.   */
+    /* they are the default wherever they apply                  */
+    {
+        bool credit_ok = (config_info.transport == TRANSPORT_SEND) &&
+                         (config_info.workload == WORKLOAD_ECHO) &&
+                         (config_info.backend == BACKEND_IB);
+
+        if (config_info.flow_control < 0) {
+            config_info.flow_control = credit_ok ? FLOW_CREDIT : FLOW_RNR;
+        }
+        check ((config_info.flow_control != FLOW_CREDIT) || credit_ok,
+               "Invalid Value: flow_control = credit needs transport = send, "
+               "workload = echo and backend = ib");
+    }
+    if (config_info.flow_control == FLOW_CREDIT) {
+        check ((config_info.num_servers <= IB_IMM_RANK_MASK + 1) &&
+               (config_info.num_clients <= IB_IMM_RANK_MASK + 1),
+               "Invalid Value: flow_control = credit allows %d nodes per side",
+               IB_IMM_RANK_MASK + 1);
+    }
+
     ret = get_rank ();
     check (ret == 0, "Failed to get rank");
 
@@ -216,6 +793,34 @@ void destroy_config_info ()
         free (config_info.servers);
     }
 
+    if (config_info.sweep_sizes != NULL) {
+        free (config_info.sweep_sizes);
+    }
+
+    if (config_info.sweep_windows != NULL) {
+        free (config_info.sweep_windows);
+    }
+
+    if (config_info.sweep_rates != NULL) {
+        free (config_info.sweep_rates);
+    }
+
+    if (config_info.rpc_ops != NULL) {
+        free (config_info.rpc_ops);
+    }
+
+    if (config_info.ib_devices != NULL) {
+        free (config_info.ib_devices);
+    }
+
+    if (config_info.trace_file != NULL) {
+        free (config_info.trace_file);
+    }
+
+    if (config_info.cpus != NULL) {
+        free (config_info.cpus);
+    }
+
     if (config_info.clients != NULL) {
         for (i = 0; i < num_clients; i++) {
             if (config_info.clients[i] != NULL) {
@@ -238,6 +843,112 @@ void print_config_info ()
     log ("rank                      = %d", config_info.rank);
     log ("msg_size                  = %d", config_info.msg_size);
     log ("num_concurr_msgs          = %d", config_info.num_concurr_msgs);
+    log ("num_threads               = %d", config_info.num_threads);
+    log ("sig_interval              = %d", config_info.sig_interval);
+    log ("batch_size                = %d", config_info.batch_size);
+    log ("inline_threshold          = %d", config_info.inline_threshold);
+    if (config_info.transport == TRANSPORT_WRITE) {
+	log ("transport                 = %s", "write");
+    } else if (config_info.transport == TRANSPORT_UD) {
+	log ("transport                 = %s", "ud");
+    } else {
+	log ("transport                 = %s", "send");
+    }
+    switch (config_info.workload) {
+    case WORKLOAD_READ:
+	log ("workload                  = %s", "read");
+	break;
+    case WORKLOAD_FETCH_ADD:
+	log ("workload                  = %s", "fetch_add");
+	break;
+    case WORKLOAD_CMP_SWP:
+	log ("workload                  = %s", "cmp_swp");
+	break;
+    default:
+	log ("workload                  = %s", "echo");
+	break;
+    }
+    if (config_info.workload != WORKLOAD_ECHO) {
+	log ("num_counters              = %d", config_info.num_counters);
+    }
+    if (config_info.mode == MODE_LATENCY) {
+	log ("mode                      = %s", "latency");
+	log ("latency_window            = %d", config_info.latency_window);
+    } else {
+	log ("mode                      = %s", "throughput");
+    }
+    if (config_info.num_rpc_ops > 0) {
+	log ("rpc_ops                   = %d opcodes", config_info.num_rpc_ops);
+    }
+    if (config_info.eager_threshold > 0) {
+	log ("eager_threshold           = %d", config_info.eager_threshold);
+    }
+    if (config_info.mr_cache > 0) {
+	log ("mr_cache                  = %d MiB", config_info.mr_cache);
+    }
+    log ("flow_control              = %s",
+	 (config_info.flow_control == FLOW_CREDIT) ? "credit" : "rnr");
+    switch (config_info.arrival) {
+    case ARRIVAL_FIXED:
+	log ("arrival                   = %s", "fixed");
+	log ("arrival_rate              = %d Kops/s", config_info.arrival_rate);
+	break;
+    case ARRIVAL_POISSON:
+	log ("arrival                   = %s", "poisson");
+	log ("arrival_rate              = %d Kops/s", config_info.arrival_rate);
+	break;
+    default:
+	log ("arrival                   = %s", "closed");
+	break;
+    }
+    switch (config_info.poll_mode) {
+    case POLL_EVENT:
+	log ("poll_mode                 = %s", "event");
+	break;
+    case POLL_HYBRID:
+	log ("poll_mode                 = %s", "hybrid");
+	log ("poll_budget_us            = %d", config_info.poll_budget_us);
+	break;
+    default:
+	log ("poll_mode                 = %s", "busy");
+	break;
+    }
+    switch (config_info.hugepages) {
+    case HUGEPAGES_2M:
+	log ("hugepages                 = %s", "2m");
+	break;
+    case HUGEPAGES_1G:
+	log ("hugepages                 = %s", "1g");
+	break;
+    default:
+	log ("hugepages                 = %s", "none");
+	break;
+    }
+    log ("sq_depth                  = %d", config_info.sq_depth);
+    log ("srq_depth                 = %d", config_info.srq_depth);
+    log ("cq_depth                  = %d", config_info.cq_depth);
+    log ("num_ops                   = %ld", config_info.num_ops);
+    log ("num_warmup_ops            = %ld", config_info.num_warmup_ops);
+    if (config_info.num_sweep_sizes > 0) {
+	log ("sweep                     = %d msg_sizes x %d windows x %d rates (%s)",
+	     config_info.num_sweep_sizes, config_info.num_sweep_windows,
+	     config_info.num_sweep_rates,
+	     (config_info.sweep_format == SWEEP_JSON) ? "json" : "csv");
+    }
+    log ("connect_mode              = %s",
+	 (config_info.connect_mode == CONNECT_CM) ? "cm" : "sock");
+    log ("backend                   = %s",
+	 (config_info.backend == BACKEND_SHM) ? "shm" : "ib");
+    log ("gid_index                 = %d", config_info.gid_index);
+    if (config_info.ib_devices != NULL) {
+	log ("ib_devices                = %s", config_info.ib_devices);
+    }
+    if (config_info.trace_file != NULL) {
+	log ("trace_file                = %s", config_info.trace_file);
+    }
+    if (config_info.num_cpus > 0) {
+	log ("cpus                      = %d listed", config_info.num_cpus);
+    }
     log ("sock_port                 = %s", config_info.sock_port);
     
     log (LOG_SUB_HEADER, "End of Configuraion");
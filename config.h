@@ -9,6 +9,103 @@ enum ConfigFileAttr {
     ATTR_CLIENTS,
     ATTR_MSG_SIZE,
     ATTR_NUM_CONCURR_MSGS,
+    ATTR_NUM_THREADS,
+    ATTR_SIG_INTERVAL,
+    ATTR_BATCH_SIZE,
+    ATTR_INLINE_THRESHOLD,
+    ATTR_MODE,
+    ATTR_LATENCY_WINDOW,
+    ATTR_TRANSPORT,
+    ATTR_WORKLOAD,
+    ATTR_NUM_COUNTERS,
+    ATTR_POLL_MODE,
+    ATTR_POLL_BUDGET_US,
+    ATTR_NUM_OPS,
+    ATTR_NUM_WARMUP_OPS,
+    ATTR_SWEEP_MSG_SIZES,
+    ATTR_SWEEP_WINDOWS,
+    ATTR_SWEEP_FORMAT,
+    ATTR_HUGEPAGES,
+    ATTR_SQ_DEPTH,
+    ATTR_SRQ_DEPTH,
+    ATTR_CQ_DEPTH,
+    ATTR_CONNECT_MODE,
+    ATTR_GID_INDEX,
+    ATTR_BACKEND,
+    ATTR_ARRIVAL,
+    ATTR_ARRIVAL_RATE,
+    ATTR_SWEEP_RATES,
+    ATTR_RPC_OPS,
+    ATTR_EAGER_THRESHOLD,
+    ATTR_MR_CACHE,
+    ATTR_IB_DEVICES,
+    ATTR_CPUS,
+    ATTR_FLOW_CONTROL,
+    ATTR_TRACE_FILE,
+};
+
+enum BenchMode {
+    MODE_THROUGHPUT = 0,     /* keep num_concurr_msgs in flight, report Mops/s */
+    MODE_LATENCY,            /* timestamp every request, report percentiles */
+};
+
+/* when the client issues echo requests */
+enum Arrival {
+    ARRIVAL_CLOSED = 0,      /* the next request goes out when an echo is back */
+    ARRIVAL_FIXED,           /* open loop, evenly spaced at arrival_rate */
+    ARRIVAL_POISSON,         /* open loop, exponential gaps around arrival_rate */
+};
+
+enum Transport {
+    TRANSPORT_SEND = 0,      /* two-sided SEND_WITH_IMM into the srq */
+    TRANSPORT_WRITE,         /* one-sided RDMA WRITE into polled rings */
+    TRANSPORT_UD,            /* SEND_WITH_IMM over one ud qp per thread */
+};
+
+/* how worker threads wait for completions */
+enum PollMode {
+    POLL_BUSY = 0,           /* spin on ibv_poll_cq */
+    POLL_EVENT,              /* arm the cq and sleep as soon as it is empty */
+    POLL_HYBRID,             /* spin for poll_budget_us, then arm and sleep */
+};
+
+/* page size backing ib_buf; falls back to smaller pages if unavailable */
+enum HugePages {
+    HUGEPAGES_NONE = 0,
+    HUGEPAGES_2M,
+    HUGEPAGES_1G,
+};
+
+/* what keeps a sender from outrunning the srq of its receiver */
+enum FlowControl {
+    FLOW_CREDIT = 0,         /* send only with a receive credit, see ib.h */
+    FLOW_RNR,                /* send freely, the nic retries on rnr naks */
+};
+
+/* what the echo engine runs on, see transport.h */
+enum Backend {
+    BACKEND_IB = 0,          /* verbs on an rdma device */
+    BACKEND_SHM,             /* spsc rings in shared memory, local processes only */
+};
+
+/* how the qps of two nodes find each other */
+enum ConnectMode {
+    CONNECT_SOCK = 0,        /* exchange QPInfo over tcp, modify qps by hand */
+    CONNECT_CM,              /* rdma_cm: resolve, connect/accept, rank in private data */
+};
+
+enum SweepFormat {
+    SWEEP_CSV = 0,
+    SWEEP_JSON,
+};
+
+/* everything but echo is driven by the client against the server's */
+/* buffer, the server cpu only takes part in start and stop          */
+enum Workload {
+    WORKLOAD_ECHO = 0,
+    WORKLOAD_READ,           /* RDMA READ msg_size bytes */
+    WORKLOAD_FETCH_ADD,      /* ATOMIC_FETCH_AND_ADD 1 on a counter */
+    WORKLOAD_CMP_SWP,        /* ATOMIC_CMP_AND_SWP last seen -> +1 */
 };
 
 struct ConfigInfo {
@@ -22,6 +119,57 @@ struct ConfigInfo {
 
     int  msg_size;           /* the size of each echo message */
     int  num_concurr_msgs;   /* the number of messages can be sent concurrently */
+    int  num_threads;        /* the number of worker threads */
+    int  sig_interval;       /* signal one out of every sig_interval sends */
+    int  batch_size;         /* max wcs per poll and wrs per posted chain */
+    int  inline_threshold;   /* max inline send size, -1 for the device limit */
+
+    int  mode;               /* enum BenchMode */
+    int  latency_window;     /* requests in flight per peer in latency mode */
+    int  transport;          /* enum Transport */
+    int  workload;           /* enum Workload */
+    int  num_counters;       /* distinct 8-byte targets of read/atomic ops */
+    int  poll_mode;          /* enum PollMode */
+    int  poll_budget_us;     /* hybrid: busy-poll budget of an idle cq */
+    long num_ops;            /* ops per run, warmup included */
+    long num_warmup_ops;     /* ops before the measured interval starts */
+    int  arrival;            /* enum Arrival */
+    int  arrival_rate;       /* open loop: Kops/s offered by each client */
+    int  eager_threshold;    /* larger msgs go by rendezvous, 0: never */
+    int  flow_control;       /* enum FlowControl; credits need transport = */
+                             /* send, workload = echo and backend = ib;    */
+                             /* the default there, rnr otherwise           */
+    int  mr_cache;           /* rendezvous sources from application memory, */
+                             /* MiB pinned per thread; 0: pool buffers      */
+    int  num_rpc_ops;        /* rpc: opcodes the client cycles through, */
+    int *rpc_ops;            /* 0 for plain echoes, see rpc.h           */
+
+    /* sweep: one run per (msg_size, window) point over the same qps; */
+    /* msg_size and num_concurr_msgs hold the largest point           */
+    int  num_sweep_sizes;
+    int *sweep_sizes;
+    int  num_sweep_windows;
+    int *sweep_windows;
+    int  num_sweep_rates;    /* open loop: offered loads, Kops/s */
+    int *sweep_rates;
+    int  sweep_format;       /* enum SweepFormat */
+
+    int  hugepages;          /* enum HugePages */
+
+    /* queue depths, 0 to derive them from peers and num_concurr_msgs */
+    int  sq_depth;           /* send queue of every qp */
+    int  srq_depth;          /* srq of every thread */
+    int  cq_depth;           /* cq of every thread */
+
+    int  connect_mode;       /* enum ConnectMode */
+    int  gid_index;          /* sgid of the grh, -1: lid on ib, 0 on roce */
+    int  backend;            /* enum Backend */
+    int   num_cpus;          /* worker t runs on cpus[t % num_cpus]; */
+    int  *cpus;              /* 0: next to its rail, see setup_ib.c  */
+    char *ib_devices;        /* ports to stripe threads over, NULL: IB_PORT */
+                             /* of the first device, see setup_ib.c         */
+    char *trace_file;        /* prefix of the trace dumps, NULL: no tracing; */
+                             /* needs a make trace build, see trace.h        */
 
     char *sock_port;         /* socket port number */
 }__attribute__((aligned(64)));
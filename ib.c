@@ -1,10 +1,37 @@
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
 
 #include "ib.h"
 #include "debug.h"
+#include "stats.h"
+#include "transport.h"
+#include "trace.h"
 
-int modify_qp_to_rts (struct ibv_qp *qp, uint32_t target_qp_num, uint16_t target_lid)
+/* infiniband routes by lid; with an sgid_index (always on roce) */
+/* packets carry a grh addressed to the peer's gid               */
+void fill_ah_attr (struct ibv_ah_attr *ah_attr, uint16_t lid, const uint8_t *gid,
+		   int sgid_index, uint8_t port_num)
+{
+    memset (ah_attr, 0, sizeof(struct ibv_ah_attr));
+    ah_attr->dlid          = lid;
+    ah_attr->sl            = IB_SL;
+    ah_attr->src_path_bits = 0;
+    ah_attr->port_num      = port_num;
+
+    if (sgid_index >= 0) {
+	ah_attr->is_global      = 1;
+	ah_attr->grh.sgid_index = sgid_index;
+	ah_attr->grh.hop_limit  = IB_GRH_HOP_LIMIT;
+	memcpy (ah_attr->grh.dgid.raw, gid, sizeof(ah_attr->grh.dgid.raw));
+    }
+}
+
+int modify_qp_to_rts (struct ibv_qp *qp, uint32_t target_qp_num, struct ibv_ah_attr *ah_attr,
+		      enum ibv_mtu mtu, uint8_t max_rd_atomic, uint8_t max_dest_rd_atomic)
 {
     int ret = 0;
 
@@ -13,7 +40,7 @@ int modify_qp_to_rts (struct ibv_qp *qp, uint32_t target_qp_num, uint16_t target
 	struct ibv_qp_attr qp_attr = {
 	    .qp_state        = IBV_QPS_INIT,
 	    .pkey_index      = 0,
-	    .port_num        = IB_PORT,
+	    .port_num        = ah_attr->port_num,
 	    .qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
 	                       IBV_ACCESS_REMOTE_READ |
 	                       IBV_ACCESS_REMOTE_ATOMIC |
@@ -30,16 +57,12 @@ int modify_qp_to_rts (struct ibv_qp *qp, uint32_t target_qp_num, uint16_t target
     {
 	struct ibv_qp_attr  qp_attr = {
 	    .qp_state           = IBV_QPS_RTR,
-	    .path_mtu           = IB_MTU,
+	    .path_mtu           = mtu,
 	    .dest_qp_num        = target_qp_num,
 	    .rq_psn             = 0,
-	    .max_dest_rd_atomic = 1,
+	    .max_dest_rd_atomic = max_dest_rd_atomic,
 	    .min_rnr_timer      = 12,
-	    .ah_attr.is_global  = 0,
-	    .ah_attr.dlid       = target_lid,
-	    .ah_attr.sl         = IB_SL,
-	    .ah_attr.src_path_bits = 0,
-	    .ah_attr.port_num      = IB_PORT,
+	    .ah_attr            = *ah_attr,
 	};
 
 	ret = ibv_modify_qp(qp, &qp_attr,
@@ -58,7 +81,7 @@ int modify_qp_to_rts (struct ibv_qp *qp, uint32_t target_qp_num, uint16_t target
 	    .retry_cnt     = 7,
 	    .rnr_retry     = 7,
 	    .sq_psn        = 0,
-	    .max_rd_atomic = 1,
+	    .max_rd_atomic = max_rd_atomic,
 	};
 
 	ret = ibv_modify_qp (qp, &qp_attr,
@@ -73,6 +96,53 @@ int modify_qp_to_rts (struct ibv_qp *qp, uint32_t target_qp_num, uint16_t target
     return -1;
 }
 
+int modify_ud_qp_to_rts (struct ibv_qp *qp, uint8_t port_num)
+{
+    int ret = 0;
+
+    {
+	struct ibv_qp_attr qp_attr = {
+	    .qp_state   = IBV_QPS_INIT,
+	    .pkey_index = 0,
+	    .port_num   = port_num,
+	    .qkey       = IB_UD_QKEY,
+	};
+
+	ret = ibv_modify_qp (qp, &qp_attr,
+			     IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+			     IBV_QP_PORT  | IBV_QP_QKEY);
+	check (ret == 0, "Failed to modify ud qp to INIT.");
+    }
+
+    {
+	struct ibv_qp_attr qp_attr = {
+	    .qp_state = IBV_QPS_RTR,
+	};
+
+	ret = ibv_modify_qp (qp, &qp_attr, IBV_QP_STATE);
+	check (ret == 0, "Failed to modify ud qp to RTR.");
+    }
+
+    {
+	struct ibv_qp_attr qp_attr = {
+	    .qp_state = IBV_QPS_RTS,
+	    .sq_psn   = 0,
+	};
+
+	ret = ibv_modify_qp (qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
+	check (ret == 0, "Failed to modify ud qp to RTS.");
+    }
+
+    return 0;
+ error:
+    return -1;
+}
+
+struct ibv_ah *create_ud_ah (struct ibv_pd *pd, struct ibv_ah_attr *ah_attr)
+{
+    return ibv_create_ah (pd, ah_attr);
+}
+
 int post_send (uint32_t req_size, uint32_t lkey, uint64_t wr_id,
 	       uint32_t imm_data, struct ibv_qp *qp, char *buf)
 {
@@ -98,6 +168,35 @@ int post_send (uint32_t req_size, uint32_t lkey, uint64_t wr_id,
     return ret;
 }
 
+int post_send_ud (uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+		  uint32_t imm_data, struct ibv_qp *qp, struct ibv_ah *ah,
+		  uint32_t remote_qpn, char *buf)
+{
+    struct ibv_send_wr *bad_send_wr;
+
+    struct ibv_sge list = {
+	.addr   = (uintptr_t) buf,
+	.length = req_size,
+	.lkey   = lkey
+    };
+
+    struct ibv_send_wr send_wr = {
+	.wr_id      = wr_id,
+	.sg_list    = &list,
+	.num_sge    = 1,
+	.opcode     = IBV_WR_SEND_WITH_IMM,
+	.send_flags = IBV_SEND_SIGNALED,
+	.imm_data   = htonl (imm_data),
+	.wr.ud      = {
+	    .ah          = ah,
+	    .remote_qpn  = remote_qpn,
+	    .remote_qkey = IB_UD_QKEY,
+	},
+    };
+
+    return ibv_post_send (qp, &send_wr, &bad_send_wr);
+}
+
 int post_srq_recv (uint32_t req_size, uint32_t lkey, uint64_t wr_id, 
 		   struct ibv_srq *srq, char *buf)
 {
@@ -119,3 +218,669 @@ int post_srq_recv (uint32_t req_size, uint32_t lkey, uint64_t wr_id,
     ret = ibv_post_srq_recv (srq, &recv_wr, &bad_recv_wr);
     return ret;
 }
+
+void init_qp_send_state (struct QPSendState *sq, uint32_t sig_interval,
+			 uint32_t max_send_wr, uint32_t max_credits)
+{
+    memset (sq, 0, sizeof(struct QPSendState));
+    sq->credits     = max_credits;
+    sq->max_credits = max_credits;
+
+    /* every wr may sit in the queue until the next signaled one */
+    /* completes, so keep room for two intervals plus control msgs */
+    sq->max_outstanding = max_send_wr - IB_SQ_CTL_RESERVE;
+    if (sig_interval < 1) {
+	sig_interval = 1;
+    }
+    if (sig_interval > sq->max_outstanding / 2) {
+	sig_interval = sq->max_outstanding / 2;
+    }
+    if (sig_interval > IB_WR_ID_SIG_COUNT(~0ULL)) {
+	sig_interval = IB_WR_ID_SIG_COUNT(~0ULL);
+    }
+    sq->sig_interval = sig_interval;
+}
+
+/* the n oldest wrs completed, their send slab slots are free again */
+static void release_inflight (struct QPSendState *sq, uint32_t n)
+{
+    while (n-- > 0) {
+	char *slot = sq->inflight[sq->inflight_tail];
+
+	if (slot != NULL) {
+	    slab_put (sq->slab, slot);
+	}
+	if (++sq->inflight_tail == sq->max_outstanding) {
+	    sq->inflight_tail = 0;
+	}
+    }
+}
+
+/* between runs, once every send of the qp has completed; both */
+/* sides have all their recvs posted again by then              */
+void reset_qp_send_state (struct QPSendState *sq)
+{
+    /* unsignaled wrs at the end of a run are never retired */
+    if (sq->inflight != NULL) {
+	release_inflight (sq, sq->num_outstanding);
+    }
+    sq->num_unsignaled  = 0;
+    sq->num_outstanding = 0;
+    sq->credits         = sq->max_credits;
+    sq->pending_grant   = 0;
+}
+
+void retire_send (struct QPSendState *sq_state, uint64_t wr_id)
+{
+    if ((wr_id & IB_WR_ID_TAG_MASK) == IB_WR_ID_SIG) {
+	struct QPSendState *sq = &sq_state[IB_WR_ID_SIG_PEER(wr_id)];
+
+	sq->num_outstanding -= IB_WR_ID_SIG_COUNT(wr_id);
+	if (sq->inflight != NULL) {
+	    release_inflight (sq, IB_WR_ID_SIG_COUNT(wr_id));
+	}
+    }
+}
+
+int init_post_batch (struct PostBatch *b, int max_wr, uint32_t lkey,
+		     uint32_t inline_threshold, struct ibv_qp **qp,
+		     struct QPSendState *sq_state, int num_qps,
+		     struct ibv_srq *srq)
+{
+    memset (b, 0, sizeof(struct PostBatch));
+
+    b->max_wr   = max_wr;
+    b->lkey     = lkey;
+    b->inline_threshold = inline_threshold;
+    b->qp       = qp;
+    b->sq_state = sq_state;
+    b->srq      = srq;
+
+    b->send_wr   = (struct ibv_send_wr *) calloc (max_wr, sizeof(struct ibv_send_wr));
+    b->send_sge  = (struct ibv_sge *) calloc (max_wr, sizeof(struct ibv_sge));
+    b->send_head = (struct ibv_send_wr **) calloc (num_qps, sizeof(struct ibv_send_wr *));
+    b->send_tail = (struct ibv_send_wr **) calloc (num_qps, sizeof(struct ibv_send_wr *));
+    b->active    = (uint32_t *) calloc (max_wr, sizeof(uint32_t));
+    b->recv_wr   = (struct ibv_recv_wr *) calloc (max_wr, sizeof(struct ibv_recv_wr));
+    b->recv_sge  = (struct ibv_sge *) calloc (max_wr, sizeof(struct ibv_sge));
+    check ((b->send_wr != NULL) && (b->send_sge != NULL) &&
+	   (b->send_head != NULL) && (b->send_tail != NULL) &&
+	   (b->active != NULL) && (b->recv_wr != NULL) && (b->recv_sge != NULL),
+	   "Failed to allocate post batch");
+
+    return 0;
+ error:
+    destroy_post_batch (b);
+    return -1;
+}
+
+void batch_set_ud (struct PostBatch *b, struct ibv_ah **ah,
+		   uint32_t *remote_qpn, uint32_t ud_qp_index)
+{
+    b->ah          = ah;
+    b->remote_qpn  = remote_qpn;
+    b->ud_qp_index = ud_qp_index;
+    b->grh_size    = IB_GRH_SIZE;
+}
+
+void destroy_post_batch (struct PostBatch *b)
+{
+    free (b->send_wr);
+    free (b->send_sge);
+    free (b->send_head);
+    free (b->send_tail);
+    free (b->active);
+    free (b->recv_wr);
+    free (b->recv_sge);
+    memset (b, 0, sizeof(struct PostBatch));
+}
+
+/* the first send with imm in the chain of peer returns the credits */
+/* reposted for peer so far                                          */
+static void attach_grant (struct PostBatch *b, uint32_t peer)
+{
+    struct QPSendState *sq    = &b->sq_state[peer];
+    struct ibv_send_wr *wr    = NULL;
+    uint32_t            grant = sq->pending_grant;
+
+    if (grant == 0) {
+	return;
+    }
+    if (grant > IB_IMM_MAX_GRANT) {
+	grant = IB_IMM_MAX_GRANT;
+    }
+    for (wr = b->send_head[peer]; wr != NULL; wr = wr->next) {
+	if (wr->opcode == IBV_WR_SEND_WITH_IMM) {
+	    wr->imm_data       = htonl (ntohl (wr->imm_data) | grant << IB_IMM_GRANT_SHIFT);
+	    sq->pending_grant -= grant;
+	    b->num_grants     += grant;
+	    return;
+	}
+    }
+}
+
+int flush_post_batch_send (struct PostBatch *b)
+{
+    int ret = 0, i = 0;
+    struct ibv_send_wr *bad_send_wr;
+
+    /* credits: a grant promises a posted recv, so the reposts */
+    /* must reach the srq before any send that carries one     */
+    if (b->credit_flow) {
+	ret = flush_post_batch_recv (b);
+	check (ret == 0, "Failed to flush recv chain");
+    }
+
+    for (i = 0; i < b->num_active; i++) {
+	uint32_t peer = b->active[i];
+
+	if (b->credit_flow) {
+	    attach_grant (b, peer);
+	}
+#ifdef TRACE
+	{
+	    struct ibv_send_wr *wr  = b->send_head[peer];
+	    uint32_t            num = 0;
+
+	    for (; wr != NULL; wr = wr->next) {
+		num += 1;
+	    }
+	    TRACE_EVENT (TRACE_POST_SEND, peer, b->send_head[peer]->wr_id, num);
+	}
+#endif
+	ret = ibv_post_send (b->qp[peer], b->send_head[peer], &bad_send_wr);
+	check (ret == 0, "Failed to post send chain to peer[%"PRIu32"]", peer);
+
+	b->send_head[peer] = NULL;
+	b->send_tail[peer] = NULL;
+	b->num_send_posts += 1;
+    }
+    b->num_active = 0;
+    b->num_send   = 0;
+
+    return 0;
+ error:
+    return -1;
+}
+
+int flush_post_batch_recv (struct PostBatch *b)
+{
+    int ret = 0;
+    struct ibv_recv_wr *bad_recv_wr;
+
+    if (b->num_recv == 0) {
+	return 0;
+    }
+
+    b->recv_wr[b->num_recv - 1].next = NULL;
+    TRACE_EVENT (TRACE_POST_RECV, 0, b->recv_wr[0].wr_id, b->num_recv);
+    ret = ibv_post_srq_recv (b->srq, b->recv_wr, &bad_recv_wr);
+    check (ret == 0, "Failed to post recv chain");
+
+    b->num_recv        = 0;
+    b->num_recv_posts += 1;
+
+    return 0;
+ error:
+    return -1;
+}
+
+/* sends go out first so that echoes are not delayed behind reposts, */
+/* unless they carry credits for them                                */
+int flush_post_batch (struct PostBatch *b)
+{
+    int ret = 0;
+
+    ret = flush_post_batch_send (b);
+    check (ret == 0, "Failed to flush send chains");
+
+    ret = flush_post_batch_recv (b);
+    check (ret == 0, "Failed to flush recv chain");
+
+    return 0;
+ error:
+    return -1;
+}
+
+/*
+ *  batch_add_wr:
+ *       append a wr to the chain of the given peer and hand it back
+ *       so the caller can fill in the opcode specific fields; only
+ *       every sig_interval-th wr of a qp is signaled and the signaled
+ *       wr carries the number of wrs its completion retires
+ *
+ *  return value:
+ *       0 on success, EAGAIN if the send queue is out of credits
+ *       or a send with imm has no receive credit, -1 on error
+ */
+int batch_add_wr (struct PostBatch *b, enum ibv_wr_opcode opcode,
+		  uint32_t req_size, uint32_t peer, char *buf,
+		  struct ibv_send_wr **wr_out)
+{
+    int ret = 0;
+    struct QPSendState *sq = &b->sq_state[peer];
+
+    if (sq->num_outstanding >= sq->max_outstanding) {
+	return EAGAIN;
+    }
+    /* credits: never send into an srq that may have no recv for it */
+    if (b->credit_flow && (opcode == IBV_WR_SEND_WITH_IMM)) {
+	if (sq->credits == 0) {
+	    b->num_credit_stalls += 1;
+	    return EAGAIN;
+	}
+	sq->credits -= 1;
+    }
+
+    if (b->num_send == b->max_wr) {
+	ret = flush_post_batch_send (b);
+	check (ret == 0, "Failed to flush send chains");
+    }
+
+    struct ibv_sge     *sge = &b->send_sge[b->num_send];
+    struct ibv_send_wr *wr  = &b->send_wr[b->num_send];
+
+    memset (wr, 0, sizeof(struct ibv_send_wr));
+
+    sge->addr   = (uintptr_t) buf;
+    sge->length = req_size;
+    sge->lkey   = b->lkey;
+
+    wr->sg_list    = sge;
+    wr->num_sge    = 1;
+    wr->opcode     = opcode;
+
+    /* only payloads the nic would otherwise dma-read can go inline */
+    if ((req_size <= b->inline_threshold) &&
+	((opcode == IBV_WR_SEND) || (opcode == IBV_WR_SEND_WITH_IMM) ||
+	 (opcode == IBV_WR_RDMA_WRITE) || (opcode == IBV_WR_RDMA_WRITE_WITH_IMM))) {
+	wr->send_flags = IBV_SEND_INLINE;
+    }
+
+    /* the last wr before running out of credits is always signaled, */
+    /* otherwise nothing would ever give the credits back; reads and */
+    /* atomics are always signaled since their result is needed      */
+    sq->num_unsignaled  += 1;
+    sq->num_outstanding += 1;
+    if (sq->inflight != NULL) {
+	uint32_t pos = sq->inflight_tail + sq->num_outstanding - 1;
+
+	if (pos >= sq->max_outstanding) {
+	    pos -= sq->max_outstanding;
+	}
+	sq->inflight[pos] = slab_owns (sq->slab, buf) ? buf : NULL;
+    }
+    if ((sq->num_unsignaled >= sq->sig_interval) ||
+	(sq->num_outstanding >= sq->max_outstanding) ||
+	(opcode == IBV_WR_RDMA_READ) ||
+	(opcode == IBV_WR_ATOMIC_FETCH_AND_ADD) ||
+	(opcode == IBV_WR_ATOMIC_CMP_AND_SWP)) {
+	wr->wr_id          = IB_WR_ID_SIG | ((uint64_t)peer << 32) | sq->num_unsignaled;
+	wr->send_flags    |= IBV_SEND_SIGNALED;
+	sq->num_unsignaled = 0;
+    }
+
+    if (b->send_head[peer] == NULL) {
+	b->send_head[peer]          = wr;
+	b->active[b->num_active++]  = peer;
+    } else {
+	b->send_tail[peer]->next    = wr;
+    }
+    b->send_tail[peer] = wr;
+
+    b->num_send  += 1;
+    b->num_sends += 1;
+
+    *wr_out = wr;
+    return 0;
+ error:
+    return -1;
+}
+
+/* with a send slab the payload is copied into a slot that only goes */
+/* back with the completion retiring its wr, so buf, usually a recv   */
+/* buffer, can be reposted as soon as this returns. Inline payloads   */
+/* are copied by the provider when the chain is posted, which is soon */
+/* enough unless credits put the srq reposts first                    */
+int batch_send (struct PostBatch *b, uint32_t req_size, uint32_t imm_data,
+		uint32_t peer, char *buf)
+{
+    int                 ret  = 0;
+    struct ibv_send_wr *wr   = NULL;
+    char               *slot = buf;
+
+    if ((b->send_slab != NULL) && (req_size > 0) &&
+	((req_size > b->inline_threshold) || b->credit_flow)) {
+	slot = slab_get (b->send_slab);
+	if (slot == NULL) {
+	    return EAGAIN;
+	}
+    }
+
+    /* ud: all peers share one qp, so they share one chain and credits */
+    ret = batch_add_wr (b, IBV_WR_SEND_WITH_IMM, req_size,
+			(b->ah != NULL) ? b->ud_qp_index : peer, slot, &wr);
+    if (ret != 0) {
+	if (slot != buf) {
+	    slab_put (b->send_slab, slot);
+	}
+	return ret;
+    }
+
+    if (slot != buf) {
+	memcpy (slot, buf, req_size);
+    }
+    wr->imm_data = htonl (imm_data);
+    if (b->ah != NULL) {
+	wr->wr.ud.ah          = b->ah[peer];
+	wr->wr.ud.remote_qpn  = b->remote_qpn[peer];
+	wr->wr.ud.remote_qkey = IB_UD_QKEY;
+    }
+    TRACE_EVENT (TRACE_SEND, peer, slot, req_size);
+    return 0;
+}
+
+int batch_write (struct PostBatch *b, uint32_t req_size, uint32_t peer,
+		 char *buf, uint64_t remote_addr, uint32_t rkey)
+{
+    int ret = 0;
+    struct ibv_send_wr *wr = NULL;
+
+    ret = batch_add_wr (b, IBV_WR_RDMA_WRITE, req_size, peer, buf, &wr);
+    if (ret == 0) {
+	wr->wr.rdma.remote_addr = remote_addr;
+	wr->wr.rdma.rkey        = rkey;
+    }
+    return ret;
+}
+
+int batch_read (struct PostBatch *b, uint32_t req_size, uint32_t peer,
+		uint16_t slot, char *buf, uint64_t remote_addr, uint32_t rkey)
+{
+    return batch_read_to (b, req_size, peer, slot, buf, b->lkey, remote_addr, rkey);
+}
+
+/* read into a buffer outside ib_buf, registered under lkey */
+int batch_read_to (struct PostBatch *b, uint32_t req_size, uint32_t peer,
+		   uint16_t slot, char *buf, uint32_t lkey,
+		   uint64_t remote_addr, uint32_t rkey)
+{
+    int ret = 0;
+    struct ibv_send_wr *wr = NULL;
+
+    ret = batch_add_wr (b, IBV_WR_RDMA_READ, req_size, peer, buf, &wr);
+    if (ret == 0) {
+	wr->wr_id              |= (uint64_t)slot << 16;
+	wr->sg_list->lkey       = lkey;
+	wr->wr.rdma.remote_addr = remote_addr;
+	wr->wr.rdma.rkey        = rkey;
+    }
+    return ret;
+}
+
+/* the old value of the 8-byte target lands in buf */
+int batch_atomic (struct PostBatch *b, enum ibv_wr_opcode opcode,
+		  uint32_t peer, uint16_t slot, char *buf,
+		  uint64_t remote_addr, uint32_t rkey,
+		  uint64_t compare_add, uint64_t swap)
+{
+    int ret = 0;
+    struct ibv_send_wr *wr = NULL;
+
+    ret = batch_add_wr (b, opcode, sizeof(uint64_t), peer, buf, &wr);
+    if (ret == 0) {
+	wr->wr_id                   |= (uint64_t)slot << 16;
+	wr->wr.atomic.remote_addr    = remote_addr;
+	wr->wr.atomic.rkey           = rkey;
+	wr->wr.atomic.compare_add    = compare_add;
+	wr->wr.atomic.swap           = swap;
+    }
+    return ret;
+}
+
+int batch_recv (struct PostBatch *b, uint32_t req_size, char *buf)
+{
+    int ret = 0;
+
+    /* an inline send still reads the buffer it was batched from, */
+    /* so pending sends go out before any repost can               */
+    if (b->num_recv == b->max_wr) {
+	ret = flush_post_batch (b);
+	check (ret == 0, "Failed to flush post batch");
+    }
+
+    struct ibv_sge     *sge = &b->recv_sge[b->num_recv];
+    struct ibv_recv_wr *wr  = &b->recv_wr[b->num_recv];
+
+    sge->addr   = (uintptr_t) buf;
+    sge->length = req_size;
+    sge->lkey   = b->lkey;
+
+    wr->wr_id   = (uint64_t) buf;
+    wr->sg_list = sge;
+    wr->num_sge = 1;
+    wr->next    = (b->num_recv + 1 < b->max_wr) ? wr + 1 : NULL;
+
+    b->num_recv  += 1;
+    b->num_recvs += 1;
+    TRACE_EVENT (TRACE_REPOST, 0, buf, req_size);
+
+    return 0;
+ error:
+    return -1;
+}
+
+void log_post_batch (long thread_id, struct PostBatch *b)
+{
+    log ("thread[%ld]: %ld sends in %ld doorbells (%.2f wr/doorbell), "
+	 "%ld recvs in %ld doorbells (%.2f wr/doorbell), batch_size = %d",
+	 thread_id,
+	 b->num_sends, b->num_send_posts,
+	 b->num_send_posts > 0 ? (double)b->num_sends / b->num_send_posts : 0.0,
+	 b->num_recvs, b->num_recv_posts,
+	 b->num_recv_posts > 0 ? (double)b->num_recvs / b->num_recv_posts : 0.0,
+	 b->max_wr);
+    if (b->credit_flow) {
+	log ("thread[%ld]: %ld credits returned, %ld sends waited for credits",
+	     thread_id, b->num_grants, b->num_credit_stalls);
+    }
+    if (b->send_slab != NULL) {
+	log ("thread[%ld]: send slab: %"PRIu32" slots of %"PRIu32" bytes, "
+	     "%ld sends waited for a slot", thread_id, b->send_slab->num_slots,
+	     b->send_slab->slot_size, b->send_slab->num_empty);
+    }
+}
+
+int init_send_backlog (struct SendBacklog *bl, int cap)
+{
+    bl->num = 0;
+    bl->cap = cap;
+    bl->ent = (struct PendingSend *) calloc (cap, sizeof(struct PendingSend));
+    check (bl->ent != NULL, "Failed to allocate send backlog");
+
+    return 0;
+ error:
+    return -1;
+}
+
+void destroy_send_backlog (struct SendBacklog *bl)
+{
+    if (bl->ent != NULL) {
+	free (bl->ent);
+	bl->ent = NULL;
+    }
+}
+
+int init_cq_waiter (struct CQWaiter *w, struct ibv_comp_channel *channel,
+		    bool sleep, uint64_t budget_ns)
+{
+    struct epoll_event ev = {
+	.events = EPOLLIN,
+    };
+
+    memset (w, 0, sizeof(struct CQWaiter));
+    w->epfd = -1;
+
+    if (sleep != true) {
+	return 0;
+    }
+    check (channel != NULL, "Failed to init cq waiter: no completion channel");
+
+    w->sleep     = true;
+    w->budget_ns = budget_ns;
+    w->channel   = channel;
+
+    w->epfd = epoll_create1 (0);
+    check (w->epfd >= 0, "Failed to create epoll fd");
+
+    ev.data.fd = channel->fd;
+    check (epoll_ctl (w->epfd, EPOLL_CTL_ADD, channel->fd, &ev) == 0,
+	   "Failed to add completion channel to epoll");
+
+    return 0;
+ error:
+    if (w->epfd >= 0) {
+	close (w->epfd);
+	w->epfd = -1;
+    }
+    return -1;
+}
+
+void destroy_cq_waiter (struct CQWaiter *w, struct ibv_cq *cq)
+{
+    /* a cq can only be destroyed once all its events are acked */
+    if (w->num_unacked > 0) {
+	ibv_ack_cq_events (cq, w->num_unacked);
+	w->num_unacked = 0;
+    }
+    if (w->epfd >= 0) {
+	close (w->epfd);
+	w->epfd = -1;
+    }
+}
+
+/*
+ *  wait_poll_cq:
+ *       ibv_poll_cq that gives the cpu away while the cq stays empty.
+ *       busy: plain poll. otherwise an empty cq is polled for budget_ns,
+ *       then armed and re-polled to close the race with a completion
+ *       that arrived meanwhile, and the thread sleeps in epoll_wait on
+ *       the channel fd (non-blocking) until the cq event fires
+ *
+ *  return value:
+ *       number of wcs, 0 if none yet, -1 on error
+ */
+int wait_poll_cq (struct CQWaiter *w, struct ibv_cq *cq, int num_wc,
+		  struct ibv_wc *wc)
+{
+    int      n   = 0;
+    uint64_t now = 0;
+
+    n = ibv_poll_cq (cq, num_wc, wc);
+    if ((n != 0) || (w->sleep != true)) {
+	w->idle_since = 0;
+	return n;
+    }
+
+    now = get_time_ns ();
+    if (w->idle_since == 0) {
+	w->idle_since = now;
+    }
+    if (now - w->idle_since < w->budget_ns) {
+	return 0;
+    }
+
+    check (ibv_req_notify_cq (cq, 0) == 0, "Failed to arm cq");
+    n = ibv_poll_cq (cq, num_wc, wc);
+    if (n != 0) {
+	w->idle_since = 0;
+	return n;
+    }
+
+    struct epoll_event ev;
+    w->num_sleeps += 1;
+    n = epoll_wait (w->epfd, &ev, 1, IB_CQ_WAIT_TIMEOUT_MS);
+    check ((n >= 0) || (errno == EINTR), "Failed to wait for cq event");
+
+    /* drain the channel; events of earlier arms may still be queued */
+    if (n > 0) {
+	struct ibv_cq *ev_cq  = NULL;
+	void          *ev_ctx = NULL;
+
+	w->num_wakeups += 1;
+	while (ibv_get_cq_event (w->channel, &ev_cq, &ev_ctx) == 0) {
+	    w->num_unacked += 1;
+	}
+	if (w->num_unacked >= IB_CQ_ACK_BATCH) {
+	    ibv_ack_cq_events (cq, w->num_unacked);
+	    w->num_unacked = 0;
+	}
+    }
+
+    w->idle_since = 0;
+    return ibv_poll_cq (cq, num_wc, wc);
+ error:
+    return -1;
+}
+
+/*
+ *  flush_send_backlog:
+ *       retry deferred echoes; each echo that goes out gets its
+ *       receive buffer reposted to the srq. entries hold the receive
+ *       buffer, the payload starts grh_size bytes into it, and the
+ *       size the send was deferred at. The buffer goes back at
+ *       recv_size, the largest message of any sweep point
+ *
+ *  return value:
+ *       0 on success (entries may remain), -1 on error
+ */
+int flush_send_backlog (struct SendBacklog *bl, struct PostBatch *b,
+			uint32_t recv_size)
+{
+    int ret = 0, i = 0, n = 0;
+
+    for (i = 0; i < bl->num; i++) {
+	struct PendingSend *ps = &bl->ent[i];
+
+	ret = transport->send (b, ps->size, ps->imm_data, ps->peer,
+			       ps->buf + b->grh_size);
+	if (ret == EAGAIN) {
+	    bl->ent[n++] = *ps;
+	    continue;
+	}
+	check (ret == 0, "Failed to post deferred send to peer[%"PRIu32"]", ps->peer);
+
+	ret = transport->recv (b, recv_size, ps->buf);
+	check (ret == 0, "Failed to repost recv");
+	batch_grant (b, ps->peer);
+    }
+    bl->num = n;
+
+    return 0;
+ error:
+    return -1;
+}
+
+/*
+ *  discard_send_backlog:
+ *       give up on deferred echoes at the end of a run; their
+ *       receive buffers go back to the srq
+ *
+ *  return value:
+ *       0 on success, -1 on error
+ */
+int discard_send_backlog (struct SendBacklog *bl, struct PostBatch *b,
+			  uint32_t recv_size)
+{
+    int ret = 0, i = 0;
+
+    for (i = 0; i < bl->num; i++) {
+	ret = transport->recv (b, recv_size, bl->ent[i].buf);
+	check (ret == 0, "Failed to repost recv");
+    }
+    bl->num = 0;
+
+    return 0;
+ error:
+    return -1;
+}
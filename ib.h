@@ -1,6 +1,7 @@
 #ifndef IB_H_
 #define IB_H_
 
+#include <stdbool.h>
 #include <inttypes.h>
 #include <sys/types.h>
 #include <endian.h>
@@ -8,14 +9,46 @@
 #include <infiniband/verbs.h>
 #include <arpa/inet.h>
 
-#define IB_MTU			IBV_MTU_4096
+#include "slab.h"
+
 #define IB_PORT			1
 #define IB_SL			0
+#define IB_GRH_HOP_LIMIT	64
 #define IB_WR_ID_STOP		0xE000000000000000
 #define NUM_WARMING_UP_OPS      500000
 #define TOT_NUM_OPS             10000000
 #define SIG_INTERVAL            1000
 
+/* wr_id of a signaled send: tag | peer << 32 | slot << 16 | wrs retired */
+/* slot identifies the local buffer of a one-sided op, 0 otherwise      */
+#define IB_WR_ID_TAG_MASK	0xF000000000000000
+#define IB_WR_ID_SIG		0xD000000000000000
+#define IB_WR_ID_SIG_PEER(id)	((uint32_t)(((id) >> 32) & 0x0FFFFFFF))
+#define IB_WR_ID_SIG_SLOT(id)	((uint32_t)(((id) >> 16) & 0xFFFF))
+#define IB_WR_ID_SIG_COUNT(id)	((uint32_t)((id) & 0xFFFF))
+#define IB_WR_ID_MAX_SLOTS	0x10000
+
+/* ud: every receive buffer starts with room for the global route header */
+#define IB_GRH_SIZE		40
+#define IB_UD_QKEY		0x11111111
+
+/* largest max_inline_data tried when creating qps */
+#define IB_MAX_INLINE_PROBE	1024
+
+/* send queue slots kept free for control messages */
+#define IB_SQ_CTL_RESERVE	4
+
+/* srq buffers per peer beyond its window, for control messages; */
+/* those are not covered by receive credits                      */
+#define IB_RECV_CTL_RESERVE	1
+
+/* credit flow control: a data imm carries the sender's rank in its */
+/* low half and the receive credits it returns in the high half,    */
+/* top bit clear so it never reads as a control value               */
+#define IB_IMM_RANK_MASK	0xFFFF
+#define IB_IMM_GRANT_SHIFT	16
+#define IB_IMM_MAX_GRANT	0x7FFF
+
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 static inline uint64_t htonll (uint64_t x) {return bswap_64(x); }
 static inline uint64_t ntohll (uint64_t x) {return bswap_64(x); }
@@ -30,20 +63,215 @@ struct QPInfo {
     uint16_t lid;
     uint32_t qp_num;
     uint32_t rank;
+    uint64_t buf_addr;          /* region this peer may access one-sided */
+    uint32_t rkey;
+    uint8_t  mtu;               /* enum ibv_mtu, active on the sender's port */
+    uint8_t  gid[16];           /* raw union ibv_gid, roce has no lids */
 }__attribute__ ((packed));
 
+/* imm_data carries the sender's rank, keep control values out of that range */
 enum MsgType {
-    MSG_CTL_START = 100,
+    MSG_CTL_START = 0xFFFF0000,
     MSG_CTL_STOP,
+    MSG_CTL_DONE,            /* client: nothing more in flight after this */
+};
+
+/* per-qp send queue accounting for selective signaling */
+struct QPSendState {
+    uint32_t  sig_interval;     /* signal every sig_interval-th wr */
+    uint32_t  num_unsignaled;   /* wrs posted since the last signaled one */
+    uint32_t  num_outstanding;  /* wrs not yet retired by a send completion */
+    uint32_t  max_outstanding;  /* send queue credits */
+
+    /* credit flow control: sends the peer has a posted recv for, */
+    /* and recvs we reposted for the peer but not yet announced   */
+    uint32_t  credits;
+    uint32_t  max_credits;
+    uint32_t  pending_grant;
+
+    /* send slab slots of the wrs not yet retired, oldest first at */
+    /* inflight_tail, NULL for wrs without one; NULL if no slab     */
+    char            **inflight;
+    uint32_t          inflight_tail;
+    struct SlabPool  *slab;
+}__attribute__((aligned(64)));
+
+/* echoes that could not be posted for lack of send queue credits */
+struct PendingSend {
+    char     *buf;
+    uint32_t  peer;
+    uint32_t  imm_data;
+    uint32_t  size;         /* of the send, echo, reply or rndv ack */
+};
+
+/* wrs gathered from one poll batch, posted as one chain per qp and */
+/* one chain for the srq so that each chain costs a single doorbell  */
+struct PostBatch {
+    int                   max_wr;       /* capacity of each chain */
+    uint32_t              lkey;
+    uint32_t              inline_threshold;
+    struct ibv_qp       **qp;
+
+    /* ud: sends to any peer go out on qp[ud_qp_index] using ah[peer] */
+    struct ibv_ah       **ah;
+    uint32_t             *remote_qpn;
+    uint32_t              ud_qp_index;
+    uint32_t              grh_size;     /* recv buffers hold this before the payload */
+
+    struct QPSendState   *sq_state;
+    struct ibv_srq       *srq;
+    struct ibv_cq        *cq;
+    void                 *ctx;          /* backend state of the owning thread */
+    bool                  credit_flow;  /* sends with imm need receive credits */
+    struct SlabPool      *send_slab;    /* send payloads are copied here, NULL: */
+                                        /* sent from the caller's buffer        */
+
+    int                   num_send;
+    struct ibv_send_wr   *send_wr;
+    struct ibv_sge       *send_sge;
+    struct ibv_send_wr  **send_head;    /* per qp chain */
+    struct ibv_send_wr  **send_tail;
+    int                   num_active;
+    uint32_t             *active;       /* qps with a non-empty chain */
+
+    int                   num_recv;
+    struct ibv_recv_wr   *recv_wr;
+    struct ibv_sge       *recv_sge;
+
+    /* statistics */
+    long                  num_sends;
+    long                  num_send_posts;
+    long                  num_recvs;
+    long                  num_recv_posts;
+    long                  num_credit_stalls; /* sends refused for lack of credits */
+    long                  num_grants;        /* credits returned to peers */
+};
+
+struct SendBacklog {
+    int                  num;
+    int                  cap;
+    struct PendingSend  *ent;
 };
 
-int modify_qp_to_rts (struct ibv_qp *qp, uint32_t qp_num, uint16_t lid);
+/* cq events are acked in batches, acking takes a lock in libibverbs */
+#define IB_CQ_ACK_BATCH		64
+/* upper bound on one sleep, the loop re-polls after it */
+#define IB_CQ_WAIT_TIMEOUT_MS	100
+
+/* polls a cq and, once it has been empty for budget_ns, arms it and */
+/* sleeps on the completion channel until the next completion       */
+struct CQWaiter {
+    bool                      sleep;
+    uint64_t                  budget_ns;
+    uint64_t                  idle_since;  /* 0 while completions arrive */
+    struct ibv_comp_channel  *channel;
+    int                       epfd;
+    unsigned int              num_unacked;
+
+    /* stats */
+    long                      num_sleeps;
+    long                      num_wakeups; /* sleeps ended by a cq event */
+};
+
+void fill_ah_attr (struct ibv_ah_attr *ah_attr, uint16_t lid, const uint8_t *gid,
+		   int sgid_index, uint8_t port_num);
+
+int modify_qp_to_rts (struct ibv_qp *qp, uint32_t qp_num, struct ibv_ah_attr *ah_attr,
+		      enum ibv_mtu mtu, uint8_t max_rd_atomic, uint8_t max_dest_rd_atomic);
+int modify_ud_qp_to_rts (struct ibv_qp *qp, uint8_t port_num);
+
+struct ibv_ah *create_ud_ah (struct ibv_pd *pd, struct ibv_ah_attr *ah_attr);
 
 int post_send (uint32_t req_size, uint32_t lkey, uint64_t wr_id, 
 	       uint32_t imm_data, struct ibv_qp *qp, char *buf);
 
+int post_send_ud (uint32_t req_size, uint32_t lkey, uint64_t wr_id,
+		  uint32_t imm_data, struct ibv_qp *qp, struct ibv_ah *ah,
+		  uint32_t remote_qpn, char *buf);
+
 int post_srq_recv (uint32_t req_size, uint32_t lkey, uint64_t wr_id, 
 		   struct ibv_srq *srq, char *buf);
 
+void init_qp_send_state (struct QPSendState *sq, uint32_t sig_interval,
+			 uint32_t max_send_wr, uint32_t max_credits);
+void reset_qp_send_state (struct QPSendState *sq);
+void retire_send        (struct QPSendState *sq_state, uint64_t wr_id);
+
+int  init_post_batch       (struct PostBatch *b, int max_wr, uint32_t lkey,
+			    uint32_t inline_threshold, struct ibv_qp **qp,
+			    struct QPSendState *sq_state, int num_qps,
+			    struct ibv_srq *srq);
+void batch_set_ud          (struct PostBatch *b, struct ibv_ah **ah,
+			    uint32_t *remote_qpn, uint32_t ud_qp_index);
+void destroy_post_batch    (struct PostBatch *b);
+int  batch_add_wr          (struct PostBatch *b, enum ibv_wr_opcode opcode,
+			    uint32_t req_size, uint32_t peer, char *buf,
+			    struct ibv_send_wr **wr_out);
+int  batch_send            (struct PostBatch *b, uint32_t req_size,
+			    uint32_t imm_data, uint32_t peer, char *buf);
+int  batch_write           (struct PostBatch *b, uint32_t req_size,
+			    uint32_t peer, char *buf, uint64_t remote_addr,
+			    uint32_t rkey);
+int  batch_read            (struct PostBatch *b, uint32_t req_size,
+			    uint32_t peer, uint16_t slot, char *buf,
+			    uint64_t remote_addr, uint32_t rkey);
+int  batch_read_to         (struct PostBatch *b, uint32_t req_size,
+			    uint32_t peer, uint16_t slot, char *buf,
+			    uint32_t lkey, uint64_t remote_addr, uint32_t rkey);
+int  batch_atomic          (struct PostBatch *b, enum ibv_wr_opcode opcode,
+			    uint32_t peer, uint16_t slot, char *buf,
+			    uint64_t remote_addr, uint32_t rkey,
+			    uint64_t compare_add, uint64_t swap);
+int  batch_recv            (struct PostBatch *b, uint32_t req_size, char *buf);
+int  flush_post_batch_send (struct PostBatch *b);
+int  flush_post_batch_recv (struct PostBatch *b);
+int  flush_post_batch      (struct PostBatch *b);
+void log_post_batch        (long thread_id, struct PostBatch *b);
+
+int  init_cq_waiter    (struct CQWaiter *w, struct ibv_comp_channel *channel,
+			bool sleep, uint64_t budget_ns);
+void destroy_cq_waiter (struct CQWaiter *w, struct ibv_cq *cq);
+int  wait_poll_cq      (struct CQWaiter *w, struct ibv_cq *cq, int num_wc,
+			struct ibv_wc *wc);
+
+int  init_send_backlog    (struct SendBacklog *bl, int cap);
+void destroy_send_backlog (struct SendBacklog *bl);
+int  flush_send_backlog   (struct SendBacklog *bl, struct PostBatch *b,
+			   uint32_t recv_size);
+int  discard_send_backlog (struct SendBacklog *bl, struct PostBatch *b,
+			   uint32_t recv_size);
+
+static inline void push_send_backlog (struct SendBacklog *bl, char *buf,
+				      uint32_t peer, uint32_t imm_data,
+				      uint32_t size)
+{
+    struct PendingSend *ps = &bl->ent[bl->num++];
+
+    ps->buf      = buf;
+    ps->peer     = peer;
+    ps->imm_data = imm_data;
+    ps->size     = size;
+}
+
+/* credit flow control: the buffer a data msg of peer arrived in was */
+/* reposted, the next send to peer hands the credit back              */
+static inline void batch_grant (struct PostBatch *b, uint32_t peer)
+{
+    if (b->credit_flow) {
+	b->sq_state[peer].pending_grant += 1;
+    }
+}
+
+/* the sender's rank of a data imm, after taking the credits it   */
+/* returns; control values and imms without credits pass as they are */
+static inline uint32_t batch_take_credits (struct PostBatch *b, uint32_t imm_data)
+{
+    if ((b->credit_flow != true) || (imm_data >= MSG_CTL_START)) {
+	return imm_data;
+    }
+    b->sq_state[imm_data & IB_IMM_RANK_MASK].credits += imm_data >> IB_IMM_GRANT_SHIFT;
+    return imm_data & IB_IMM_RANK_MASK;
+}
+
 
 #endif /*ib.h*/
@@ -6,9 +6,14 @@
 #include "setup_ib.h"
 #include "client.h"
 #include "server.h"
+#include "sweep.h"
+#include "transport.h"
+#include "trace.h"
 
 FILE	*log_fp	     = NULL;
 
+struct TransportOps *transport = &ib_transport;
+
 int	init_env    ();
 void	destroy_env ();
 
@@ -25,13 +30,22 @@ int main (int argc, char *argv[])
     check (ret == 0, "Failed to parse config file");
     config_info.sock_port = argv[2];
 
+    if (config_info.backend == BACKEND_SHM) {
+        transport = &shm_transport;
+    }
+
     ret = init_env ();
     check (ret == 0, "Failed to init env");
 
-    ret = setup_ib ();
-    check (ret == 0, "Failed to setup IB");
+    ret = transport->setup ();
+    check (ret == 0, "Failed to setup %s transport", transport->name);
 
-    if (config_info.is_server) {
+    ret = trace_init (ib_res.num_threads);
+    check (ret == 0, "Failed to init trace");
+
+    if (config_info.num_sweep_sizes > 0) {
+        ret = run_sweep ();
+    } else if (config_info.is_server) {
         ret = run_server ();
     } else {
         ret = run_client ();
@@ -39,7 +53,8 @@ int main (int argc, char *argv[])
     check (ret == 0, "Failed to run workload");
 
  error:
-    close_ib_connection ();
+    trace_finish ();
+    transport->close ();
     destroy_env         ();
     return ret;
 }    
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "stats.h"
+#include "mrcache.h"
+#include "transport.h"
+
+/* registrations cover whole pages */
+#define MRCACHE_PAGE_SIZE	4096UL
+
+void mrcache_init (struct MRCache *c, struct ibv_pd *pd, int access, size_t budget)
+{
+    memset (c, 0, sizeof(struct MRCache));
+    c->pd     = pd;
+    c->access = access;
+    c->budget = budget;
+}
+
+/* the first indexed entry ending above addr, num_ent if none */
+static int index_find (struct MRCache *c, uintptr_t addr)
+{
+    int lo = 0, hi = c->num_ent;
+
+    while (lo < hi) {
+	int mid = (lo + hi) / 2;
+
+	if (c->index[mid]->end <= addr) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return lo;
+}
+
+static int index_insert (struct MRCache *c, int i, struct MRCacheEntry *e)
+{
+    if (c->num_ent == c->cap) {
+	int                   cap   = (c->cap > 0) ? 2 * c->cap : 16;
+	struct MRCacheEntry **index = NULL;
+
+	index = (struct MRCacheEntry **) realloc (c->index, cap * sizeof(*index));
+	check (index != NULL, "Failed to grow mr cache index to %d entries", cap);
+	c->index = index;
+	c->cap   = cap;
+    }
+
+    memmove (&c->index[i + 1], &c->index[i],
+	     (c->num_ent - i) * sizeof(struct MRCacheEntry *));
+    c->index[i]  = e;
+    c->num_ent  += 1;
+    return 0;
+ error:
+    return -1;
+}
+
+static void lru_unlink (struct MRCache *c, struct MRCacheEntry *e)
+{
+    if (e->prev != NULL) {
+	e->prev->next = e->next;
+    } else {
+	c->lru_head = e->next;
+    }
+    if (e->next != NULL) {
+	e->next->prev = e->prev;
+    } else {
+	c->lru_tail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void lru_push (struct MRCache *c, struct MRCacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = c->lru_head;
+    if (c->lru_head != NULL) {
+	c->lru_head->prev = e;
+    } else {
+	c->lru_tail = e;
+    }
+    c->lru_head = e;
+}
+
+static void entry_release (struct MRCache *c, struct MRCacheEntry *e)
+{
+    c->pinned -= e->end - e->start;
+    transport->dereg_mr (e->mr);
+    free (e);
+}
+
+/* drop index[i, i + n) from lookups; entries still in use */
+/* are released by their last mrcache_put                   */
+static void index_retire (struct MRCache *c, int i, int n)
+{
+    int k = 0;
+
+    for (k = i; k < i + n; k++) {
+	struct MRCacheEntry *e = c->index[k];
+
+	e->indexed = false;
+	lru_unlink (c, e);
+	if (e->refcnt == 0) {
+	    entry_release (c, e);
+	}
+    }
+    memmove (&c->index[i], &c->index[i + n],
+	     (c->num_ent - i - n) * sizeof(struct MRCacheEntry *));
+    c->num_ent -= n;
+}
+
+/* deregister unused entries, least recently used first, until */
+/* len more bytes fit in the budget                             */
+static void make_room (struct MRCache *c, size_t len)
+{
+    struct MRCacheEntry *e = c->lru_tail, *prev = NULL;
+
+    while ((e != NULL) && (c->pinned + len > c->budget)) {
+	prev = e->prev;
+	if (e->refcnt == 0) {
+	    index_retire (c, index_find (c, e->start), 1);
+	    c->num_evictions += 1;
+	}
+	e = prev;
+    }
+    if (c->pinned + len > c->budget) {
+	c->num_over_budget += 1;
+    }
+}
+
+/*
+ *  mrcache_get:
+ *       a registration covering [addr, addr + len), with a reference
+ *       held until mrcache_put; a miss registers, which is slow
+ *
+ *  return value:
+ *       the entry, or NULL if registration failed
+ */
+struct MRCacheEntry *mrcache_get (struct MRCache *c, void *addr, size_t len)
+{
+    uintptr_t            start = (uintptr_t)addr & ~(MRCACHE_PAGE_SIZE - 1);
+    uintptr_t            end   = ((uintptr_t)addr + len + MRCACHE_PAGE_SIZE - 1) &
+	~(MRCACHE_PAGE_SIZE - 1);
+    struct MRCacheEntry *e     = NULL;
+    uint64_t             t0    = 0, dt = 0;
+    int                  i     = index_find (c, start), j = 0, ret = 0;
+
+    if ((i < c->num_ent) && (c->index[i]->start <= start) && (c->index[i]->end >= end)) {
+	e = c->index[i];
+	e->refcnt += 1;
+	lru_unlink (c, e);
+	lru_push (c, e);
+	c->num_hits += 1;
+	return e;
+    }
+    c->num_misses += 1;
+
+    /* one registration replaces every entry the range touches */
+    for (j = i; (j < c->num_ent) && (c->index[j]->start < end); j++) {
+	if (c->index[j]->start < start) {
+	    start = c->index[j]->start;
+	}
+	if (c->index[j]->end > end) {
+	    end = c->index[j]->end;
+	}
+    }
+    c->num_merges += j - i;
+    index_retire (c, i, j - i);
+
+    if (c->budget > 0) {
+	make_room (c, end - start);
+    }
+
+    e = (struct MRCacheEntry *) calloc (1, sizeof(struct MRCacheEntry));
+    check (e != NULL, "Failed to allocate mr cache entry");
+
+    t0    = get_time_ns ();
+    e->mr = transport->reg_mr (c->pd, (void *)start, end - start, c->access);
+    dt    = get_time_ns () - t0;
+    check (e->mr != NULL, "Failed to register %zu bytes at %p",
+	   (size_t)(end - start), (void *)start);
+
+    c->reg_ns += dt;
+    if (dt > c->max_reg_ns) {
+	c->max_reg_ns = dt;
+    }
+    c->pinned  += end - start;
+    e->start    = start;
+    e->end      = end;
+    e->refcnt   = 1;
+    e->indexed  = true;
+
+    ret = index_insert (c, index_find (c, start), e);
+    if (ret != 0) {
+	/* usable, just never found again */
+	e->indexed = false;
+	return e;
+    }
+    lru_push (c, e);
+    return e;
+
+ error:
+    if (e != NULL) {
+	free (e);
+    }
+    return NULL;
+}
+
+void mrcache_put (struct MRCache *c, struct MRCacheEntry *e)
+{
+    e->refcnt -= 1;
+    if ((e->refcnt == 0) && (e->indexed != true)) {
+	entry_release (c, e);
+    }
+}
+
+/* [addr, addr + len) is about to be freed or unmapped */
+void mrcache_invalidate (struct MRCache *c, void *addr, size_t len)
+{
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end   = start + len;
+    int       i     = index_find (c, start), j = 0;
+
+    for (j = i; (j < c->num_ent) && (c->index[j]->start < end); j++) {
+	;
+    }
+    c->num_invalidations += j - i;
+    index_retire (c, i, j - i);
+}
+
+/* every reference must have been put */
+void mrcache_destroy (struct MRCache *c)
+{
+    index_retire (c, 0, c->num_ent);
+    if (c->index != NULL) {
+	free (c->index);
+    }
+    c->index = NULL;
+    c->cap   = 0;
+}
+
+void mrcache_log (char *name, struct MRCache *c)
+{
+    long lookups = c->num_hits + c->num_misses;
+
+    if (lookups == 0) {
+	return;
+    }
+    log ("%s: mr cache: %ld lookups, %.1f%% hits, %ld merges, %ld evictions, "
+	 "%ld invalidations, %zu KiB pinned", name, lookups,
+	 100.0 * c->num_hits / lookups, c->num_merges, c->num_evictions,
+	 c->num_invalidations, c->pinned >> 10);
+    log ("%s: mr cache: ibv_reg_mr avg %.1f us, max %.1f us over %ld misses",
+	 name, c->reg_ns / 1000.0 / c->num_misses, c->max_reg_ns / 1000.0,
+	 c->num_misses);
+    if (c->num_over_budget > 0) {
+	log ("%s: mr cache: %ld registrations went over the %zu KiB budget",
+	     name, c->num_over_budget, c->budget >> 10);
+    }
+}
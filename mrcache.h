@@ -0,0 +1,63 @@
+#ifndef MRCACHE_H_
+#define MRCACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <infiniband/verbs.h>
+
+/* a registration of the pages [start, end); mr stays valid while */
+/* refcnt > 0, even after the range was invalidated or merged     */
+struct MRCacheEntry {
+    uintptr_t             start;
+    uintptr_t             end;
+    struct ibv_mr        *mr;
+    int                   refcnt;
+    bool                  indexed;  /* still found by lookups */
+    struct MRCacheEntry  *prev;     /* lru list of indexed entries, */
+    struct MRCacheEntry  *next;     /* most recently used first     */
+};
+
+/*
+ * registration cache, owned by one thread: application buffers are
+ * registered on first use and the registration is reused by every
+ * later send from inside the same pages. The index is an array of
+ * non-overlapping entries sorted by start address; a miss that
+ * overlaps indexed entries registers the union and retires them, so
+ * neighbouring buffers end up sharing one mr. Above budget bytes of
+ * pinned memory unreferenced entries are deregistered in lru order.
+ * Memory must be invalidated before it is freed or unmapped.
+ */
+struct MRCache {
+    struct ibv_pd         *pd;
+    int                    access;  /* ibv_reg_mr flags of every entry */
+    size_t                 budget;  /* pinned bytes, 0: unlimited */
+    size_t                 pinned;  /* bytes of every live mr */
+
+    struct MRCacheEntry  **index;
+    int                    num_ent;
+    int                    cap;
+    struct MRCacheEntry   *lru_head;
+    struct MRCacheEntry   *lru_tail;
+
+    /* statistics */
+    long                   num_hits;
+    long                   num_misses;
+    long                   num_merges;      /* entries folded into a larger one */
+    long                   num_evictions;
+    long                   num_invalidations;
+    long                   num_over_budget; /* registrations nothing could make room for */
+    uint64_t               reg_ns;          /* total ibv_reg_mr time */
+    uint64_t               max_reg_ns;
+};
+
+void mrcache_init    (struct MRCache *c, struct ibv_pd *pd, int access, size_t budget);
+void mrcache_destroy (struct MRCache *c);
+
+struct MRCacheEntry *mrcache_get (struct MRCache *c, void *addr, size_t len);
+void mrcache_put        (struct MRCache *c, struct MRCacheEntry *e);
+void mrcache_invalidate (struct MRCache *c, void *addr, size_t len);
+
+void mrcache_log (char *name, struct MRCache *c);
+
+#endif /* MRCACHE_H_ */
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "debug.h"
+#include "pool.h"
+#include "transport.h"
+
+static int pool_class (size_t len)
+{
+    int shift = POOL_MIN_SHIFT;
+
+    while ((shift <= POOL_MAX_SHIFT) && (((size_t)1 << shift) < len)) {
+	shift += 1;
+    }
+    return shift - POOL_MIN_SHIFT;
+}
+
+void pool_init (struct BufPool *p, struct ibv_pd *pd, int access)
+{
+    memset (p, 0, sizeof(struct BufPool));
+    p->pd     = pd;
+    p->access = access;
+}
+
+/*
+ *  pool_get:
+ *       the smallest class holding len bytes; an empty class grows,
+ *       which registers memory and is slow
+ *
+ *  return value:
+ *       the buffer, or NULL if len is beyond the largest class or
+ *       allocation or registration failed
+ */
+struct PoolBuf *pool_get (struct BufPool *p, size_t len)
+{
+    int             c   = pool_class (len);
+    struct PoolBuf *buf = NULL;
+
+    check (c < POOL_NUM_CLASSES, "Failed to get pool buffer: %zu bytes "
+	   "exceed the largest class", len);
+
+    if (p->free[c] != NULL) {
+	buf        = p->free[c];
+	p->free[c] = buf->next;
+	return buf;
+    }
+
+    buf = (struct PoolBuf *) calloc (1, sizeof(struct PoolBuf));
+    check (buf != NULL, "Failed to allocate pool buffer");
+
+    buf->size = (size_t)1 << (c + POOL_MIN_SHIFT);
+    buf->addr = (char *) memalign (4096, buf->size);
+    check (buf->addr != NULL, "Failed to allocate %zu bytes of pool buffer", buf->size);
+
+    buf->mr = transport->reg_mr (p->pd, buf->addr, buf->size, p->access);
+    check (buf->mr != NULL, "Failed to register %zu bytes of pool buffer", buf->size);
+
+    p->num_bufs  += 1;
+    p->num_bytes += buf->size;
+    return buf;
+
+ error:
+    if (buf != NULL) {
+	if (buf->addr != NULL) {
+	    free (buf->addr);
+	}
+	free (buf);
+    }
+    return NULL;
+}
+
+void pool_put (struct BufPool *p, struct PoolBuf *buf)
+{
+    int c = pool_class (buf->size);
+
+    buf->next  = p->free[c];
+    p->free[c] = buf;
+}
+
+/* every buffer must be back on its free list */
+void pool_destroy (struct BufPool *p)
+{
+    int             c   = 0;
+    struct PoolBuf *buf = NULL;
+
+    for (c = 0; c < POOL_NUM_CLASSES; c++) {
+	while (p->free[c] != NULL) {
+	    buf        = p->free[c];
+	    p->free[c] = buf->next;
+	    transport->dereg_mr (buf->mr);
+	    free (buf->addr);
+	    free (buf);
+	}
+    }
+    p->num_bufs  = 0;
+    p->num_bytes = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <infiniband/verbs.h>
+
+/* power-of-two size classes, 4 KiB to 1 GiB */
+#define POOL_MIN_SHIFT		12
+#define POOL_MAX_SHIFT		30
+#define POOL_NUM_CLASSES	(POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+/* a registered buffer of its class size; addr and mr stay valid */
+/* until the pool is destroyed                                    */
+struct PoolBuf {
+    char            *addr;
+    size_t           size;
+    struct ibv_mr   *mr;
+    struct PoolBuf  *next;      /* free list */
+};
+
+/*
+ * size-classed pool of registered buffers, owned by one thread. A
+ * class grows by one buffer, allocated and registered on the spot,
+ * whenever it is empty; buffers go back to the free list of their
+ * class and are only deregistered by pool_destroy, so a steady
+ * workload stops registering after warmup.
+ */
+struct BufPool {
+    struct ibv_pd   *pd;
+    int              access;    /* ibv_reg_mr flags of every buffer */
+    struct PoolBuf  *free[POOL_NUM_CLASSES];
+
+    /* statistics */
+    long             num_bufs;
+    size_t           num_bytes;
+};
+
+void            pool_init    (struct BufPool *p, struct ibv_pd *pd, int access);
+struct PoolBuf *pool_get     (struct BufPool *p, size_t len);
+void            pool_put     (struct BufPool *p, struct PoolBuf *buf);
+void            pool_destroy (struct BufPool *p);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,47 @@
+#ifndef RING_H_
+#define RING_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/*
+ * one-sided transport: every peer owns a ring of num_concurr_msgs
+ * slots in the other side's registered buffer and fills it with
+ * RDMA WRITEs. A slot is the payload, padded to 8 bytes, followed
+ * by a 64-bit sequence number. The n-th message (starting at 0) of
+ * a ring lands in slot n % num_slots with sequence number n + 1;
+ * the sequence number is the last thing the nic writes, so the
+ * receiver detects arrival by polling it. The peer's ring for us is
+ * found in ib_res.remote_buf.
+ */
+struct PeerRing {
+    char      *recv_ring;       /* written by the peer */
+    char      *send_ring;       /* staging slots for our writes */
+    uint64_t   recv_seq;        /* messages consumed */
+    uint64_t   send_seq;        /* messages written */
+}__attribute__((aligned(64)));
+
+static inline size_t ring_slot_size (int msg_size)
+{
+    return (((size_t)msg_size + 7) & ~(size_t)7) + sizeof(uint64_t);
+}
+
+static inline size_t ring_slot_offset (uint64_t seq, int num_slots,
+				       size_t slot_size)
+{
+    return (size_t)(seq % num_slots) * slot_size;
+}
+
+static inline uint64_t *ring_slot_seq (char *slot, size_t slot_size)
+{
+    return (uint64_t *)(slot + slot_size - sizeof(uint64_t));
+}
+
+/* acquire: the payload is only read after the sequence number matched */
+static inline int ring_slot_ready (char *slot, size_t slot_size, uint64_t seq)
+{
+    return __atomic_load_n (ring_slot_seq (slot, slot_size),
+			    __ATOMIC_ACQUIRE) == seq + 1;
+}
+
+#endif /* RING_H_ */
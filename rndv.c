@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "rndv.h"
+
+int rndv_init (struct RndvTable *t, int cap)
+{
+    int i = 0;
+
+    memset (t, 0, sizeof(struct RndvTable));
+    t->cap  = cap;
+    t->ent  = (struct RndvRead *) calloc (cap, sizeof(struct RndvRead));
+    t->free = (int *) calloc (cap, sizeof(int));
+    t->wait = (int *) calloc (cap, sizeof(int));
+    check ((t->ent != NULL) && (t->free != NULL) && (t->wait != NULL),
+	   "Failed to allocate rendezvous table");
+
+    for (i = 0; i < cap; i++) {
+	t->free[i] = cap - 1 - i;
+    }
+    t->num_free = cap;
+    return 0;
+ error:
+    rndv_destroy (t);
+    return -1;
+}
+
+void rndv_destroy (struct RndvTable *t)
+{
+    if (t->ent != NULL) {
+	free (t->ent);
+	t->ent = NULL;
+    }
+    if (t->free != NULL) {
+	free (t->free);
+	t->free = NULL;
+    }
+    if (t->wait != NULL) {
+	free (t->wait);
+	t->wait = NULL;
+    }
+}
+
+static int rndv_issue (struct RndvTable *t, struct PostBatch *b, int idx)
+{
+    struct RndvRead *r    = &t->ent[idx];
+    struct RndvDesc *desc = (struct RndvDesc *)(r->msg + b->grh_size);
+
+    return batch_read_to (b, desc->len, r->peer, idx, r->buf->addr, r->buf->mr->lkey,
+			  desc->addr, desc->rkey);
+}
+
+/*
+ *  rndv_start_read:
+ *       pull the payload described by the descriptor in msg from
+ *       peer; without a send credit the READ waits for
+ *       rndv_retry_wait
+ *
+ *  return value:
+ *       0 on success, -1 on error
+ */
+int rndv_start_read (struct RndvTable *t, struct PostBatch *b,
+		     struct BufPool *pool, char *msg, uint32_t peer)
+{
+    int              ret  = 0, idx = 0;
+    struct RndvDesc *desc = (struct RndvDesc *)(msg + b->grh_size);
+
+    check (t->num_free > 0, "Failed to start read from peer[%"PRIu32"]: "
+	   "%d reads in progress", peer, t->cap);
+
+    idx = t->free[--t->num_free];
+    t->ent[idx].msg  = msg;
+    t->ent[idx].peer = peer;
+    t->ent[idx].buf  = pool_get (pool, desc->len);
+    check (t->ent[idx].buf != NULL, "Failed to get a %"PRIu32"-byte buffer for "
+	   "peer[%"PRIu32"]", desc->len, peer);
+
+    ret = rndv_issue (t, b, idx);
+    if (ret == EAGAIN) {
+	t->wait[t->num_wait++] = idx;
+	return 0;
+    }
+    check (ret == 0, "Failed to post read from peer[%"PRIu32"]", peer);
+    return 0;
+ error:
+    return -1;
+}
+
+/* in arrival order, up to the first one still short of credits */
+int rndv_retry_wait (struct RndvTable *t, struct PostBatch *b)
+{
+    int ret = 0, i = 0, n = 0;
+
+    for (i = 0; i < t->num_wait; i++) {
+	ret = rndv_issue (t, b, t->wait[i]);
+	if (ret == EAGAIN) {
+	    break;
+	}
+	check (ret == 0, "Failed to post read from peer[%"PRIu32"]",
+	       t->ent[t->wait[i]].peer);
+    }
+
+    n = t->num_wait - i;
+    memmove (t->wait, t->wait + i, n * sizeof(int));
+    t->num_wait = n;
+    return 0;
+ error:
+    return -1;
+}
+
+/*
+ *  rndv_read_done:
+ *       the READ of slot completed; the payload is consumed on the
+ *       spot, its buffer goes back to the pool
+ *
+ *  return value:
+ *       the recv buffer holding the descriptor, to send back to peer
+ */
+char *rndv_read_done (struct RndvTable *t, struct BufPool *pool,
+		      uint16_t slot, uint32_t *peer)
+{
+    struct RndvRead *r = &t->ent[slot];
+
+    pool_put (pool, r->buf);
+    r->buf = NULL;
+    t->free[t->num_free++] = slot;
+    *peer = r->peer;
+    return r->msg;
+}
+
+/* end of a run: reads never posted are dropped, their recvs reposted */
+int rndv_discard_wait (struct RndvTable *t, struct PostBatch *b,
+		       struct BufPool *pool, uint32_t recv_size)
+{
+    int ret = 0, i = 0;
+
+    for (i = 0; i < t->num_wait; i++) {
+	struct RndvRead *r = &t->ent[t->wait[i]];
+
+	pool_put (pool, r->buf);
+	r->buf = NULL;
+	ret = batch_recv (b, recv_size, r->msg);
+	check (ret == 0, "Failed to repost recv");
+	t->free[t->num_free++] = t->wait[i];
+    }
+    t->num_wait = 0;
+    return 0;
+ error:
+    return -1;
+}
@@ -0,0 +1,61 @@
+#ifndef RNDV_H_
+#define RNDV_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "ib.h"
+#include "pool.h"
+#include "config.h"
+
+/*
+ * rendezvous: a message above eager_threshold does not travel in
+ * the SEND itself. The sender posts a descriptor of its registered
+ * source buffer, the receiver pulls the payload with RDMA READ into
+ * a buffer of its pool and acknowledges by sending the descriptor
+ * back, after which the source buffer may be reused. srq slots only
+ * need to hold eager messages and descriptors.
+ */
+struct RndvDesc {
+    uint64_t  tag;              /* returned untouched; latency mode: send time */
+    uint64_t  addr;
+    uint32_t  rkey;
+    uint32_t  len;
+};
+
+/* a descriptor being served: the recv buffer holding it stays */
+/* out of the srq until the ack went out from it               */
+struct RndvRead {
+    char            *msg;
+    uint32_t         peer;
+    struct PoolBuf  *buf;
+};
+
+/* per thread; the index of an entry is the slot of its READ wr_id */
+struct RndvTable {
+    int               cap;
+    struct RndvRead  *ent;
+    int              *free;     /* stack of unused entries */
+    int               num_free;
+    int              *wait;     /* entries whose READ found no send credit */
+    int               num_wait;
+};
+
+static inline bool rndv_enabled (int msg_size)
+{
+    return (config_info.eager_threshold > 0) &&
+	(msg_size > config_info.eager_threshold);
+}
+
+int  rndv_init    (struct RndvTable *t, int cap);
+void rndv_destroy (struct RndvTable *t);
+
+int   rndv_start_read (struct RndvTable *t, struct PostBatch *b,
+		       struct BufPool *pool, char *msg, uint32_t peer);
+int   rndv_retry_wait (struct RndvTable *t, struct PostBatch *b);
+char *rndv_read_done  (struct RndvTable *t, struct BufPool *pool,
+		       uint16_t slot, uint32_t *peer);
+int   rndv_discard_wait (struct RndvTable *t, struct PostBatch *b,
+			 struct BufPool *pool, uint32_t recv_size);
+
+#endif /* RNDV_H_ */
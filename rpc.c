@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "rpc.h"
+
+static int rpc_echo (char *buf, uint32_t req_len, uint32_t buf_size)
+{
+    return req_len;
+}
+
+static int rpc_null (char *buf, uint32_t req_len, uint32_t buf_size)
+{
+    return 0;
+}
+
+static int rpc_checksum (char *buf, uint32_t req_len, uint32_t buf_size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    uint32_t i    = 0;
+
+    if (buf_size < sizeof(uint64_t)) {
+	return -1;
+    }
+    for (i = 0; i < req_len; i++) {
+	hash ^= (uint8_t)buf[i];
+	hash *= 0x100000001b3ULL;
+    }
+    memcpy (buf, &hash, sizeof(uint64_t));
+    return sizeof(uint64_t);
+}
+
+static struct RPCHandler rpc_handlers[RPC_MAX_OPS] = {
+    [RPC_OP_ECHO]     = {"echo",     rpc_echo},
+    [RPC_OP_NULL]     = {"null",     rpc_null},
+    [RPC_OP_CHECKSUM] = {"checksum", rpc_checksum},
+};
+
+/* before the worker threads start; later registrations race them */
+int rpc_register (uint16_t opcode, const char *name, RPCHandlerFn fn)
+{
+    check (opcode < RPC_MAX_OPS, "Failed to register rpc %s: opcode %"PRIu16" "
+	   "out of range", name, opcode);
+    check (rpc_handlers[opcode].fn == NULL, "Failed to register rpc %s: opcode "
+	   "%"PRIu16" taken by %s", name, opcode, rpc_handlers[opcode].name);
+
+    rpc_handlers[opcode].name = name;
+    rpc_handlers[opcode].fn   = fn;
+    return 0;
+ error:
+    return -1;
+}
+
+bool rpc_has_op (uint16_t opcode)
+{
+    return (opcode < RPC_MAX_OPS) && (rpc_handlers[opcode].fn != NULL);
+}
+
+const char *rpc_op_name (uint16_t opcode)
+{
+    if (rpc_has_op (opcode) != true) {
+	return "unknown";
+    }
+    return rpc_handlers[opcode].name;
+}
+
+/* the request payload is whatever the buffer holds */
+void rpc_init_request (char *msg, int msg_size, uint16_t opcode, uint64_t req_id)
+{
+    struct RPCHeader *hdr = (struct RPCHeader *)msg;
+
+    hdr->opcode = opcode;
+    hdr->status = RPC_STATUS_OK;
+    hdr->len    = msg_size - sizeof(struct RPCHeader);
+    hdr->req_id = req_id;
+}
+
+/*
+ *  rpc_dispatch:
+ *       run the handler of the request in msg and turn msg into its
+ *       reply; a request for an unknown opcode or a failed handler
+ *       is answered with an empty payload and an error status
+ *
+ *  return value:
+ *       bytes of the reply, header included
+ */
+int rpc_dispatch (char *msg, int msg_size)
+{
+    struct RPCHeader *hdr      = (struct RPCHeader *)msg;
+    uint32_t          buf_size = msg_size - sizeof(struct RPCHeader);
+    int               len      = 0;
+
+    if (rpc_has_op (hdr->opcode) != true) {
+	hdr->status = RPC_STATUS_BAD_OP;
+	hdr->len    = 0;
+	return sizeof(struct RPCHeader);
+    }
+
+    if (hdr->len > buf_size) {
+	hdr->len = buf_size;
+    }
+    len = rpc_handlers[hdr->opcode].fn (msg + sizeof(struct RPCHeader),
+					hdr->len, buf_size);
+    if ((len < 0) || (len > buf_size)) {
+	hdr->status = RPC_STATUS_ERROR;
+	hdr->len    = 0;
+	return sizeof(struct RPCHeader);
+    }
+
+    hdr->status = RPC_STATUS_OK;
+    hdr->len    = len;
+    return sizeof(struct RPCHeader) + len;
+}
+
+/* stats: one entry per opcode */
+void rpc_init_stats (struct RPCStats *stats)
+{
+    int i = 0;
+
+    for (i = 0; i < RPC_MAX_OPS; i++) {
+	stats[i].count      = 0;
+	stats[i].num_errors = 0;
+	stats[i].throughput = 0.0;
+	hist_init (&stats[i].lat_hist);
+    }
+}
+
+/* duration of the measured interval in us */
+void rpc_set_duration (struct RPCStats *stats, double duration)
+{
+    int i = 0;
+
+    for (i = 0; i < RPC_MAX_OPS; i++) {
+	stats[i].throughput = (duration > 0.0) ? stats[i].count / duration : 0.0;
+    }
+}
+
+void rpc_merge_stats (struct RPCStats *dst, struct RPCStats *src)
+{
+    int i = 0;
+
+    for (i = 0; i < RPC_MAX_OPS; i++) {
+	dst[i].count      += src[i].count;
+	dst[i].num_errors += src[i].num_errors;
+	dst[i].throughput += src[i].throughput;
+	hist_merge (&dst[i].lat_hist, &src[i].lat_hist);
+    }
+}
+
+/* latency only where the owner recorded any */
+void rpc_log_stats (char *name, struct RPCStats *stats)
+{
+    int  i = 0;
+    char op_name[96];
+
+    for (i = 0; i < RPC_MAX_OPS; i++) {
+	if (stats[i].count == 0) {
+	    continue;
+	}
+	log ("%s: rpc %s: %ld ops, %ld errors, throughput = %f (Mops/s)",
+	     name, rpc_op_name (i), stats[i].count, stats[i].num_errors,
+	     stats[i].throughput);
+	if (stats[i].lat_hist.count > 0) {
+	    snprintf (op_name, sizeof(op_name), "%s: rpc %s latency", name,
+		      rpc_op_name (i));
+	    hist_log (op_name, &stats[i].lat_hist);
+	}
+    }
+}
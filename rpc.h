@@ -0,0 +1,73 @@
+#ifndef RPC_H_
+#define RPC_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "stats.h"
+
+/* opcodes index the handler table directly */
+#define RPC_MAX_OPS		16
+
+enum RPCOpcode {
+    RPC_OP_ECHO = 0,         /* reply with the request payload */
+    RPC_OP_NULL,             /* empty reply */
+    RPC_OP_CHECKSUM,         /* 8-byte fnv-1a of the request payload */
+};
+
+enum RPCStatus {
+    RPC_STATUS_OK = 0,
+    RPC_STATUS_BAD_OP,       /* no handler registered for the opcode */
+    RPC_STATUS_ERROR,        /* the handler failed */
+};
+
+/*
+ * rpc: the echo engine's payload starts with this header, in host
+ * order on both ends. The server answers in place, in the buffer
+ * the request landed in: the handler turns the request payload into
+ * the reply payload and the header goes back with status and len
+ * updated. req_id is the client's, returned untouched.
+ */
+struct RPCHeader {
+    uint16_t  opcode;
+    uint16_t  status;           /* enum RPCStatus, replies only */
+    uint32_t  len;              /* payload bytes behind the header */
+    uint64_t  req_id;
+};
+
+/*
+ * a handler runs inline in the polling thread and must not block or
+ * allocate; buf holds req_len bytes of request and has room for
+ * buf_size bytes of reply
+ *
+ * return value:
+ *       length of the reply, or -1 on error
+ */
+typedef int (*RPCHandlerFn) (char *buf, uint32_t req_len, uint32_t buf_size);
+
+struct RPCHandler {
+    const char    *name;
+    RPCHandlerFn   fn;
+};
+
+/* per opcode, written by the owning thread only */
+struct RPCStats {
+    long            count;
+    long            num_errors;
+    double          throughput; /* Mops/s over the measured interval */
+    struct LatHist  lat_hist;   /* client: issue to reply */
+};
+
+int         rpc_register (uint16_t opcode, const char *name, RPCHandlerFn fn);
+bool        rpc_has_op   (uint16_t opcode);
+const char *rpc_op_name  (uint16_t opcode);
+
+void rpc_init_request (char *msg, int msg_size, uint16_t opcode, uint64_t req_id);
+int  rpc_dispatch     (char *msg, int msg_size);
+
+void rpc_init_stats   (struct RPCStats *stats);
+void rpc_set_duration (struct RPCStats *stats, double duration);
+void rpc_merge_stats  (struct RPCStats *dst, struct RPCStats *src);
+void rpc_log_stats    (char *name, struct RPCStats *stats);
+
+#endif /* RPC_H_ */
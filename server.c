@@ -2,12 +2,17 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <errno.h>
 
 #include "debug.h"
 #include "ib.h"
+#include "transport.h"
 #include "setup_ib.h"
 #include "config.h"
 #include "server.h"
+#include "rpc.h"
+#include "rndv.h"
+#include "trace.h"
 
 void *server_thread (void *arg)
 {
@@ -15,62 +20,120 @@ void *server_thread (void *arg)
     long        thread_id	 = (long) arg;
     int         num_concurr_msgs = config_info.num_concurr_msgs;
     int         msg_size	 = config_info.msg_size;
-    int         num_peers        = ib_res.num_qps;
+    long        num_ops          = config_info.num_ops;
+    long        num_warmup_ops   = config_info.num_warmup_ops;
+    struct ThreadRes *tres       = &ib_res.thread_res[thread_id];
+    int         num_peers        = tres->num_peers;
+    int        *peers            = tres->peers;
 
     pthread_t   self;
     cpu_set_t   cpuset;
 
-    int                  num_wc		= 20;
-    struct ibv_qp       **qp		= ib_res.qp;
-    struct ibv_cq       *cq		= ib_res.cq;
-    struct ibv_srq      *srq            = ib_res.srq;
+    int                  num_wc		= config_info.batch_size;
+    struct ibv_cq       *cq		= tres->cq;
     struct ibv_wc       *wc             = NULL;
-    uint32_t             lkey           = ib_res.mr->lkey;
+    struct QPSendState  *sq_state       = ib_res.sq_state;
+    struct SendBacklog   backlog        = {0};
+    struct PostBatch     batch          = {0};
+    struct CQWaiter      waiter         = {.epfd = -1};
+    uint32_t             rank           = config_info.rank;
     
-    char                *buf_ptr	= ib_res.ib_buf;
-    char                *buf_base	= ib_res.ib_buf;
+    char                *buf_ptr	= tres->buf;
+    char                *buf_base	= tres->buf;
     int                  buf_offset	= 0;
-    size_t               buf_size	= ib_res.ib_buf_size;
+    size_t               buf_size	= tres->buf_size;
     
+    struct PeerRing     *rings          = ib_res.rings;
+    struct RemoteBuf    *remote_buf     = ib_res.remote_buf;
+    size_t               slot_size      = ib_res.ring_slot_size;
+    bool                 write_mode     = (config_info.transport == TRANSPORT_WRITE);
+    bool                 passive        = (config_info.workload != WORKLOAD_ECHO);
+    bool                 ud_mode        = (config_info.transport == TRANSPORT_UD);
+    uint32_t             recv_size      = ib_res.recv_size;
+    bool                 rpc_mode       = (config_info.num_rpc_ops > 0);
+    struct RPCStats     *rpc_stats      = NULL;
+    int                  reply_size     = msg_size;
+    bool                 rndv           = rndv_enabled (msg_size);
+    uint32_t             send_size      = rndv ? sizeof(struct RndvDesc) : msg_size;
+    struct RndvTable     rndv_tab       = {0};
+
     uint32_t            imm_data	= 0;
     int			num_acked_peers = 0;
     bool                stop            = false;
     struct timeval      start, end;
     long                ops_count	= 0;
+    uint64_t            cpu_start       = 0, cpu_end = 0;
     double              duration	= 0.0;
     double              throughput	= 0.0;
 
-    wc = (struct ibv_wc *) calloc (num_wc, sizeof(struct ibv_wc));
-    check (wc != NULL, "thread[%ld]: failed to allocate wc.", thread_id);
-
-    /* set thread affinity */
+    /* set thread affinity first, what it allocates is then local */
     CPU_ZERO (&cpuset);
-    CPU_SET  ((int)thread_id, &cpuset);
+    CPU_SET  (tres->cpu, &cpuset);
     self = pthread_self ();
     ret  = pthread_setaffinity_np (self, sizeof(cpu_set_t), &cpuset);
     check (ret == 0, "thread[%ld]: failed to set thread affinity", thread_id);
 
-    /* pre-post recvs */
     wc = (struct ibv_wc *) calloc (num_wc, sizeof(struct ibv_wc));
     check (wc != NULL, "thread[%ld]: failed to allocate wc.", thread_id);
+    log_thread_placement (thread_id, wc);
+    trace_thread_start (thread_id);
 
-    for (i = 0; i < num_peers; i++) {
-        for (j = 0; j < num_concurr_msgs; j++) {
-            ret = post_srq_recv (msg_size, lkey, (uint64_t)buf_ptr, srq, buf_ptr);
-            buf_offset = (buf_offset + msg_size) % buf_size;
-            buf_ptr = buf_base + buf_offset;
-        }
+    ret = init_thread_cq_waiter (&waiter, thread_id);
+    check (ret == 0, "thread[%ld]: failed to init cq waiter", thread_id);
+
+    ret = init_send_backlog (&backlog, num_peers * num_concurr_msgs);
+    check (ret == 0, "thread[%ld]: failed to allocate send backlog", thread_id);
+
+    /* rendezvous: one read per request a client may have in flight */
+    if (rndv) {
+        ret = rndv_init (&rndv_tab, num_peers * num_concurr_msgs);
+        check (ret == 0, "thread[%ld]: failed to allocate rendezvous table", thread_id);
+    }
+
+    if (rpc_mode) {
+        rpc_stats = (struct RPCStats *) malloc (RPC_MAX_OPS * sizeof(struct RPCStats));
+        check (rpc_stats != NULL, "thread[%ld]: failed to allocate rpc stats", thread_id);
+        rpc_init_stats (rpc_stats);
+        tres->rpc_stats = rpc_stats;
     }
 
+    ret = transport->init_batch (&batch, thread_id);
+    check (ret == 0, "thread[%ld]: failed to allocate post batch", thread_id);
+    sq_state = batch.sq_state;
+
+    /* pre-post recvs; every buffer of the slice stays posted across runs */
+    for (j = 0; (tres->recvs_posted != true) && (j < buf_size / recv_size); j++) {
+        ret = transport->recv (&batch, recv_size, buf_ptr);
+        check (ret == 0, "thread[%ld]: failed to pre-post recv", thread_id);
+        buf_offset = (buf_offset + recv_size) % buf_size;
+        buf_ptr = buf_base + buf_offset;
+    }
+    ret = transport->flush (&batch);
+    check (ret == 0, "thread[%ld]: failed to pre-post recvs", thread_id);
+    tres->recvs_posted = true;
+
     /* signal the client to start */
     for (i = 0; i < num_peers; i++) {
-	ret = post_send (0, lkey, 0, MSG_CTL_START, qp[i], buf_base);
+	ret = transport->ctl_send (&batch, peers[i], 0, MSG_CTL_START);
 	check (ret == 0, "thread[%ld]: failed to signal the client to start", thread_id);
     }
 
+    /* one-sided workloads: the clients do all the work and tell us */
+    /* when they are done, skip straight to waiting for that       */
+    stop = passive;
     while (stop != true) {
+        /* retry echoes deferred for lack of send credits */
+        if (backlog.num > 0) {
+            ret = flush_send_backlog (&backlog, &batch, recv_size);
+            check (ret == 0, "thread[%ld]: failed to flush send backlog", thread_id);
+        }
+        if (rndv_tab.num_wait > 0) {
+            ret = rndv_retry_wait (&rndv_tab, &batch);
+            check (ret == 0, "thread[%ld]: failed to retry reads", thread_id);
+        }
+
         /* poll cq */
-        n = ibv_poll_cq (cq, num_wc, wc);
+        n = transport->poll (&batch, &waiter, num_wc, wc);
         if (n < 0) {
             check (0, "thread[%ld]: Failed to poll cq", thread_id);
         }
@@ -85,41 +148,175 @@ void *server_thread (void *arg)
                            thread_id, ibv_wc_status_str(wc[i].status));
                 }
             }
+
+            if (wc[i].opcode == IBV_WC_SEND) {
+                retire_send (sq_state, wc[i].wr_id);
+                continue;
+            }
+
+            /* rendezvous: the payload is in, acknowledge it with the */
+            /* descriptor, sent back from the buffer it arrived in    */
+            if (wc[i].opcode == IBV_WC_RDMA_READ) {
+                uint32_t  peer    = 0;
+                char     *msg_ptr = NULL;
+
+                retire_send (sq_state, wc[i].wr_id);
+                msg_ptr = rndv_read_done (&rndv_tab, &tres->pool,
+                                          IB_WR_ID_SIG_SLOT (wc[i].wr_id), &peer);
+                if (stop != true) {
+                    ret = transport->send (&batch, send_size, rank, peer, msg_ptr);
+                    if (ret == EAGAIN) {
+                        push_send_backlog (&backlog, msg_ptr, peer, rank, send_size);
+                        continue;
+                    }
+                    check (ret == 0, "thread[%ld]: failed to ack peer[%"PRIu32"]",
+                           thread_id, peer);
+                }
+                ret = transport->recv (&batch, recv_size, msg_ptr);
+                check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
+                batch_grant (&batch, peer);
+                continue;
+            }
 	    
 	    if (wc[i].opcode == IBV_WC_RECV) {
+                char *msg_ptr = (char *)wc[i].wr_id;
+
+                /* past the last op: keep the buffer posted, drop the msg */
+                if (stop) {
+                    ret = transport->recv (&batch, recv_size, msg_ptr);
+                    check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
+                    continue;
+                }
+
                 ops_count += 1;
                 debug ("ops_count = %ld", ops_count);
 
-                if (ops_count == NUM_WARMING_UP_OPS) {
+                if (ops_count == num_warmup_ops) {
                     gettimeofday (&start, NULL);
+                    cpu_start = get_thread_cpu_ns ();
                 }
-                if (ops_count == TOT_NUM_OPS) {
+                if (ops_count == num_ops) {
                     gettimeofday (&end, NULL);
+                    cpu_end = get_thread_cpu_ns ();
                     stop = true;
-                    break;
+                    ret = transport->recv (&batch, recv_size, msg_ptr);
+                    check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
+                    continue;
                 }
 
-                /* echo the message back */
-		imm_data = ntohl(wc[i].imm_data);
-                char *msg_ptr = (char *)wc[i].wr_id;
-                post_send (msg_size, lkey, 0, imm_data, qp[imm_data], msg_ptr);
+                /* echo the message back; imm_data is the client rank, */
+                /* ud names the client by its source address and qp    */
+		imm_data = batch_take_credits (&batch, ntohl(wc[i].imm_data));
+                if (ud_mode) {
+                    int peer = ud_lookup_peer (&wc[i], msg_ptr);
+                    check (peer >= 0, "thread[%ld]: datagram from unknown qp %"PRIu32"",
+                           thread_id, wc[i].src_qp);
+                    imm_data = peer;
+                }
+
+                /* rendezvous: the buffer stays out of the srq until */
+                /* the payload was read and acknowledged              */
+                if (rndv) {
+                    ret = rndv_start_read (&rndv_tab, &batch, &tres->pool,
+                                           msg_ptr, imm_data);
+                    check (ret == 0, "thread[%ld]: failed to read from peer[%"PRIu32"]",
+                           thread_id, imm_data);
+                    continue;
+                }
+
+                /* rpc: the handler runs right here and turns the */
+                /* request into its reply, in place               */
+                if (rpc_mode) {
+                    struct RPCHeader *hdr    = (struct RPCHeader *)(msg_ptr + batch.grh_size);
+                    uint16_t          opcode = hdr->opcode;
+
+                    reply_size = rpc_dispatch ((char *)hdr, msg_size);
+                    if ((ops_count > num_warmup_ops) && (opcode < RPC_MAX_OPS)) {
+                        rpc_stats[opcode].count      += 1;
+                        rpc_stats[opcode].num_errors += (hdr->status != RPC_STATUS_OK);
+                    }
+                }
+
+                ret = transport->send (&batch, reply_size, rank, imm_data,
+                                       msg_ptr + batch.grh_size);
+                if (ret == EAGAIN) {
+                    /* the recv buffer is reposted once the echo goes out */
+                    push_send_backlog (&backlog, msg_ptr, imm_data, rank, reply_size);
+                    continue;
+                }
+                check (ret == 0, "thread[%ld]: failed to echo to peer[%"PRIu32"]",
+                       thread_id, imm_data);
 
                 /* post a new receive */
-                post_srq_recv (msg_size, lkey, wc[i].wr_id, srq, msg_ptr);
+                ret = transport->recv (&batch, recv_size, msg_ptr);
+                check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
+                batch_grant (&batch, imm_data);
+            }
+        }
+
+        /* write transport: one message per peer ring and pass, the */
+        /* slot is written back as is into the same slot of the     */
+        /* client's ring, sequence number included                  */
+        for (i = 0; write_mode && (stop != true) && (i < num_peers); i++) {
+            struct PeerRing *ring = &rings[peers[i]];
+            size_t           off  = ring_slot_offset (ring->recv_seq,
+                                                      num_concurr_msgs, slot_size);
+            char            *slot = ring->recv_ring + off;
+
+            if (!ring_slot_ready (slot, slot_size, ring->recv_seq)) {
+                continue;
+            }
+
+            /* out of credits: the slot stays unconsumed until next pass */
+            ret = batch_write (&batch, slot_size, peers[i], slot,
+                               remote_buf[peers[i]].addr + off,
+                               remote_buf[peers[i]].rkey);
+            if (ret == EAGAIN) {
+                continue;
+            }
+            check (ret == 0, "thread[%ld]: failed to echo to peer[%d]",
+                   thread_id, peers[i]);
+            ring->recv_seq += 1;
+
+            ops_count += 1;
+            if (ops_count == num_warmup_ops) {
+                gettimeofday (&start, NULL);
+                cpu_start = get_thread_cpu_ns ();
+            }
+            if (ops_count == num_ops) {
+                gettimeofday (&end, NULL);
+                cpu_end = get_thread_cpu_ns ();
+                stop = true;
             }
         }
+
+        /* one doorbell per qp and one for the srq per poll batch */
+        ret = transport->flush (&batch);
+        check (ret == 0, "thread[%ld]: failed to flush post batch", thread_id);
     }
 
+    /* echoes still waiting for credits are dropped, so are reads */
+    ret = discard_send_backlog (&backlog, &batch, recv_size);
+    check (ret == 0, "thread[%ld]: failed to discard send backlog", thread_id);
+    ret = rndv_discard_wait (&rndv_tab, &batch, &tres->pool, recv_size);
+    check (ret == 0, "thread[%ld]: failed to discard reads", thread_id);
+
     /* signal the client to stop */
-    for (i = 0; i < num_peers; i++) {
-	ret = post_send (0, lkey, IB_WR_ID_STOP, MSG_CTL_STOP, qp[i], ib_res.ib_buf);
+    for (i = 0; (passive != true) && (i < num_peers); i++) {
+	ret = transport->ctl_send (&batch, peers[i], IB_WR_ID_STOP, MSG_CTL_STOP);
 	check (ret == 0, "thread[%ld]: failed to signal the client to stop", thread_id);
     }
 
+    /* wait for our stops to go out and for every client to finish: */
+    /* echo clients answer the stop with DONE behind their last msg, */
+    /* one-sided clients send STOP once their last op completed      */
+    int      num_stops_sent = passive ? num_peers : 0;
+    uint32_t done_msg       = passive ? MSG_CTL_STOP : MSG_CTL_DONE;
+
     stop = false;
     while (stop != true) {
         /* poll cq */
-        n = ibv_poll_cq (cq, num_wc, wc);
+        n = transport->poll (&batch, &waiter, num_wc, wc);
         if (n < 0) {
             check (0, "thread[%ld]: Failed to poll cq", thread_id);
         }
@@ -137,14 +334,45 @@ void *server_thread (void *arg)
 
             if (wc[i].opcode == IBV_WC_SEND) {
                 if (wc[i].wr_id == IB_WR_ID_STOP) {
-		    num_acked_peers += 1;
-		    if (num_acked_peers == num_peers) {
-			stop = true;
-			break;
-		    }
+                    num_stops_sent += 1;
+                } else {
+                    retire_send (sq_state, wc[i].wr_id);
+                }
+                continue;
+            }
+
+            /* reads complete ahead of the stop behind them, unacked */
+            if (wc[i].opcode == IBV_WC_RDMA_READ) {
+                uint32_t peer = 0;
+
+                retire_send (sq_state, wc[i].wr_id);
+                ret = transport->recv (&batch, recv_size,
+                                       rndv_read_done (&rndv_tab, &tres->pool,
+                                                       IB_WR_ID_SIG_SLOT (wc[i].wr_id),
+                                                       &peer));
+                check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
+                continue;
+            }
+
+            /* late requests are dropped, their buffers reposted */
+            if (wc[i].opcode == IBV_WC_RECV) {
+                if (ntohl(wc[i].imm_data) == done_msg) {
+                    num_acked_peers += 1;
                 }
+                ret = transport->recv (&batch, recv_size, (char *)wc[i].wr_id);
+                check (ret == 0, "thread[%ld]: failed to repost recv", thread_id);
             }
         }
+
+        ret = transport->flush (&batch);
+        check (ret == 0, "thread[%ld]: failed to flush post batch", thread_id);
+
+        stop = (num_stops_sent == num_peers) && (num_acked_peers == num_peers);
+    }
+
+    if (passive) {
+        log ("thread[%ld]: passive, %d clients done", thread_id, num_peers);
+        goto out;
     }
     
     /* dump statistics */
@@ -152,22 +380,51 @@ void *server_thread (void *arg)
                           (end.tv_usec - start.tv_usec));
     throughput = (double)(ops_count) / duration;
     log ("thread[%ld]: throughput = %f (Mops/s)",  thread_id, throughput);
+    log_thread_cpu (thread_id, cpu_end - cpu_start, duration,
+                    ops_count - num_warmup_ops, &waiter);
+
+    log_post_batch (thread_id, &batch);
+    if (rndv) {
+        log ("thread[%ld]: rendezvous pool: %ld buffers, %zu bytes registered",
+             thread_id, tres->pool.num_bufs, tres->pool.num_bytes);
+    }
+
+    if (rpc_mode) {
+        char name[32];
+
+        sprintf (name, "thread[%ld]", thread_id);
+        rpc_set_duration (rpc_stats, duration);
+        rpc_log_stats (name, rpc_stats);
+    }
 
+    tres->ops_count  = ops_count;
+    tres->throughput = throughput;
+
+ out:
     free (wc);
+    rndv_destroy (&rndv_tab);
+    destroy_cq_waiter (&waiter, cq);
+    destroy_send_backlog (&backlog);
+    destroy_post_batch (&batch);
     pthread_exit ((void *)0);
 
  error:
     if (wc != NULL) {
     	free (wc);
     }
+    rndv_destroy (&rndv_tab);
+    destroy_cq_waiter (&waiter, cq);
+    destroy_send_backlog (&backlog);
+    destroy_post_batch (&batch);
     pthread_exit ((void *)-1);
 }
 
 int run_server ()
 {
     int   ret         = 0;
-    long  num_threads = 1;
+    long  num_threads = ib_res.num_threads;
     long  i           = 0;
+    double tot_throughput = 0.0;
 
     pthread_t           *threads = NULL;
     pthread_attr_t       attr;
@@ -198,6 +455,30 @@ int run_server ()
         goto error;
     }
 
+    for (i = 0; i < num_threads; i++) {
+        tot_throughput += ib_res.thread_res[i].throughput;
+    }
+    log ("aggregate: %ld threads, throughput = %f (Mops/s)",
+         num_threads, tot_throughput);
+    log_aggregate_rails ();
+    log_rnr_events ();
+    if (config_info.workload == WORKLOAD_ECHO) {
+        log_aggregate_cpu ();
+    }
+    if (config_info.num_rpc_ops > 0) {
+        log_aggregate_rpc ();
+    }
+
+    /* every fetch_add/cmp_swp that succeeded left a +1 behind */
+    if ((config_info.workload == WORKLOAD_FETCH_ADD) ||
+        (config_info.workload == WORKLOAD_CMP_SWP)) {
+        uint64_t sum = 0;
+        for (i = 0; i < config_info.num_counters; i++) {
+            sum += *(uint64_t *)(ib_res.target_buf + i * ib_res.target_stride);
+        }
+        log ("counters: %d, sum = %"PRIu64"", config_info.num_counters, sum);
+    }
+
     pthread_attr_destroy    (&attr);
     free (threads);
 
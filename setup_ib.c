@@ -1,38 +1,333 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include "sock.h"
+#include "cm.h"
 #include "ib.h"
 #include "debug.h"
 #include "config.h"
 #include "setup_ib.h"
+#include "stats.h"
+#include "transport.h"
+#include "rpc.h"
+#include "rndv.h"
+#include "topo.h"
+#include "trace.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT	26
+#endif
 
 struct IBRes ib_res;
 
+/* the region a peer may access with one-sided verbs, 0 if none */
+static uint64_t local_rdma_addr (int peer)
+{
+    if (ib_res.rings != NULL) {
+	return (uintptr_t) ib_res.rings[peer].recv_ring;
+    }
+    if (ib_res.target_buf != NULL) {
+	return (uintptr_t) ib_res.target_buf;
+    }
+    return 0;
+}
+
+/* the qp a peer talks to; ud peers share their thread's qp */
+static uint32_t local_qp_num (int peer)
+{
+    if (ib_res.ud_qp != NULL) {
+	return ib_res.ud_qp[peer % ib_res.num_threads]->qp_num;
+    }
+    return ib_res.qp[peer]->qp_num;
+}
+
+/* what we tell a peer about ourselves: address, qp, rank and rdma region */
+static void fill_local_qp_info (int peer, struct QPInfo *info)
+{
+    struct IBRail *rail = peer_rail (peer);
+
+    memset (info, 0, sizeof(struct QPInfo));
+    info->lid      = rail->port_attr.lid;
+    info->qp_num   = local_qp_num (peer);
+    info->rank     = config_info.rank;
+    info->buf_addr = local_rdma_addr (peer);
+    info->rkey     = rail->mr->rkey;
+    info->mtu      = rail->port_attr.active_mtu;
+    memcpy (info->gid, rail->gid.raw, sizeof(info->gid));
+}
+
+/* ::ffff:a.b.c.d, the gid of a roce v2 port with an ipv4 address */
+static inline bool gid_is_ipv4 (const uint8_t *gid)
+{
+    static const uint8_t prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+    return memcmp (gid, prefix, sizeof(prefix)) == 0;
+}
+
+/* 32 bits naming a sender: its lid, or without lids the ipv4 */
+/* address in its gid, or else a fold of the whole gid        */
+/* (ud runs on a single rail)                                 */
+static uint32_t ud_peer_src (uint16_t lid, const uint8_t *gid)
+{
+    uint32_t w[4];
+
+    if (ib_res.rails[0].gid_index < 0) {
+	return lid;
+    }
+    memcpy (w, gid, sizeof(w));
+    if (gid_is_ipv4 (gid)) {
+	return w[3];
+    }
+    return w[0] ^ w[1] ^ w[2] ^ w[3];
+}
+
+static inline uint64_t ud_peer_key (uint32_t src, uint32_t qp_num)
+{
+    return ((uint64_t)src << 32) | qp_num;
+}
+
+/* ud completions name the sender by (source, src_qp); the table */
+/* is filled while connecting and only read by the worker threads */
+static void ud_insert_peer (uint32_t src, uint32_t qp_num, int peer)
+{
+    uint64_t key = ud_peer_key (src, qp_num);
+    uint32_t h   = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+
+    while (ib_res.ud_peer_val[h & ib_res.ud_peer_mask] >= 0) {
+	h += 1;
+    }
+    ib_res.ud_peer_key[h & ib_res.ud_peer_mask] = key;
+    ib_res.ud_peer_val[h & ib_res.ud_peer_mask] = peer;
+}
+
+/* grh is the 40 bytes in front of the payload; under roce v2 */
+/* with ipv4 its last 20 hold the ip header instead            */
+int ud_lookup_peer (struct ibv_wc *wc, const char *grh)
+{
+    uint32_t src = wc->slid;
+
+    if (ib_res.rails[0].gid_index >= 0) {
+	if (gid_is_ipv4 (ib_res.rails[0].gid.raw)) {
+	    memcpy (&src, grh + IB_GRH_SIZE - 8, sizeof(src));
+	} else {
+	    src = ud_peer_src (0, (const uint8_t *)grh + 8);
+	}
+    }
+
+    uint64_t key = ud_peer_key (src, wc->src_qp);
+    uint32_t h   = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32);
+
+    while (ib_res.ud_peer_val[h & ib_res.ud_peer_mask] >= 0) {
+	if (ib_res.ud_peer_key[h & ib_res.ud_peer_mask] == key) {
+	    return ib_res.ud_peer_val[h & ib_res.ud_peer_mask];
+	}
+	h += 1;
+    }
+    return -1;
+}
+
+/* zero-length, always signaled control message (START/STOP) to peer */
+int post_ctl_send (int peer, uint64_t wr_id, uint32_t imm_data)
+{
+    if (ib_res.ud_qp != NULL) {
+	return post_send_ud (0, peer_rail (peer)->mr->lkey, wr_id, imm_data,
+			     ib_res.ud_qp[peer % ib_res.num_threads],
+			     ib_res.ah[peer], ib_res.remote_qpn[peer],
+			     ib_res.ib_buf);
+    }
+    return post_send (0, peer_rail (peer)->mr->lkey, wr_id, imm_data,
+		      ib_res.qp[peer], ib_res.ib_buf);
+}
+
+/* ud peers need an address handle instead of a connected qp; */
+/* rc qps take their path from cm_id if rdma_cm connects them  */
+static int connect_peer (int peer, struct QPInfo *remote, struct rdma_cm_id *cm_id)
+{
+    int                 ret  = 0;
+    struct ibv_ah_attr  ah_attr;
+    struct IBRail      *rail = peer_rail (peer);
+    enum ibv_mtu        mtu  = rail->port_attr.active_mtu;
+
+    ib_res.remote_buf[peer].addr = remote->buf_addr;
+    ib_res.remote_buf[peer].rkey = remote->rkey;
+
+    if (ib_res.ud_qp != NULL) {
+	fill_ah_attr (&ah_attr, remote->lid, remote->gid, rail->gid_index,
+		      rail->port_num);
+	ib_res.ah[peer] = create_ud_ah (rail->pd, &ah_attr);
+	check (ib_res.ah[peer] != NULL, "Failed to create ah for peer[%d]", peer);
+	ib_res.remote_qpn[peer] = remote->qp_num;
+	ud_insert_peer (ud_peer_src (remote->lid, remote->gid), remote->qp_num, peer);
+    } else if (cm_id != NULL) {
+	ret = cm_modify_qp_to_rts (cm_id, ib_res.qp[peer]);
+	check (ret == 0, "Failed to modify qp[%d] to rts", peer);
+    } else {
+	/* the path mtu is what both ports can do */
+	if (remote->mtu < mtu) {
+	    mtu = remote->mtu;
+	}
+	fill_ah_attr (&ah_attr, remote->lid, remote->gid, rail->gid_index,
+		      rail->port_num);
+	ret = modify_qp_to_rts (ib_res.qp[peer], remote->qp_num, &ah_attr, mtu,
+				ib_res.max_rd_atomic, ib_res.max_dest_rd_atomic);
+	check (ret == 0, "Failed to modify qp[%d] to rts", peer);
+    }
+
+    log ("\tqp[%"PRIu32"] <-> qp[%"PRIu32"]",
+	 local_qp_num (peer), remote->qp_num);
+    return 0;
+ error:
+    return -1;
+}
+
+/* bootstrap state of one client connection */
+enum PeerConnState {
+    CONN_RECV_INFO = 0,      /* reading the client's QPInfo */
+    CONN_SEND_INFO,          /* writing ours back */
+    CONN_RECV_SYNC,          /* waiting for the client's qps to be ready */
+    CONN_SYNCED,
+};
+
+struct PeerConn {
+    int            fd;
+    int            state;
+    size_t         off;      /* bytes of the current message done */
+    struct QPInfo  info;     /* network byte order */
+    char           sync[sizeof(SOCK_SYNC_MSG)];
+};
+
+/*
+ *  advance_peer_conn:
+ *       move one connection as far through the exchange as its socket
+ *       allows without blocking; the client's qp is connected as soon
+ *       as its QPInfo arrived, qp[r] belongs to the client of rank r
+ *
+ *  return value:
+ *       0 on progress or EAGAIN, -1 on error
+ */
+static int advance_peer_conn (struct PeerConn *c, struct QPInfo *local_qp_info,
+			      bool *rank_seen)
+{
+    int            ret  = 0;
+    ssize_t        n    = 0;
+    struct QPInfo  remote;
+
+    while (c->state != CONN_SYNCED) {
+	if (c->state == CONN_RECV_INFO) {
+	    n = read (c->fd, (char *)&c->info + c->off, sizeof(struct QPInfo) - c->off);
+	} else if (c->state == CONN_SEND_INFO) {
+	    n = write (c->fd, (char *)&c->info + c->off, sizeof(struct QPInfo) - c->off);
+	} else {
+	    n = read (c->fd, c->sync + c->off, sizeof(c->sync) - c->off);
+	}
+	if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+	    return 0;
+	}
+	check (n > 0, "Failed to exchange qp_info with a client");
+	c->off += n;
+
+	if ((c->state == CONN_RECV_INFO) && (c->off == sizeof(struct QPInfo))) {
+	    qp_info_ntoh (&remote, &c->info);
+	    check (remote.rank < config_info.num_clients,
+		   "Invalid client rank: %"PRIu32"", remote.rank);
+	    check (rank_seen[remote.rank] != true,
+		   "Duplicate client rank: %"PRIu32"", remote.rank);
+	    rank_seen[remote.rank] = true;
+
+	    ret = connect_peer (remote.rank, &remote, NULL);
+	    check (ret == 0, "Failed to connect to client[%"PRIu32"]", remote.rank);
+
+	    qp_info_hton (&c->info, &local_qp_info[remote.rank]);
+	    c->state = CONN_SEND_INFO;
+	    c->off   = 0;
+	} else if ((c->state == CONN_SEND_INFO) && (c->off == sizeof(struct QPInfo))) {
+	    c->state = CONN_RECV_SYNC;
+	    c->off   = 0;
+	} else if ((c->state == CONN_RECV_SYNC) && (c->off == sizeof(c->sync))) {
+	    c->state = CONN_SYNCED;
+	}
+    }
+
+    return 0;
+ error:
+    return -1;
+}
+
+/*
+ *  post_client_recvs:
+ *       fill every thread's srq with its slice before the bootstrap
+ *       sync releases the servers. A ud START that arrives at an
+ *       empty srq is dropped, not retried, and the client would wait
+ *       for it forever
+ *
+ *  return value:
+ *       0 on success, -1 on error
+ */
+static int post_client_recvs ()
+{
+    int      ret = 0, t = 0;
+    uint32_t recv_size = ib_res.recv_size;
+    size_t   j = 0;
+
+    for (t = 0; t < ib_res.num_threads; t++) {
+	struct ThreadRes *tres = &ib_res.thread_res[t];
+
+	for (j = 0; j < tres->buf_size / recv_size; j++) {
+	    char *buf = tres->buf + j * recv_size;
+
+	    ret = post_srq_recv (recv_size, tres->rail->mr->lkey, (uint64_t)buf,
+				 tres->srq, buf);
+	    check (ret == 0, "Failed to pre-post recv of thread[%d]", t);
+	}
+	tres->recvs_posted = true;
+    }
+
+    return 0;
+ error:
+    return -1;
+}
+
+/*
+ *  connect_qp_server:
+ *       accept and bootstrap all clients concurrently from one epoll
+ *       loop on non-blocking sockets, so a slow client only delays
+ *       itself; the final sync is a barrier across all clients
+ */
 int connect_qp_server ()
 {
     int			 ret		= 0, n = 0, i = 0;
     int                  num_peers      = config_info.num_clients;
-    int			 sockfd		= 0;
-    int			*peer_sockfd	= NULL;
-    struct sockaddr_in	 peer_addr;
-    socklen_t		 peer_addr_len	= sizeof(struct sockaddr_in);
+    int			 sockfd		= -1;
+    int                  epfd           = -1;
+    int                  num_accepted   = 0;
+    int                  num_synced     = 0;
+    struct PeerConn	*conn		= NULL;
+    bool                *rank_seen      = NULL;
+    struct epoll_event  *events         = NULL;
     char sock_buf[64]			= {'\0'};
     struct QPInfo	*local_qp_info	= NULL;
-    struct QPInfo	*remote_qp_info = NULL;
+    uint64_t             start_ns       = get_time_ns ();
 
     sockfd = sock_create_bind(config_info.sock_port);
     check(sockfd > 0, "Failed to create server socket.");
-    listen(sockfd, 5);
-
-    peer_sockfd = (int *) calloc (num_peers, sizeof(int));
-    check (peer_sockfd != NULL, "Failed to allocate peer_sockfd");
+    listen(sockfd, SOMAXCONN);
+    check (sock_set_nonblock (sockfd) == 0, "Failed to make server socket non-blocking");
 
+    conn      = (struct PeerConn *) calloc (num_peers, sizeof(struct PeerConn));
+    rank_seen = (bool *) calloc (num_peers, sizeof(bool));
+    events    = (struct epoll_event *) calloc (num_peers + 1, sizeof(struct epoll_event));
+    check ((conn != NULL) && (rank_seen != NULL) && (events != NULL),
+	   "Failed to allocate bootstrap state");
     for (i = 0; i < num_peers; i++) {
-	peer_sockfd[i] = accept(sockfd, (struct sockaddr *)&peer_addr,
-				&peer_addr_len);
-	check (peer_sockfd[i] > 0, "Failed to create peer_sockfd[%d]", i);
+	conn[i].fd = -1;
     }
 
     /* init local qp_info */
@@ -41,83 +336,106 @@ int connect_qp_server ()
     check (local_qp_info != NULL, "Failed to allocate local_qp_info");
 
     for (i = 0; i < num_peers; i++) {
-	local_qp_info[i].lid	= ib_res.port_attr.lid; 
-	local_qp_info[i].qp_num = ib_res.qp[i]->qp_num;
-	local_qp_info[i].rank   = config_info.rank;
+	fill_local_qp_info (i, &local_qp_info[i]);
     }
 
-    /* get qp_info from client */
-    remote_qp_info = (struct QPInfo *) calloc (num_peers, 
-					       sizeof(struct QPInfo));
-    check (remote_qp_info != NULL, "Failed to allocate remote_qp_info");
+    epfd = epoll_create1 (0);
+    check (epfd >= 0, "Failed to create epoll fd");
 
-    for (i = 0; i < num_peers; i++) {
-	ret = sock_get_qp_info (peer_sockfd[i], &remote_qp_info[i]);
-	check (ret == 0, "Failed to get qp_info from client[%d]", i);
-    }
-    
-    /* send qp_info to client */
-    int peer_ind = -1;
-    int j        = 0;
-    for (i = 0; i < num_peers; i++) {
-	peer_ind = -1;
-	for (j = 0; j < num_peers; j++) {
-	    if (remote_qp_info[j].rank == i) {
-		peer_ind = j;
-		break;
-	    }
-	}
-	ret = sock_set_qp_info (peer_sockfd[i], &local_qp_info[peer_ind]);
-	check (ret == 0, "Failed to send qp_info to client[%d]", peer_ind);
-    }
+    /* data.u32 = num_peers marks the listening socket */
+    struct epoll_event ev = {
+	.events   = EPOLLIN,
+	.data.u32 = num_peers,
+    };
+    check (epoll_ctl (epfd, EPOLL_CTL_ADD, sockfd, &ev) == 0,
+	   "Failed to add server socket to epoll");
 
-    /* change send QP state to RTS */
     log (LOG_SUB_HEADER, "Start of IB Config");
-    for (i = 0; i < num_peers; i++) {
-	peer_ind = -1;
-	for (j = 0; j < num_peers; j++) {
-	    if (remote_qp_info[j].rank == i) {
-		peer_ind = j;
-		break;
+    while (num_synced < num_peers) {
+	n = epoll_wait (epfd, events, num_peers + 1, -1);
+	check ((n >= 0) || (errno == EINTR), "Failed to wait for clients");
+
+	for (i = 0; i < n; i++) {
+	    uint32_t ind = events[i].data.u32;
+
+	    if (ind == num_peers) {
+		while (num_accepted < num_peers) {
+		    int fd = accept (sockfd, NULL, NULL);
+		    if (fd < 0) {
+			check ((errno == EAGAIN) || (errno == EINTR),
+			       "Failed to accept client");
+			break;
+		    }
+		    conn[num_accepted].fd = fd;
+		    check (sock_set_nonblock (fd) == 0,
+			   "Failed to make client socket non-blocking");
+
+		    /* edge-triggered: advance_peer_conn drains until EAGAIN */
+		    struct epoll_event cev = {
+			.events   = EPOLLIN | EPOLLOUT | EPOLLET,
+			.data.u32 = num_accepted,
+		    };
+		    check (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &cev) == 0,
+			   "Failed to add client socket to epoll");
+		    num_accepted += 1;
+		}
+		continue;
 	    }
-	}
-	ret = modify_qp_to_rts (ib_res.qp[peer_ind], 
-				remote_qp_info[i].qp_num, 
-				remote_qp_info[i].lid);
-	check (ret == 0, "Failed to modify qp[%d] to rts", peer_ind);
 
-	log ("\tqp[%"PRIu32"] <-> qp[%"PRIu32"]", 
-	     ib_res.qp[peer_ind]->qp_num, remote_qp_info[i].qp_num);
+	    if (conn[ind].state == CONN_SYNCED) {
+		continue;
+	    }
+	    ret = advance_peer_conn (&conn[ind], local_qp_info, rank_seen);
+	    check (ret == 0, "Failed to bootstrap connection[%"PRIu32"]", ind);
+	    if (conn[ind].state == CONN_SYNCED) {
+		num_synced += 1;
+	    }
+	}
     }
     log (LOG_SUB_HEADER, "End of IB Config");
 
-    /* sync with clients */
-    for (i = 0; i < num_peers; i++) {
-	n = sock_read (peer_sockfd[i], sock_buf, sizeof(SOCK_SYNC_MSG));
-	check (n == sizeof(SOCK_SYNC_MSG), "Failed to receive sync from client");
-    }
-    
+    /* everyone is connected, release the clients together */
     for (i = 0; i < num_peers; i++) {
-	n = sock_write (peer_sockfd[i], sock_buf, sizeof(SOCK_SYNC_MSG));
+	ret = fcntl (conn[i].fd, F_SETFL, fcntl (conn[i].fd, F_GETFL) & ~O_NONBLOCK);
+	check (ret == 0, "Failed to make client socket blocking");
+	n = sock_write (conn[i].fd, sock_buf, sizeof(SOCK_SYNC_MSG));
 	check (n == sizeof(SOCK_SYNC_MSG), "Failed to write sync to client");
     }
-	
+    log ("bootstrap (sock): %d clients synced in %.3f ms", num_peers,
+	 (get_time_ns () - start_ns) / 1000000.0);
+
     for (i = 0; i < num_peers; i++) {
-	close (peer_sockfd[i]);
+	close (conn[i].fd);
     }
-    free (peer_sockfd);
+    free (conn);
+    free (rank_seen);
+    free (events);
+    free (local_qp_info);
+    close (epfd);
     close (sockfd);
     
     return 0;
 
  error:
-    if (peer_sockfd != NULL) {
+    if (conn != NULL) {
 	for (i = 0; i < num_peers; i++) {
-	    if (peer_sockfd[i] > 0) {
-		close (peer_sockfd[i]);
+	    if (conn[i].fd >= 0) {
+		close (conn[i].fd);
 	    }
 	}
-	free (peer_sockfd);
+	free (conn);
+    }
+    if (rank_seen != NULL) {
+	free (rank_seen);
+    }
+    if (events != NULL) {
+	free (events);
+    }
+    if (local_qp_info != NULL) {
+	free (local_qp_info);
+    }
+    if (epfd >= 0) {
+	close (epfd);
     }
     if (sockfd > 0) {
 	close (sockfd);
@@ -135,6 +453,7 @@ int connect_qp_client ()
 
     struct QPInfo *local_qp_info  = NULL;
     struct QPInfo *remote_qp_info = NULL;
+    uint64_t       start_ns       = get_time_ns ();
 
     peer_sockfd = (int *) calloc (num_peers, sizeof(int));
     check (peer_sockfd != NULL, "Failed to allocate peer_sockfd");
@@ -151,9 +470,7 @@ int connect_qp_client ()
     check (local_qp_info != NULL, "Failed to allocate local_qp_info");
 
     for (i = 0; i < num_peers; i++) {
-	local_qp_info[i].lid     = ib_res.port_attr.lid; 
-	local_qp_info[i].qp_num  = ib_res.qp[i]->qp_num; 
-	local_qp_info[i].rank    = config_info.rank;
+	fill_local_qp_info (i, &local_qp_info[i]);
     }
 
     /* send qp_info to server */
@@ -172,26 +489,11 @@ int connect_qp_client ()
 	check (ret == 0, "Failed to get qp_info[%d] from server", i);
     }
     
-    /* change QP state to RTS */
-    /* send qp_info to client */
-    int peer_ind = -1;
-    int j        = 0;
+    /* change QP state to RTS; qp[i] was set up for servers[i] */
     log (LOG_SUB_HEADER, "IB Config");
     for (i = 0; i < num_peers; i++) {
-	peer_ind = -1;
-	for (j = 0; j < num_peers; j++) {
-	    if (remote_qp_info[j].rank == i) {
-		peer_ind = j;
-		break;
-	    }
-	}
-	ret = modify_qp_to_rts (ib_res.qp[peer_ind], 
-				remote_qp_info[i].qp_num, 
-				remote_qp_info[i].lid);
-	check (ret == 0, "Failed to modify qp[%d] to rts", peer_ind);
-    
-	log ("\tqp[%"PRIu32"] <-> qp[%"PRIu32"]", 
-	     ib_res.qp[peer_ind]->qp_num, remote_qp_info[i].qp_num);
+	ret = connect_peer (i, &remote_qp_info[i], NULL);
+	check (ret == 0, "Failed to connect to server[%d]", i);
     }
     log (LOG_SUB_HEADER, "End of IB Config");
 
@@ -206,6 +508,9 @@ int connect_qp_client ()
 	check (n == sizeof(SOCK_SYNC_MSG), "Failed to receive sync from client");
     }
 
+    log ("bootstrap (sock): %d servers synced in %.3f ms", num_peers,
+	 (get_time_ns () - start_ns) / 1000000.0);
+
     for (i = 0; i < num_peers; i++) {
 	close (peer_sockfd[i]);
     }
@@ -236,143 +541,1371 @@ int connect_qp_client ()
     return -1;
 }
 
-int setup_ib ()
+/* rd_atomic limits, rnr retries and the srq of an rc qp created */
+/* outside rdma_cm; private_data carries our QPInfo              */
+static void fill_conn_param (int peer, struct QPInfo *net_info,
+			     struct rdma_conn_param *param)
 {
-    int	ret		         = 0;
-    int i                        = 0;
-    struct ibv_device **dev_list = NULL;    
-    memset (&ib_res, 0, sizeof(struct IBRes));
+    memset (param, 0, sizeof(struct rdma_conn_param));
+    param->private_data        = net_info;
+    param->private_data_len    = sizeof(struct QPInfo);
+    param->responder_resources = ib_res.max_dest_rd_atomic;
+    param->initiator_depth     = ib_res.max_rd_atomic;
+    param->retry_count         = 7;
+    param->rnr_retry_count     = 7;
+    param->srq                 = 1;
+    param->qp_num              = ib_res.qp[peer]->qp_num;
+}
 
-    if (config_info.is_server) {
-	ib_res.num_qps = config_info.num_clients;
-    } else {
-	ib_res.num_qps = config_info.num_servers;
-    }
+/* server side of one rdma_cm connection request */
+static int accept_peer_cm (struct rdma_cm_event *event, bool *rank_seen)
+{
+    int                     ret = 0;
+    struct rdma_cm_id      *id  = event->id;
+    struct QPInfo           remote, host, net;
+    struct rdma_conn_param  param;
 
-    /* get IB device list */
-    dev_list = ibv_get_device_list(NULL);
-    check(dev_list != NULL, "Failed to get ib device list.");
+    check (event->param.conn.private_data_len >= sizeof(struct QPInfo),
+	   "Invalid connection request: %d bytes of private data",
+	   event->param.conn.private_data_len);
+    qp_info_ntoh (&remote, (struct QPInfo *)event->param.conn.private_data);
 
-    /* create IB context */
-    ib_res.ctx = ibv_open_device(*dev_list);
-    check(ib_res.ctx != NULL, "Failed to open ib device.");
+    check (remote.rank < config_info.num_clients,
+	   "Invalid client rank: %"PRIu32"", remote.rank);
+    check (rank_seen[remote.rank] != true,
+	   "Duplicate client rank: %"PRIu32"", remote.rank);
+    check (id->verbs == ib_res.rails[0].ctx,
+	   "Failed to accept client[%"PRIu32"]: request arrived on another device",
+	   remote.rank);
+    rank_seen[remote.rank]    = true;
+    cm_res.ids[remote.rank]   = id;
 
-    /* allocate protection domain */
-    ib_res.pd = ibv_alloc_pd(ib_res.ctx);
-    check(ib_res.pd != NULL, "Failed to allocate protection domain.");
+    ret = connect_peer (remote.rank, &remote, id);
+    check (ret == 0, "Failed to connect to client[%"PRIu32"]", remote.rank);
 
-    /* query IB port attribute */
-    ret = ibv_query_port(ib_res.ctx, IB_PORT, &ib_res.port_attr);
-    check(ret == 0, "Failed to query IB port information.");
-    
-    /* register mr */
-    /* set the buf_size twice as large as msg_size * num_concurr_msgs */
-    /* the recv buffer occupies the first half while the sending buffer */
-    /* occupies the second half */
-    /* assume all msgs are of the same content */
-    ib_res.ib_buf_size = config_info.msg_size * config_info.num_concurr_msgs * ib_res.num_qps;
-    ib_res.ib_buf      = (char *) memalign (4096, ib_res.ib_buf_size);
-    check (ib_res.ib_buf != NULL, "Failed to allocate ib_buf");
-
-    ib_res.mr = ibv_reg_mr (ib_res.pd, (void *)ib_res.ib_buf,
-			    ib_res.ib_buf_size,
-			    IBV_ACCESS_LOCAL_WRITE |
-			    IBV_ACCESS_REMOTE_READ |
-			    IBV_ACCESS_REMOTE_WRITE);
-    check (ib_res.mr != NULL, "Failed to register mr");
-    
-    /* query IB device attr */
-    ret = ibv_query_device(ib_res.ctx, &ib_res.dev_attr);
-    check(ret==0, "Failed to query device");
-    
-    /* create cq */
-    ib_res.cq = ibv_create_cq (ib_res.ctx, ib_res.dev_attr.max_cqe, 
-			       NULL, NULL, 0);
-    check (ib_res.cq != NULL, "Failed to create cq");
-
-    /* create srq */
-    struct ibv_srq_init_attr srq_init_attr = {
-	.attr.max_wr  = ib_res.dev_attr.max_srq_wr,
-	.attr.max_sge = 1,
-    };
+    fill_local_qp_info (remote.rank, &host);
+    qp_info_hton (&net, &host);
+    fill_conn_param (remote.rank, &net, &param);
 
-    ib_res.srq = ibv_create_srq (ib_res.pd, &srq_init_attr);
+    ret = rdma_accept (id, &param);
+    check (ret == 0, "Failed to accept client[%"PRIu32"]", remote.rank);
 
-    /* create qp */
-    struct ibv_qp_init_attr qp_init_attr = {
-        .send_cq = ib_res.cq,
-        .recv_cq = ib_res.cq,
-	.srq     = ib_res.srq,
-        .cap = {
-            .max_send_wr = ib_res.dev_attr.max_qp_wr,
-            .max_recv_wr = ib_res.dev_attr.max_qp_wr,
-            .max_send_sge = 1,
-            .max_recv_sge = 1,
-        },
-        .qp_type = IBV_QPT_RC,
-    };
+    return 0;
+ error:
+    return -1;
+}
 
-    ib_res.qp = (struct ibv_qp **) calloc (ib_res.num_qps, 
-					   sizeof(struct ibv_qp *));
-    check (ib_res.qp != NULL, "Failed to allocate qp");
+/*
+ *  connect_qp_server_cm:
+ *       accept every client through rdma_cm; requests are served in
+ *       arrival order and each qp reaches rts before it is accepted
+ */
+static int connect_qp_server_cm ()
+{
+    int                   ret             = 0;
+    int                   num_peers       = config_info.num_clients;
+    int                   num_established = 0;
+    bool                 *rank_seen       = NULL;
+    struct rdma_cm_event *event           = NULL;
+    uint64_t              start_ns        = get_time_ns ();
 
-    for (i = 0; i < ib_res.num_qps; i++) {
-	ib_res.qp[i] = ibv_create_qp (ib_res.pd, &qp_init_attr);
-	check (ib_res.qp[i] != NULL, "Failed to create qp[%d]", i);
-    }
+    rank_seen = (bool *) calloc (num_peers, sizeof(bool));
+    check (rank_seen != NULL, "Failed to allocate bootstrap state");
 
-    /* connect QP */
-    if (config_info.is_server) {
-	ret = connect_qp_server ();
-    } else {
-	ret = connect_qp_client ();
+    log (LOG_SUB_HEADER, "Start of IB Config");
+    while (num_established < num_peers) {
+	ret = cm_get_event (&event);
+	check (ret == 0, "Failed to get cm event");
+
+	enum rdma_cm_event_type type = event->event;
+
+	if (type == RDMA_CM_EVENT_CONNECT_REQUEST) {
+	    ret = accept_peer_cm (event, rank_seen);
+	} else if (type == RDMA_CM_EVENT_ESTABLISHED) {
+	    num_established += 1;
+	}
+	rdma_ack_cm_event (event);
+
+	check ((type == RDMA_CM_EVENT_CONNECT_REQUEST) ||
+	       (type == RDMA_CM_EVENT_ESTABLISHED),
+	       "Unexpected cm event: %s", rdma_event_str (type));
+	check (ret == 0, "Failed to accept connection request");
     }
-    check (ret == 0, "Failed to connect qp");
+    log (LOG_SUB_HEADER, "End of IB Config");
+
+    log ("bootstrap (cm): %d clients connected in %.3f ms", num_peers,
+	 (get_time_ns () - start_ns) / 1000000.0);
 
-    ibv_free_device_list (dev_list);
+    free (rank_seen);
     return 0;
 
  error:
-    if (dev_list != NULL) {
-	ibv_free_device_list (dev_list);
+    if (rank_seen != NULL) {
+	free (rank_seen);
     }
     return -1;
 }
 
-void close_ib_connection ()
+/*
+ *  connect_qp_client_cm:
+ *       connect to all servers at once over the ids cm_open_device
+ *       resolved; a qp is moved to rts and established as soon as
+ *       its server's reply arrives
+ */
+static int connect_qp_client_cm ()
 {
-    int i;
+    int                     ret             = 0, i = 0;
+    int                     num_peers       = config_info.num_servers;
+    int                     num_established = 0;
+    struct rdma_cm_event   *event           = NULL;
+    struct QPInfo           remote, host, net;
+    struct rdma_conn_param  param;
+    uint64_t                start_ns        = get_time_ns ();
 
-    if (ib_res.qp != NULL) {
-	for (i = 0; i < ib_res.num_qps; i++) {
-	    if (ib_res.qp[i] != NULL) {
-		ibv_destroy_qp (ib_res.qp[i]);
+    for (i = 0; i < num_peers; i++) {
+	fill_local_qp_info (i, &host);
+	qp_info_hton (&net, &host);
+	fill_conn_param (i, &net, &param);
+
+	ret = rdma_connect (cm_res.ids[i], &param);
+	check (ret == 0, "Failed to connect to server[%d]", i);
+    }
+
+    log (LOG_SUB_HEADER, "Start of IB Config");
+    while (num_established < num_peers) {
+	ret = cm_get_event (&event);
+	check (ret == 0, "Failed to get cm event");
+
+	enum rdma_cm_event_type type = event->event;
+	struct rdma_cm_id      *id   = event->id;
+
+	i   = (int)(intptr_t)id->context;
+	ret = -1;
+	if ((type == RDMA_CM_EVENT_CONNECT_RESPONSE) &&
+	    (event->param.conn.private_data_len >= sizeof(struct QPInfo))) {
+	    qp_info_ntoh (&remote, (struct QPInfo *)event->param.conn.private_data);
+	    ret = connect_peer (i, &remote, id);
+	    if (ret == 0) {
+		ret = rdma_establish (id);
 	    }
 	}
-	free (ib_res.qp);
+	rdma_ack_cm_event (event);
+
+	check (type == RDMA_CM_EVENT_CONNECT_RESPONSE,
+	       "Failed to connect to server[%d]: %s", i, rdma_event_str (type));
+	check (ret == 0, "Failed to establish connection to server[%d]", i);
+	num_established += 1;
+    }
+    log (LOG_SUB_HEADER, "End of IB Config");
+
+    log ("bootstrap (cm): %d servers connected in %.3f ms, %.3f ms resolving",
+	 num_peers, (get_time_ns () - start_ns + cm_res.resolve_ns) / 1000000.0,
+	 cm_res.resolve_ns / 1000000.0);
+
+    return 0;
+ error:
+    return -1;
+}
+
+/* back ib_buf with the largest page size up to the configured one */
+/* that the system can provide; 4 KiB pages when none is left      */
+static int alloc_ib_buf (size_t size)
+{
+    static const int page_shift[] = {0, 21, 30};
+    int              h            = config_info.hugepages;
+
+    for (; h > HUGEPAGES_NONE; h--) {
+	size_t page_size = (size_t)1 << page_shift[h];
+	size_t map_size  = (size + page_size - 1) & ~(page_size - 1);
+	void  *buf       = mmap (NULL, map_size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+				 (page_shift[h] << MAP_HUGE_SHIFT), -1, 0);
+
+	if (buf != MAP_FAILED) {
+	    ib_res.ib_buf           = (char *) buf;
+	    ib_res.ib_buf_page_size = page_size;
+	    ib_res.ib_buf_map_size  = map_size;
+	    return 0;
+	}
+	log ("ib_buf: no %zu MiB hugepages for %zu bytes, falling back",
+	     page_size >> 20, map_size);
     }
 
-    if (ib_res.srq != NULL) {
-	ibv_destroy_srq (ib_res.srq);
+    ib_res.ib_buf           = (char *) memalign (4096, size);
+    ib_res.ib_buf_page_size = 4096;
+    ib_res.ib_buf_map_size  = 0;
+    return (ib_res.ib_buf != NULL) ? 0 : -1;
+}
+
+/* pinned pages of this process (VmPin), -1 if the kernel does not say */
+static long get_pinned_kb ()
+{
+    FILE *fp   = fopen ("/proc/self/status", "r");
+    char  line[128];
+    long  kb   = -1;
+
+    if (fp == NULL) {
+	return -1;
+    }
+    while (fgets (line, sizeof(line), fp) != NULL) {
+	if (sscanf (line, "VmPin: %ld kB", &kb) == 1) {
+	    break;
+	}
     }
+    fclose (fp);
+    return kb;
+}
+
+/* peers are dealt to threads round-robin */
+static inline int thread_num_peers (int t)
+{
+    return (ib_res.num_qps - t + ib_res.num_threads - 1) / ib_res.num_threads;
+}
 
-    if (ib_res.cq != NULL) {
-	ibv_destroy_cq (ib_res.cq);
+/* where worker t runs: the configured cpus in turn, or else next */
+/* to its rail, or cpu t if the topology is unknown               */
+static int thread_cpu (int t, struct IBRail *rail)
+{
+    int i = 0, k = 0, cpu = -1;
+
+    if (config_info.num_cpus > 0) {
+	return config_info.cpus[t % config_info.num_cpus];
+    }
+    if (rail->numa_node >= 0) {
+	for (i = 0; i < t; i++) {
+	    k += (ib_res.thread_res[i].rail->numa_node == rail->numa_node);
+	}
+	cpu = node_cpu (rail->numa_node, k);
     }
+    return (cpu >= 0) ? cpu : t;
+}
+
+/* the first rail opened on ctx; it owns pd and mr */
+static struct IBRail *rail_owner (struct IBRail *rail)
+{
+    int i = 0;
 
-    if (ib_res.mr != NULL) {
-	ibv_dereg_mr (ib_res.mr);
+    for (i = 0; ib_res.rails[i].ctx != rail->ctx; i++) {
+	;
     }
+    return &ib_res.rails[i];
+}
 
-    if (ib_res.pd != NULL) {
-        ibv_dealloc_pd (ib_res.pd);
+/*
+ *  add_rails:
+ *       one rail per port of dev, or only for port if it is not 0;
+ *       a whole device contributes its active ports. *ctx is opened
+ *       on first use and shared by all rails of the device
+ *
+ *  return value:
+ *       0 on success, -1 on error
+ */
+static int add_rails (struct ibv_device *dev, struct ibv_context **ctx, int port)
+{
+    int                     ret   = 0, p = 0;
+    struct ibv_device_attr  dev_attr;
+    struct ibv_port_attr    port_attr;
+    struct IBRail          *rails = NULL, *rail = NULL;
+
+    if (*ctx == NULL) {
+	*ctx = ibv_open_device (dev);
+	check (*ctx != NULL, "Failed to open ib device %s", ibv_get_device_name (dev));
     }
+    ret = ibv_query_device (*ctx, &dev_attr);
+    check (ret == 0, "Failed to query ib device %s", ibv_get_device_name (dev));
+    check (port <= dev_attr.phys_port_cnt, "Failed to find port %d of %s",
+	   port, ibv_get_device_name (dev));
+
+    for (p = 1; p <= dev_attr.phys_port_cnt; p++) {
+	if ((port > 0) && (p != port)) {
+	    continue;
+	}
+	ret = ibv_query_port (*ctx, p, &port_attr);
+	check (ret == 0, "Failed to query port %d of %s", p, ibv_get_device_name (dev));
+	if ((port == 0) && (port_attr.state != IBV_PORT_ACTIVE)) {
+	    continue;
+	}
+
+	rails = (struct IBRail *) realloc (ib_res.rails,
+		(ib_res.num_rails + 1) * sizeof(struct IBRail));
+	check (rails != NULL, "Failed to allocate rails");
+	ib_res.rails = rails;
 
-    if (ib_res.ctx != NULL) {
-        ibv_close_device (ib_res.ctx);
+	rail = &ib_res.rails[ib_res.num_rails];
+	memset (rail, 0, sizeof(struct IBRail));
+	rail->ctx       = *ctx;
+	rail->port_num  = p;
+	rail->numa_node = read_numa_node (dev);
+	snprintf (rail->name, sizeof(rail->name), "%s", ibv_get_device_name (dev));
+	ib_res.num_rails += 1;
+	rail->owner = (rail_owner (rail) == rail);
     }
+    return 0;
+ error:
+    return -1;
+}
 
-    if (ib_res.ib_buf != NULL) {
-	free (ib_res.ib_buf);
+/* devices opened but without a selected port; rails close the others */
+static void close_unused_devices (struct ibv_context **ctx, int num_devs)
+{
+    int d = 0, r = 0;
+
+    for (d = 0; d < num_devs; d++) {
+	for (r = 0; (ctx[d] != NULL) && (r < ib_res.num_rails); r++) {
+	    if (ib_res.rails[r].ctx == ctx[d]) {
+		break;
+	    }
+	}
+	if ((ctx[d] != NULL) && (r == ib_res.num_rails)) {
+	    ibv_close_device (ctx[d]);
+	}
     }
 }
+
+/*
+ *  select_rails:
+ *       the ports to stripe threads over. ib_devices is "all" or a
+ *       comma separated list of device or device:port names; without
+ *       it, port IB_PORT of the first device
+ *
+ *  return value:
+ *       0 on success, -1 on error
+ */
+static int select_rails (struct ibv_device **dev_list, int num_devs)
+{
+    int                   ret   = 0, d = 0, port = 0;
+    struct ibv_context  **ctx   = NULL;
+    char                 *spec  = config_info.ib_devices;
+    char                 *colon = NULL;
+    char                  tok[IBV_SYSFS_NAME_MAX + 8];
+    bool                  found = false;
+
+    check (num_devs > 0, "Failed to find an ib device");
+    ctx = (struct ibv_context **) calloc (num_devs, sizeof(struct ibv_context *));
+    check (ctx != NULL, "Failed to allocate device contexts");
+
+    if (spec == NULL) {
+	ret = add_rails (dev_list[0], &ctx[0], IB_PORT);
+	check (ret == 0, "Failed to open port %d of the first ib device", IB_PORT);
+    }
+
+    while (spec != NULL) {
+	char *comma = strchr (spec, ',');
+	int   len   = (comma != NULL) ? comma - spec : (int)strlen (spec);
+
+	snprintf (tok, sizeof(tok), "%.*s", len, spec);
+	spec = (comma != NULL) ? comma + 1 : NULL;
+
+	port  = 0;
+	colon = strchr (tok, ':');
+	if (colon != NULL) {
+	    *colon = '\0';
+	    port   = atoi (colon + 1);
+	    check (port > 0, "Invalid Value: ib_devices port %s", colon + 1);
+	}
+
+	found = false;
+	for (d = 0; d < num_devs; d++) {
+	    if ((strcmp (tok, "all") != 0) &&
+		(strcmp (tok, ibv_get_device_name (dev_list[d])) != 0)) {
+		continue;
+	    }
+	    found = true;
+	    ret = add_rails (dev_list[d], &ctx[d], port);
+	    check (ret == 0, "Failed to open ib device %s",
+		   ibv_get_device_name (dev_list[d]));
+	}
+	check (found, "Failed to find ib device %s", tok);
+    }
+    check (ib_res.num_rails > 0, "Failed to find an active port");
+
+    close_unused_devices (ctx, num_devs);
+    free (ctx);
+    return 0;
+ error:
+    if (ctx != NULL) {
+	close_unused_devices (ctx, num_devs);
+	free (ctx);
+    }
+    return -1;
+}
+
+/* protection domain, port and device attributes and gid of a rail */
+static int init_rail (struct IBRail *rail)
+{
+    int ret = 0;
+
+    if (rail->owner) {
+	rail->pd = ibv_alloc_pd (rail->ctx);
+	check (rail->pd != NULL, "Failed to allocate protection domain on %s",
+	       rail->name);
+    } else {
+	rail->pd = rail_owner (rail)->pd;
+    }
+
+    ret = ibv_query_port (rail->ctx, rail->port_num, &rail->port_attr);
+    check (ret == 0, "Failed to query port %"PRIu8" of %s", rail->port_num, rail->name);
+
+    ret = ibv_query_device (rail->ctx, &rail->dev_attr);
+    check (ret == 0, "Failed to query device %s", rail->name);
+
+    /* roce ports have no lids, peers are addressed by gid in a grh */
+    rail->gid_index = config_info.gid_index;
+    if ((rail->gid_index < 0) &&
+	(rail->port_attr.link_layer == IBV_LINK_LAYER_ETHERNET)) {
+	rail->gid_index = 0;
+    }
+    if (rail->gid_index >= 0) {
+	char gid_str[INET6_ADDRSTRLEN] = {'\0'};
+
+	ret = ibv_query_gid (rail->ctx, rail->port_num, rail->gid_index, &rail->gid);
+	check (ret == 0, "Failed to query gid[%d] of %s port %"PRIu8"",
+	       rail->gid_index, rail->name, rail->port_num);
+	inet_ntop (AF_INET6, rail->gid.raw, gid_str, sizeof(gid_str));
+	log ("%s port %"PRIu8": gid[%d] = %s, active_mtu = %d, numa_node = %d",
+	     rail->name, rail->port_num, rail->gid_index, gid_str,
+	     128 << rail->port_attr.active_mtu, rail->numa_node);
+    } else {
+	log ("%s port %"PRIu8": lid = %"PRIu16", active_mtu = %d, numa_node = %d",
+	     rail->name, rail->port_num, rail->port_attr.lid,
+	     128 << rail->port_attr.active_mtu, rail->numa_node);
+    }
+    return 0;
+ error:
+    return -1;
+}
+
+static uint32_t clamp_depth (uint32_t depth, int max, char *name)
+{
+    if (depth > (uint32_t)max) {
+	log ("%s = %"PRIu32" exceeds the device limit, using %d", name, depth, max);
+	return max;
+    }
+    return depth;
+}
+
+/* send wrs a qp can hold: the window, up to one signaling interval */
+/* of completed but not yet retired wrs, and the control messages   */
+static uint32_t sq_depth (int num_peers)
+{
+    uint32_t window = (uint32_t)config_info.num_concurr_msgs * num_peers;
+    uint32_t slack  = (uint32_t)config_info.sig_interval;
+
+    if (config_info.sq_depth > 0) {
+	return config_info.sq_depth;
+    }
+    if (slack > window) {
+	slack = window;
+    }
+    return window + slack + 2 * num_peers + 2 * IB_SQ_CTL_RESERVE;
+}
+
+/* send slab slots of a thread with num_peers peers: as many as its */
+/* qps take send wrs (see the cap on max_send_wr), so a full slab    */
+/* means full send queues, whose last wrs are signaled and give the  */
+/* slots back; one-sided transports send from their own buffers     */
+static uint32_t thread_send_slots (int num_peers)
+{
+    uint32_t depth = 0, ctl = 0;
+
+    if ((config_info.workload != WORKLOAD_ECHO) ||
+	(config_info.transport == TRANSPORT_WRITE)) {
+	return 0;
+    }
+    if (config_info.transport == TRANSPORT_UD) {
+	depth = sq_depth (num_peers);
+	ctl   = 2 * num_peers + IB_SQ_CTL_RESERVE;
+	return (depth > ctl) ? depth - ctl : 0;
+    }
+    depth = sq_depth (1);
+    ctl   = IB_SQ_CTL_RESERVE;
+    return (depth > ctl) ? num_peers * (depth - ctl) : 0;
+}
+
+/* poll_mode picks whether and when the thread sleeps on its cq */
+int init_thread_cq_waiter (struct CQWaiter *w, long thread_id)
+{
+    uint64_t budget_ns = 0;
+
+    if (config_info.poll_mode == POLL_HYBRID) {
+	budget_ns = (uint64_t)config_info.poll_budget_us * 1000;
+    }
+    return init_cq_waiter (w, ib_res.thread_res[thread_id].channel,
+			   config_info.poll_mode != POLL_BUSY, budget_ns);
+}
+
+/* cpu_ns and duration (us) cover the same measured num_ops */
+void log_thread_cpu (long thread_id, uint64_t cpu_ns, double duration,
+		     long num_ops, struct CQWaiter *w)
+{
+    struct ThreadRes *tres = &ib_res.thread_res[thread_id];
+
+    tres->cpu_util   = (double)cpu_ns / 1000.0 / duration;
+    tres->cpu_per_op = (num_ops > 0) ? (double)cpu_ns / num_ops : 0.0;
+    tres->num_sleeps = w->num_sleeps;
+    log ("thread[%ld]: cpu = %.2f cores, %.1f ns/op, %ld sleeps, %ld wakeups",
+	 thread_id, tres->cpu_util, tres->cpu_per_op,
+	 w->num_sleeps, w->num_wakeups);
+}
+
+/* cpu cost next to throughput, to compare poll modes per deployment */
+void log_aggregate_cpu ()
+{
+    int    i          = 0;
+    double cpu_util   = 0.0;
+    double throughput = 0.0;
+    long   num_sleeps = 0;
+    static char *poll_mode_name[] = {"busy", "event", "hybrid"};
+
+    for (i = 0; i < ib_res.num_threads; i++) {
+	cpu_util   += ib_res.thread_res[i].cpu_util;
+	throughput += ib_res.thread_res[i].throughput;
+	num_sleeps += ib_res.thread_res[i].num_sleeps;
+    }
+
+    /* cores / (Mops/s) is us of cpu per op */
+    log ("aggregate: poll_mode = %s, cpu = %.2f cores, %.1f ns/op, %ld sleeps",
+	 poll_mode_name[config_info.poll_mode], cpu_util,
+	 (throughput > 0.0) ? cpu_util / throughput * 1000.0 : 0.0, num_sleeps);
+}
+
+/* per-opcode rpc stats of all threads */
+void log_aggregate_rpc ()
+{
+    int              i     = 0;
+    struct RPCStats *stats = NULL;
+
+    stats = (struct RPCStats *) malloc (RPC_MAX_OPS * sizeof(struct RPCStats));
+    check (stats != NULL, "Failed to allocate aggregate rpc stats");
+
+    rpc_init_stats (stats);
+    for (i = 0; i < ib_res.num_threads; i++) {
+	if (ib_res.thread_res[i].rpc_stats != NULL) {
+	    rpc_merge_stats (stats, ib_res.thread_res[i].rpc_stats);
+	}
+    }
+    rpc_log_stats ("aggregate", stats);
+    free (stats);
+ error:
+    return;
+}
+
+/* where a worker and its memory ended up, which the kernel may */
+/* have decided differently from the plan logged at setup      */
+void log_thread_placement (long thread_id, void *wc)
+{
+    struct ThreadRes *tres = &ib_res.thread_res[thread_id];
+    int               cpu  = sched_getcpu ();
+    int               node = cpu_node (cpu);
+
+    log ("thread[%ld]: running on cpu %d (numa_node %d), buf on numa_node %d, "
+	 "wc on numa_node %d", thread_id, cpu, node, page_node (tres->buf),
+	 page_node (wc));
+    if ((tres->rail != NULL) && (tres->rail->numa_node >= 0) && (node >= 0) &&
+	(node != tres->rail->numa_node)) {
+	log ("thread[%ld]: %s is on numa_node %d, completions cross sockets",
+	     thread_id, tres->rail->name, tres->rail->numa_node);
+    }
+}
+
+/* stripe mode: what each port carried, in ops and payload bits */
+void log_aggregate_rails ()
+{
+    int    r = 0, t = 0, num = 0;
+    double mops = 0.0, tot_mops = 0.0;
+
+    if (ib_res.num_rails <= 1) {
+	return;
+    }
+    for (r = 0; r < ib_res.num_rails; r++) {
+	struct IBRail *rail = &ib_res.rails[r];
+
+	num  = 0;
+	mops = 0.0;
+	for (t = r; t < ib_res.num_threads; t += ib_res.num_rails) {
+	    num  += 1;
+	    mops += ib_res.thread_res[t].throughput;
+	}
+	tot_mops += mops;
+	log ("rail[%d]: %s port %"PRIu8", numa_node = %d, %d threads, "
+	     "throughput = %f (Mops/s), %.2f Gb/s", r, rail->name, rail->port_num,
+	     rail->numa_node, num, mops, mops * config_info.msg_size * 8 / 1000.0);
+    }
+    log ("aggregate: %d rails, throughput = %f (Mops/s), %.2f Gb/s",
+	 ib_res.num_rails, tot_mops, tot_mops * config_info.msg_size * 8 / 1000.0);
+}
+
+/* a per-port counter of the driver, -1 if it exports none by that name */
+static long read_port_counter (struct IBRail *rail, const char *name)
+{
+    char  path[IBV_SYSFS_PATH_MAX + 64];
+    FILE *fp  = NULL;
+    long  val = -1;
+
+    snprintf (path, sizeof(path), "/sys/class/infiniband/%s/ports/%"PRIu8"/hw_counters/%s",
+	      rail->name, rail->port_num, name);
+    fp = fopen (path, "r");
+    if (fp == NULL) {
+	return -1;
+    }
+    if (fscanf (fp, "%ld", &val) != 1) {
+	val = -1;
+    }
+    fclose (fp);
+    return val;
+}
+
+/* rnr events are invisible to the application while rnr_retry is 7: */
+/* out_of_buffer counts rnr naks this port sent for an empty srq,     */
+/* rnr_nak_retry_err sends it gave up on after too many of them       */
+static void snapshot_rnr_counters ()
+{
+    int r = 0;
+
+    for (r = 0; r < ib_res.num_rails; r++) {
+	struct IBRail *rail = &ib_res.rails[r];
+
+	rail->out_of_buffer_base = read_port_counter (rail, "out_of_buffer");
+	rail->rnr_retry_err_base = read_port_counter (rail, "rnr_nak_retry_err");
+    }
+}
+
+/* rnr events of the run; the counters cover every process on the port */
+void log_rnr_events ()
+{
+    int r = 0;
+
+    for (r = 0; r < ib_res.num_rails; r++) {
+	struct IBRail *rail          = &ib_res.rails[r];
+	long           out_of_buffer = read_port_counter (rail, "out_of_buffer");
+	long           rnr_retry_err = read_port_counter (rail, "rnr_nak_retry_err");
+
+	if ((out_of_buffer < 0) || (rail->out_of_buffer_base < 0)) {
+	    log ("rail[%d]: %s port %"PRIu8": rnr counters not exported by the driver",
+		 r, rail->name, rail->port_num);
+	    continue;
+	}
+	log ("rail[%d]: %s port %"PRIu8": %ld rnr naks sent, %ld sends out of rnr retries",
+	     r, rail->name, rail->port_num, out_of_buffer - rail->out_of_buffer_base,
+	     (rnr_retry_err >= 0) && (rail->rnr_retry_err_base >= 0) ?
+	     rnr_retry_err - rail->rnr_retry_err_base : 0);
+    }
+}
+
+/* send accounting, rings and stats back to their initial state before */
+/* another run over the same qps; msg_size and num_concurr_msgs may    */
+/* have changed, but never beyond what the buffers were sized for     */
+void reset_ib_run ()
+{
+    int i = 0;
+
+    for (i = 0; (ib_res.sq_state != NULL) && (i < ib_res.num_qps); i++) {
+	reset_qp_send_state (&ib_res.sq_state[i]);
+    }
+    for (i = 0; (ib_res.ud_sq_state != NULL) && (i < ib_res.num_threads); i++) {
+	reset_qp_send_state (&ib_res.ud_sq_state[i]);
+    }
+    snapshot_rnr_counters ();
+
+    if (ib_res.rings != NULL) {
+	ib_res.ring_slot_size = ring_slot_size (config_info.msg_size);
+	for (i = 0; i < ib_res.num_qps; i++) {
+	    struct PeerRing *ring = &ib_res.rings[i];
+
+	    memset (ring->recv_ring, 0, 2 * (ring->send_ring - ring->recv_ring));
+	    ring->recv_seq = 0;
+	    ring->send_seq = 0;
+	}
+    }
+
+    for (i = 0; i < ib_res.num_threads; i++) {
+	struct ThreadRes *tres = &ib_res.thread_res[i];
+
+	if (tres->lat_hist != NULL) {
+	    free (tres->lat_hist);
+	    tres->lat_hist = NULL;
+	}
+	if (tres->rpc_stats != NULL) {
+	    free (tres->rpc_stats);
+	    tres->rpc_stats = NULL;
+	}
+	tres->ops_count  = 0;
+	tres->throughput = 0.0;
+    }
+}
+
+int setup_ib ()
+{
+    int	ret		         = 0;
+    int i                        = 0, t = 0, r = 0;
+    int num_devs                 = 0;
+    struct ibv_device **dev_list = NULL;    
+    cpu_set_t setup_cpus;
+    memset (&ib_res, 0, sizeof(struct IBRes));
+
+    if (config_info.is_server) {
+	ib_res.num_qps = config_info.num_clients;
+    } else {
+	ib_res.num_qps = config_info.num_servers;
+    }
+
+    /* a thread without peers would never see any traffic */
+    ib_res.num_threads = config_info.num_threads;
+    if (ib_res.num_threads > ib_res.num_qps) {
+	ib_res.num_threads = ib_res.num_qps;
+    }
+
+    /* the setup thread moves to each worker's node to allocate */
+    /* its memory; remember where it was allowed to run          */
+    sched_getaffinity (0, sizeof(cpu_set_t), &setup_cpus);
+
+    if (config_info.connect_mode == CONNECT_CM) {
+	/* the device and port the servers are reachable through */
+	ib_res.rails = (struct IBRail *) calloc (1, sizeof(struct IBRail));
+	check (ib_res.rails != NULL, "Failed to allocate rails");
+	ib_res.num_rails         = 1;
+	ib_res.rails[0].owner    = true;
+	ib_res.rails[0].port_num = IB_PORT;
+	ret = cm_open_device (&ib_res.rails[0].ctx, &ib_res.rails[0].port_num);
+	check (ret == 0, "Failed to set up rdma_cm");
+	snprintf (ib_res.rails[0].name, sizeof(ib_res.rails[0].name), "%s",
+		  ibv_get_device_name (ib_res.rails[0].ctx->device));
+	ib_res.rails[0].numa_node = read_numa_node (ib_res.rails[0].ctx->device);
+    } else {
+	/* get IB device list */
+	dev_list = ibv_get_device_list (&num_devs);
+	check (dev_list != NULL, "Failed to get ib device list.");
+
+	ret = select_rails (dev_list, num_devs);
+	check (ret == 0, "Failed to select ib ports");
+    }
+
+    for (r = 0; r < ib_res.num_rails; r++) {
+	ret = init_rail (&ib_res.rails[r]);
+	check (ret == 0, "Failed to set up rail[%d]", r);
+    }
+
+    /* a datagram is at most one mtu and lands behind a 40-byte grh; */
+    /* with rendezvous an srq slot holds an eager msg or a descriptor */
+    ib_res.recv_size = config_info.msg_size;
+    if (rndv_enabled (config_info.msg_size)) {
+	ib_res.recv_size = config_info.eager_threshold;
+	if (ib_res.recv_size < sizeof(struct RndvDesc)) {
+	    ib_res.recv_size = sizeof(struct RndvDesc);
+	}
+    }
+    if (config_info.transport == TRANSPORT_UD) {
+	uint32_t mtu = 128u << ib_res.rails[0].port_attr.active_mtu;
+
+	check (config_info.msg_size <= mtu,
+	       "Invalid Value: msg_size = %d, ud transport allows the mtu (%"PRIu32")",
+	       config_info.msg_size, mtu);
+	ib_res.recv_size += IB_GRH_SIZE;
+    }
+    ib_res.recv_size = (ib_res.recv_size + 63) & ~63;
+
+    /* register mr */
+    /* each peer gets recv_size * (num_concurr_msgs + IB_RECV_CTL_RESERVE) */
+    /* bytes of ib_buf; assume all msgs are of the same content           */
+    /* the write transport appends a recv ring and a send ring per peer */
+    size_t srq_buf_size  = (size_t)ib_res.recv_size *
+	(config_info.num_concurr_msgs + IB_RECV_CTL_RESERVE) * ib_res.num_qps;
+    size_t send_buf_size = 0;
+    size_t ring_buf_size = 0;
+    size_t ring_offset   = 0;
+    size_t target_offset = 0;
+
+    /* two-sided echo sends out of per-thread slabs behind the srq slices */
+    for (t = 0; t < ib_res.num_threads; t++) {
+	send_buf_size += (size_t)ib_res.recv_size * thread_send_slots (thread_num_peers (t));
+    }
+    ring_offset = srq_buf_size + send_buf_size;
+
+    if (config_info.transport == TRANSPORT_WRITE) {
+	ib_res.ring_slot_size = ring_slot_size (config_info.msg_size);
+	ring_buf_size = 2 * ib_res.ring_slot_size *
+	    config_info.num_concurr_msgs * ib_res.num_qps;
+    }
+
+    /* the server exposes num_counters 8-byte aligned targets to */
+    /* client-driven read and atomic workloads                   */
+    if (config_info.workload == WORKLOAD_READ) {
+	ib_res.target_stride = ((size_t)config_info.msg_size + 7) & ~(size_t)7;
+    } else {
+	ib_res.target_stride = sizeof(uint64_t);
+    }
+    if (config_info.is_server && (config_info.workload != WORKLOAD_ECHO)) {
+	ib_res.target_size = ib_res.target_stride * config_info.num_counters;
+	target_offset      = (ring_offset + ring_buf_size + 63) & ~(size_t)63;
+    }
+
+    ib_res.ib_buf_size = ring_offset + ring_buf_size;
+    if (ib_res.target_size > 0) {
+	ib_res.ib_buf_size = target_offset + ib_res.target_size;
+    }
+    ret = alloc_ib_buf (ib_res.ib_buf_size);
+    check (ret == 0, "Failed to allocate ib_buf");
+    log ("ib_buf: %zu bytes on %zu KiB pages", ib_res.ib_buf_size,
+	 ib_res.ib_buf_page_size >> 10);
+
+    if (ib_res.target_size > 0) {
+	ib_res.target_buf = ib_res.ib_buf + target_offset;
+	memset (ib_res.target_buf, 0, ib_res.target_size);
+    }
+
+    if (config_info.transport == TRANSPORT_WRITE) {
+	size_t ring_size = ib_res.ring_slot_size * config_info.num_concurr_msgs;
+
+	ib_res.rings = (struct PeerRing *) memalign (64,
+		ib_res.num_qps * sizeof(struct PeerRing));
+	check (ib_res.rings != NULL, "Failed to allocate rings");
+	memset (ib_res.rings, 0, ib_res.num_qps * sizeof(struct PeerRing));
+
+	/* sequence numbers start at 1, so zeroed slots are empty */
+	memset (ib_res.ib_buf + ring_offset, 0, ring_buf_size);
+	for (i = 0; i < ib_res.num_qps; i++) {
+	    ib_res.rings[i].recv_ring = ib_res.ib_buf + ring_offset + 2 * i * ring_size;
+	    ib_res.rings[i].send_ring = ib_res.rings[i].recv_ring + ring_size;
+	}
+    }
+
+    /* distribute peers across threads: peer i belongs to thread */
+    /* (i % num_threads); each thread gets a contiguous buf slice */
+    /* and thread t runs on rail (t % num_rails)                  */
+    ib_res.thread_res = (struct ThreadRes *) memalign (64,
+		ib_res.num_threads * sizeof(struct ThreadRes));
+    check (ib_res.thread_res != NULL, "Failed to allocate thread_res");
+    memset (ib_res.thread_res, 0, ib_res.num_threads * sizeof(struct ThreadRes));
+
+    char *buf_ptr  = ib_res.ib_buf;
+    char *send_ptr = ib_res.ib_buf + srq_buf_size;
+    for (t = 0; t < ib_res.num_threads; t++) {
+	struct ThreadRes *tres = &ib_res.thread_res[t];
+
+	tres->rail      = &ib_res.rails[t % ib_res.num_rails];
+	tres->cpu       = thread_cpu (t, tres->rail);
+	tres->numa_node = cpu_node (tres->cpu);
+	tres->num_peers = thread_num_peers (t);
+	tres->peers = (int *) calloc (tres->num_peers, sizeof(int));
+	check (tres->peers != NULL, "Failed to allocate peers for thread[%d]", t);
+	for (i = 0; i < tres->num_peers; i++) {
+	    tres->peers[i] = t + i * ib_res.num_threads;
+	}
+
+	tres->buf      = buf_ptr;
+	tres->buf_size = (size_t)ib_res.recv_size *
+	    (config_info.num_concurr_msgs + IB_RECV_CTL_RESERVE) * tres->num_peers;
+	buf_ptr       += tres->buf_size;
+
+	/* pages are placed where they are first touched, so the slice */
+	/* is touched from the worker's node before registration       */
+	uint32_t send_slots = thread_send_slots (tres->num_peers);
+	size_t   send_size  = (size_t)ib_res.recv_size * send_slots;
+
+	bind_to_node (tres->numa_node);
+	memset (tres->buf, 0, tres->buf_size);
+	memset (send_ptr, 0, send_size);
+	if (send_slots > 0) {
+	    ret = slab_init (&tres->send_slab, send_ptr, ib_res.recv_size, send_slots);
+	    check (ret == 0, "Failed to allocate send slab of thread[%d]", t);
+	}
+	send_ptr += send_size;
+
+	log ("thread[%d]: cpu = %d, numa_node = %d, %s port %"PRIu8" on numa_node %d",
+	     t, tres->cpu, tres->numa_node, tres->rail->name, tres->rail->port_num,
+	     tres->rail->numa_node);
+
+	pool_init (&tres->pool, tres->rail->pd,
+		   IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+	mrcache_init (&tres->mr_cache, tres->rail->pd,
+		      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ,
+		      (size_t)config_info.mr_cache << 20);
+    }
+
+    /* registration pins and translates every page of ib_buf, */
+    /* once per device                                         */
+    for (r = 0; r < ib_res.num_rails; r++) {
+	struct IBRail *rail      = &ib_res.rails[r];
+	uint64_t       reg_start = get_time_ns ();
+
+	if (rail->owner != true) {
+	    rail->mr = rail_owner (rail)->mr;
+	    continue;
+	}
+	rail->mr = ibv_reg_mr (rail->pd, (void *)ib_res.ib_buf,
+			       ib_res.ib_buf_size,
+			       IBV_ACCESS_LOCAL_WRITE |
+			       IBV_ACCESS_REMOTE_READ |
+			       IBV_ACCESS_REMOTE_WRITE |
+			       IBV_ACCESS_REMOTE_ATOMIC);
+	check (rail->mr != NULL, "Failed to register mr on %s", rail->name);
+	log ("ibv_reg_mr: %s: %zu pages in %.3f ms", rail->name,
+	     (ib_res.ib_buf_size + ib_res.ib_buf_page_size - 1) / ib_res.ib_buf_page_size,
+	     (get_time_ns () - reg_start) / 1000000.0);
+    }
+
+    /* outstanding reads/atomics per qp, as initiator and as target; */
+    /* what every rail can do                                         */
+    ib_res.max_rd_atomic      = 255;
+    ib_res.max_dest_rd_atomic = 255;
+    for (r = 0; r < ib_res.num_rails; r++) {
+	struct ibv_device_attr *dev_attr = &ib_res.rails[r].dev_attr;
+
+	if (dev_attr->max_qp_init_rd_atom < ib_res.max_rd_atomic) {
+	    ib_res.max_rd_atomic = dev_attr->max_qp_init_rd_atom;
+	}
+	if (dev_attr->max_qp_rd_atom < ib_res.max_dest_rd_atomic) {
+	    ib_res.max_dest_rd_atomic = dev_attr->max_qp_rd_atom;
+	}
+    }
+    log ("max_rd_atomic = %d, max_dest_rd_atomic = %d",
+	 ib_res.max_rd_atomic, ib_res.max_dest_rd_atomic);
+
+    /* pinned memory of each kind of verbs object, from VmPin deltas */
+    long pinned_kb     = 0;
+    long cq_pinned_kb  = 0;
+    long srq_pinned_kb = 0;
+    long qp_pinned_kb  = 0;
+
+    for (t = 0; t < ib_res.num_threads; t++) {
+	struct ThreadRes *tres = &ib_res.thread_res[t];
+
+	/* the thread's cq and srq come from its node */
+	bind_to_node (tres->numa_node);
+
+	/* threads that sleep on an empty cq wait on its channel fd */
+	if (config_info.poll_mode != POLL_BUSY) {
+	    tres->channel = ibv_create_comp_channel (tres->rail->ctx);
+	    check (tres->channel != NULL,
+		   "Failed to create completion channel for thread[%d]", t);
+
+	    int flags = fcntl (tres->channel->fd, F_GETFL);
+	    ret = fcntl (tres->channel->fd, F_SETFL, flags | O_NONBLOCK);
+	    check (ret == 0, "Failed to make channel fd of thread[%d] non-blocking", t);
+	}
+
+	/* the srq holds one recv per buffer of the slice; the cq takes */
+	/* those plus every send wr of the thread's qps being signaled  */
+	uint32_t srq_depth = (config_info.num_concurr_msgs + IB_RECV_CTL_RESERVE) *
+	    tres->num_peers;
+	uint32_t cq_depth  = 0;
+
+	if (config_info.srq_depth > 0) {
+	    srq_depth = config_info.srq_depth;
+	}
+	srq_depth = clamp_depth (srq_depth, tres->rail->dev_attr.max_srq_wr, "srq_depth");
+
+	if (config_info.transport == TRANSPORT_UD) {
+	    cq_depth = srq_depth + sq_depth (tres->num_peers);
+	} else {
+	    cq_depth = srq_depth + tres->num_peers * sq_depth (1);
+	}
+	if (config_info.cq_depth > 0) {
+	    cq_depth = config_info.cq_depth;
+	}
+	cq_depth = clamp_depth (cq_depth, tres->rail->dev_attr.max_cqe, "cq_depth");
+
+	/* create cq */
+	pinned_kb = get_pinned_kb ();
+	tres->cq = ibv_create_cq (tres->rail->ctx, cq_depth, NULL, tres->channel, 0);
+	check (tres->cq != NULL, "Failed to create cq for thread[%d]", t);
+	cq_pinned_kb += get_pinned_kb () - pinned_kb;
+
+	/* create srq */
+	struct ibv_srq_init_attr srq_init_attr = {
+	    .attr.max_wr  = srq_depth,
+	    .attr.max_sge = 1,
+	};
+
+	pinned_kb = get_pinned_kb ();
+	tres->srq = ibv_create_srq (tres->rail->pd, &srq_init_attr);
+	check (tres->srq != NULL, "Failed to create srq for thread[%d]", t);
+	srq_pinned_kb += get_pinned_kb () - pinned_kb;
+
+	log ("thread[%d]: %d peers, cq_depth = %d, srq_depth = %"PRIu32"",
+	     t, tres->num_peers, tres->cq->cqe, srq_init_attr.attr.max_wr);
+    }
+
+    /* create qp */
+    ib_res.qp = (struct ibv_qp **) calloc (ib_res.num_qps, 
+					   sizeof(struct ibv_qp *));
+    check (ib_res.qp != NULL, "Failed to allocate qp");
+
+    ib_res.sq_state = (struct QPSendState *) memalign (64,
+		ib_res.num_qps * sizeof(struct QPSendState));
+    check (ib_res.sq_state != NULL, "Failed to allocate sq_state");
+    memset (ib_res.sq_state, 0, ib_res.num_qps * sizeof(struct QPSendState));
+
+    ib_res.remote_buf = (struct RemoteBuf *) calloc (ib_res.num_qps,
+						     sizeof(struct RemoteBuf));
+    check (ib_res.remote_buf != NULL, "Failed to allocate remote_buf");
+
+    /* rc: one qp per peer; ud: one qp per thread, shared by its peers */
+    struct ibv_qp      **qps     = ib_res.qp;
+    struct QPSendState  *sqs     = ib_res.sq_state;
+    int                  num_new = ib_res.num_qps;
+    enum ibv_qp_type     qp_type = IBV_QPT_RC;
+
+    if (config_info.transport == TRANSPORT_UD) {
+	uint32_t tab_size = 1;
+
+	ib_res.ud_qp = (struct ibv_qp **) calloc (ib_res.num_threads,
+						  sizeof(struct ibv_qp *));
+	check (ib_res.ud_qp != NULL, "Failed to allocate ud_qp");
+
+	ib_res.ud_sq_state = (struct QPSendState *) memalign (64,
+		ib_res.num_threads * sizeof(struct QPSendState));
+	check (ib_res.ud_sq_state != NULL, "Failed to allocate ud_sq_state");
+	memset (ib_res.ud_sq_state, 0, ib_res.num_threads * sizeof(struct QPSendState));
+
+	ib_res.ah = (struct ibv_ah **) calloc (ib_res.num_qps,
+					       sizeof(struct ibv_ah *));
+	check (ib_res.ah != NULL, "Failed to allocate ah");
+
+	ib_res.remote_qpn = (uint32_t *) calloc (ib_res.num_qps, sizeof(uint32_t));
+	check (ib_res.remote_qpn != NULL, "Failed to allocate remote_qpn");
+
+	/* keep the peer table at most half full */
+	while (tab_size < 2 * (uint32_t)ib_res.num_qps) {
+	    tab_size <<= 1;
+	}
+	ib_res.ud_peer_mask = tab_size - 1;
+	ib_res.ud_peer_key  = (uint64_t *) calloc (tab_size, sizeof(uint64_t));
+	ib_res.ud_peer_val  = (int *) malloc (tab_size * sizeof(int));
+	check ((ib_res.ud_peer_key != NULL) && (ib_res.ud_peer_val != NULL),
+	       "Failed to allocate ud peer table");
+	memset (ib_res.ud_peer_val, 0xff, tab_size * sizeof(int));
+
+	qps     = ib_res.ud_qp;
+	sqs     = ib_res.ud_sq_state;
+	num_new = ib_res.num_threads;
+	qp_type = IBV_QPT_UD;
+    }
+
+    /* the device does not advertise its inline limit, so the first */
+    /* qp probes downwards from IB_MAX_INLINE_PROBE until it succeeds */
+    uint32_t max_inline   = IB_MAX_INLINE_PROBE;
+    uint32_t max_sq_depth = 0;
+
+    /* credits: the peer keeps num_concurr_msgs recvs for our data, */
+    /* its control reserve is not ours to use                       */
+    uint32_t recv_credits = 0;
+    if (config_info.flow_control == FLOW_CREDIT) {
+	recv_credits = config_info.num_concurr_msgs;
+    }
+    for (i = 0; i < num_new; i++) {
+	struct ThreadRes *tres = &ib_res.thread_res[i % ib_res.num_threads];
+	uint32_t qp_sq_depth   = clamp_depth (sq_depth ((qp_type == IBV_QPT_UD) ?
+							tres->num_peers : 1),
+					      tres->rail->dev_attr.max_qp_wr, "sq_depth");
+	struct ibv_qp_init_attr qp_init_attr = {
+	    .send_cq = tres->cq,
+	    .recv_cq = tres->cq,
+	    .srq     = tres->srq,
+	    .cap = {
+		.max_send_wr = qp_sq_depth,
+		.max_recv_wr = 0,	/* receives go to the srq */
+		.max_send_sge = 1,
+		.max_recv_sge = 1,
+		.max_inline_data = max_inline,
+	    },
+	    .qp_type = qp_type,
+	};
+
+	bind_to_node (tres->numa_node);
+	pinned_kb = get_pinned_kb ();
+	qps[i] = ibv_create_qp (tres->rail->pd, &qp_init_attr);
+	while ((qps[i] == NULL) && (i == 0) && (max_inline > 0)) {
+	    max_inline /= 2;
+	    qp_init_attr.cap.max_inline_data = max_inline;
+	    qps[i] = ibv_create_qp (tres->rail->pd, &qp_init_attr);
+	}
+	check (qps[i] != NULL, "Failed to create qp[%d]", i);
+	qp_pinned_kb += get_pinned_kb () - pinned_kb;
+	if (qp_init_attr.cap.max_send_wr > max_sq_depth) {
+	    max_sq_depth = qp_init_attr.cap.max_send_wr;
+	}
+
+	if (i == 0) {
+	    max_inline             = qp_init_attr.cap.max_inline_data;
+	    ib_res.max_inline_data = max_inline;
+	}
+
+	/* a ud qp also carries START and STOP for each of its peers; */
+	/* a deeper queue than asked for would outgrow the send slab   */
+	uint32_t max_send_wr = qp_init_attr.cap.max_send_wr;
+	if (max_send_wr > qp_sq_depth) {
+	    max_send_wr = qp_sq_depth;
+	}
+	if (qp_type == IBV_QPT_UD) {
+	    check (max_send_wr > 2 * (uint32_t)tres->num_peers + 2 * IB_SQ_CTL_RESERVE,
+		   "Failed to fit control msgs of %d peers in ud qp[%d]",
+		   tres->num_peers, i);
+	    max_send_wr -= 2 * tres->num_peers;
+	}
+	init_qp_send_state (&sqs[i], config_info.sig_interval, max_send_wr,
+			    (qp_type == IBV_QPT_RC) ? recv_credits : 0);
+	if (tres->send_slab.num_slots > 0) {
+	    sqs[i].slab     = &tres->send_slab;
+	    sqs[i].inflight = (char **) calloc (sqs[i].max_outstanding, sizeof(char *));
+	    check (sqs[i].inflight != NULL, "Failed to allocate inflight slots of qp[%d]", i);
+	}
+
+	/* ud qps need no peer to reach rts */
+	if (qp_type == IBV_QPT_UD) {
+	    ret = modify_ud_qp_to_rts (qps[i], tres->rail->port_num);
+	    check (ret == 0, "Failed to modify ud qp[%d] to rts", i);
+	}
+    }
+    log ("%d %s qps serve %d peers, sq_depth = %"PRIu32"", num_new,
+	 (qp_type == IBV_QPT_UD) ? "ud" : "rc", ib_res.num_qps, max_sq_depth);
+
+    if (pinned_kb >= 0) {
+	log ("pinned: ib_buf %zu KiB, %d cqs %ld KiB, %d srqs %ld KiB, %d qps %ld KiB, "
+	     "process total %ld KiB",
+	     ib_res.ib_buf_size >> 10, ib_res.num_threads, cq_pinned_kb,
+	     ib_res.num_threads, srq_pinned_kb, num_new, qp_pinned_kb,
+	     get_pinned_kb ());
+    } else {
+	log ("pinned: VmPin not reported by this kernel");
+    }
+
+    /* messages up to inline_threshold bytes are copied into the wqe */
+    if ((config_info.inline_threshold < 0) ||
+	(config_info.inline_threshold > ib_res.max_inline_data)) {
+	ib_res.inline_threshold = ib_res.max_inline_data;
+    } else {
+	ib_res.inline_threshold = config_info.inline_threshold;
+    }
+    log ("max_inline_data = %"PRIu32", inline_threshold = %"PRIu32"",
+	 ib_res.max_inline_data, ib_res.inline_threshold);
+
+    /* two-sided echo clients: receives go up before any server may */
+    /* send; one-sided clients post their control receives themselves */
+    if ((config_info.is_server != true) &&
+	(config_info.workload == WORKLOAD_ECHO) &&
+	(config_info.transport != TRANSPORT_WRITE)) {
+	ret = post_client_recvs ();
+	check (ret == 0, "Failed to pre-post client recvs");
+    }
+
+    /* connect QP */
+    if (config_info.connect_mode == CONNECT_CM) {
+	ret = config_info.is_server ? connect_qp_server_cm () : connect_qp_client_cm ();
+    } else if (config_info.is_server) {
+	ret = connect_qp_server ();
+    } else {
+	ret = connect_qp_client ();
+    }
+    check (ret == 0, "Failed to connect qp");
+    snapshot_rnr_counters ();
+
+    if (dev_list != NULL) {
+	ibv_free_device_list (dev_list);
+    }
+    sched_setaffinity (0, sizeof(cpu_set_t), &setup_cpus);
+    return 0;
+
+ error:
+    if (dev_list != NULL) {
+	ibv_free_device_list (dev_list);
+    }
+    sched_setaffinity (0, sizeof(cpu_set_t), &setup_cpus);
+    return -1;
+}
+
+void close_ib_connection ()
+{
+    int i;
+
+    if (ib_res.qp != NULL) {
+	for (i = 0; i < ib_res.num_qps; i++) {
+	    if (ib_res.qp[i] != NULL) {
+		ibv_destroy_qp (ib_res.qp[i]);
+	    }
+	}
+	free (ib_res.qp);
+    }
+
+    if (ib_res.sq_state != NULL) {
+	for (i = 0; i < ib_res.num_qps; i++) {
+	    free (ib_res.sq_state[i].inflight);
+	}
+	free (ib_res.sq_state);
+    }
+
+    if (ib_res.ah != NULL) {
+	for (i = 0; i < ib_res.num_qps; i++) {
+	    if (ib_res.ah[i] != NULL) {
+		ibv_destroy_ah (ib_res.ah[i]);
+	    }
+	}
+	free (ib_res.ah);
+    }
+
+    if (ib_res.ud_qp != NULL) {
+	for (i = 0; i < ib_res.num_threads; i++) {
+	    if (ib_res.ud_qp[i] != NULL) {
+		ibv_destroy_qp (ib_res.ud_qp[i]);
+	    }
+	}
+	free (ib_res.ud_qp);
+    }
+
+    if (ib_res.ud_sq_state != NULL) {
+	for (i = 0; i < ib_res.num_threads; i++) {
+	    free (ib_res.ud_sq_state[i].inflight);
+	}
+	free (ib_res.ud_sq_state);
+    }
+
+    if (ib_res.remote_qpn != NULL) {
+	free (ib_res.remote_qpn);
+    }
+
+    if (ib_res.ud_peer_key != NULL) {
+	free (ib_res.ud_peer_key);
+    }
+
+    if (ib_res.ud_peer_val != NULL) {
+	free (ib_res.ud_peer_val);
+    }
+
+    if (ib_res.rings != NULL) {
+	free (ib_res.rings);
+    }
+
+    if (ib_res.remote_buf != NULL) {
+	free (ib_res.remote_buf);
+    }
+
+    if (ib_res.thread_res != NULL) {
+	for (i = 0; i < ib_res.num_threads; i++) {
+	    struct ThreadRes *tres = &ib_res.thread_res[i];
+
+	    if (tres->srq != NULL) {
+		ibv_destroy_srq (tres->srq);
+	    }
+	    if (tres->cq != NULL) {
+		ibv_destroy_cq (tres->cq);
+	    }
+	    if (tres->channel != NULL) {
+		ibv_destroy_comp_channel (tres->channel);
+	    }
+	    if (tres->peers != NULL) {
+		free (tres->peers);
+	    }
+	    if (tres->lat_hist != NULL) {
+		free (tres->lat_hist);
+	    }
+	    if (tres->rpc_stats != NULL) {
+		free (tres->rpc_stats);
+	    }
+	    pool_destroy (&tres->pool);
+	    mrcache_destroy (&tres->mr_cache);
+	    slab_destroy (&tres->send_slab);
+	}
+	free (ib_res.thread_res);
+    }
+
+    for (i = 0; i < ib_res.num_rails; i++) {
+	struct IBRail *rail = &ib_res.rails[i];
+
+	if (rail->owner != true) {
+	    continue;
+	}
+	if (rail->mr != NULL) {
+	    ibv_dereg_mr (rail->mr);
+	}
+	if (rail->pd != NULL) {
+	    ibv_dealloc_pd (rail->pd);
+	}
+	if ((config_info.connect_mode != CONNECT_CM) && (rail->ctx != NULL)) {
+	    ibv_close_device (rail->ctx);
+	}
+    }
+    if (config_info.connect_mode == CONNECT_CM) {
+	cm_close ();
+    }
+    if (ib_res.rails != NULL) {
+	free (ib_res.rails);
+    }
+
+    if (ib_res.ib_buf != NULL) {
+	if (ib_res.ib_buf_map_size > 0) {
+	    munmap (ib_res.ib_buf, ib_res.ib_buf_map_size);
+	} else {
+	    free (ib_res.ib_buf);
+	}
+    }
+}
+
+/* the post batch of a worker thread: the qps of its peers, its srq and cq */
+static int ib_init_batch (struct PostBatch *b, long thread_id)
+{
+    int               ret  = 0;
+    struct ThreadRes *tres = &ib_res.thread_res[thread_id];
+
+    /* ud: every message goes out on this thread's qp, addressed per peer */
+    if (ib_res.ud_qp != NULL) {
+	ret = init_post_batch (b, config_info.batch_size, tres->rail->mr->lkey,
+			       ib_res.inline_threshold, ib_res.ud_qp,
+			       ib_res.ud_sq_state, ib_res.num_threads, tres->srq);
+	check (ret == 0, "Failed to allocate post batch");
+	batch_set_ud (b, ib_res.ah, ib_res.remote_qpn, thread_id);
+    } else {
+	ret = init_post_batch (b, config_info.batch_size, tres->rail->mr->lkey,
+			       ib_res.inline_threshold, ib_res.qp,
+			       ib_res.sq_state, ib_res.num_qps, tres->srq);
+	check (ret == 0, "Failed to allocate post batch");
+	b->credit_flow = (config_info.flow_control == FLOW_CREDIT);
+    }
+    b->cq = tres->cq;
+    if (tres->send_slab.num_slots > 0) {
+	b->send_slab = &tres->send_slab;
+    }
+
+    return 0;
+ error:
+    return -1;
+}
+
+static int ib_poll (struct PostBatch *b, struct CQWaiter *w, int num_wc,
+		    struct ibv_wc *wc)
+{
+    int n = wait_poll_cq (w, b->cq, num_wc, wc);
+
+    TRACE_POLL (wc, n);
+    return n;
+}
+
+static int ib_ctl_send (struct PostBatch *b, int peer, uint64_t wr_id,
+			uint32_t imm_data)
+{
+    return post_ctl_send (peer, wr_id, imm_data);
+}
+
+static struct ibv_mr *ib_reg_mr (struct ibv_pd *pd, void *addr, size_t len,
+				 int access)
+{
+    return ibv_reg_mr (pd, addr, len, access);
+}
+
+static void ib_dereg_mr (struct ibv_mr *mr)
+{
+    ibv_dereg_mr (mr);
+}
+
+struct TransportOps ib_transport = {
+    .name       = "ib",
+    .setup      = setup_ib,
+    .close      = close_ib_connection,
+    .init_batch = ib_init_batch,
+    .send       = batch_send,
+    .recv       = batch_recv,
+    .flush      = flush_post_batch,
+    .poll       = ib_poll,
+    .ctl_send   = ib_ctl_send,
+    .reg_mr     = ib_reg_mr,
+    .dereg_mr   = ib_dereg_mr,
+};
@@ -3,23 +3,142 @@
 
 #include <infiniband/verbs.h>
 
-struct IBRes {
+#include "ib.h"
+#include "stats.h"
+#include "ring.h"
+#include "pool.h"
+#include "mrcache.h"
+
+/* an opened port; rails of one device share its context, pd and */
+/* the registration of ib_buf, which the first of them owns      */
+struct IBRail {
     struct ibv_context		*ctx;
     struct ibv_pd		*pd;
     struct ibv_mr		*mr;
-    struct ibv_cq		*cq;
-    struct ibv_qp		**qp;
-    struct ibv_srq              *srq;
+    bool                         owner;
+    char                         name[IBV_SYSFS_NAME_MAX];
+    int                          numa_node; /* of the device, -1 if unknown */
+    uint8_t                      port_num;
     struct ibv_port_attr	 port_attr;
+    int                          gid_index; /* -1: address peers by lid */
+    union ibv_gid                gid;
     struct ibv_device_attr	 dev_attr;
 
-    int     num_qps;
+    /* port rnr counters at the start of the run, -1 if not exported */
+    long                         out_of_buffer_base;
+    long                         rnr_retry_err_base;
+};
+
+/* per-thread resources; each worker thread owns its cq, srq, */
+/* a slice of ib_buf and the qps of the peers assigned to it  */
+struct ThreadRes {
+    struct IBRail               *rail;      /* every verbs object below is on it */
+    int                          cpu;       /* the worker is pinned here */
+    int                          numa_node; /* of cpu; buf and cq live there */
+    struct ibv_cq		*cq;
+    struct ibv_srq              *srq;
+    struct ibv_comp_channel     *channel;   /* poll_mode event/hybrid only */
+
+    int     num_peers;
+    int    *peers;              /* global qp indices owned by this thread */
+    char   *buf;
+    size_t  buf_size;
+
+    /* srq buffers stay posted from one run to the next; starts */
+    /* that arrived while the last run was winding down         */
+    bool    recvs_posted;
+    int     num_early_starts;
+
+    /* statistics, written by the owning thread only */
+    long    ops_count;
+    double  throughput;
+    double  cpu_util;           /* cores busy over the measured interval */
+    double  cpu_per_op;         /* ns of cpu per measured op */
+    long    num_sleeps;
+    struct LatHist *lat_hist;   /* latency mode: one per peer, then the total */
+    struct RPCStats *rpc_stats; /* rpc: RPC_MAX_OPS, by opcode */
+
+    /* rendezvous payloads: the client's sources, the server's sinks */
+    struct BufPool  pool;
+    struct MRCache  mr_cache;   /* client, mr_cache: application sources */
+
+    /* two-sided echo: send payloads, next to the srq slice in ib_buf */
+    struct SlabPool send_slab;
+}__attribute__((aligned(64)));
+
+/* a region of the peer's registered buffer we may access one-sided */
+struct RemoteBuf {
+    uint64_t  addr;
+    uint32_t  rkey;
+};
+
+struct IBRes {
+    struct IBRail               *rails;     /* threads are striped across them */
+    int                          num_rails;
+    struct ibv_qp		**qp;
+    struct QPSendState          *sq_state;  /* one per qp */
+    struct PeerRing             *rings;     /* write transport: one per qp */
+    struct RemoteBuf            *remote_buf;/* one per qp */
+
+    /* ud transport: one qp per thread, peers addressed by ah and qpn */
+    struct ibv_qp		**ud_qp;       /* one per thread */
+    struct QPSendState          *ud_sq_state; /* one per thread */
+    struct ibv_ah		**ah;          /* one per peer */
+    uint32_t                    *remote_qpn;  /* one per peer */
+    uint64_t                    *ud_peer_key; /* (slid, src_qp) -> peer */
+    int                         *ud_peer_val;
+    uint32_t                     ud_peer_mask;
+
+    int      num_qps;
+    uint32_t recv_size;         /* srq buffer size: msg_size, plus the grh for ud, */
+                                /* in whole cache lines; also the send slot size   */
+    uint32_t max_inline_data;   /* inline capacity the qps were created with */
+    uint32_t inline_threshold;  /* sends up to this size go inline */
     char   *ib_buf;
     size_t  ib_buf_size;
+    size_t  ib_buf_page_size;   /* page size actually backing ib_buf */
+    size_t  ib_buf_map_size;    /* mmap length if hugepage backed, else 0 */
+    size_t  ring_slot_size;
+
+    char   *target_buf;         /* server: targets of read/atomic workloads */
+    size_t  target_size;
+    size_t  target_stride;
+
+    uint8_t max_rd_atomic;
+    uint8_t max_dest_rd_atomic;
+
+    int                 num_threads;
+    struct ThreadRes   *thread_res;
 };
 
 extern struct IBRes ib_res;
 
+/* peers are assigned to threads round-robin */
+static inline int peer_local_index (int peer)
+{
+    return peer / ib_res.num_threads;
+}
+
+/* the rail of the thread a peer belongs to */
+static inline struct IBRail *peer_rail (int peer)
+{
+    return ib_res.thread_res[peer % ib_res.num_threads].rail;
+}
+
+int  ud_lookup_peer (struct ibv_wc *wc, const char *grh);
+int  post_ctl_send  (int peer, uint64_t wr_id, uint32_t imm_data);
+
+int  init_thread_cq_waiter (struct CQWaiter *w, long thread_id);
+void log_thread_cpu        (long thread_id, uint64_t cpu_ns, double duration,
+			    long num_ops, struct CQWaiter *w);
+void log_aggregate_cpu     ();
+void log_aggregate_rpc     ();
+void log_aggregate_rails   ();
+void log_rnr_events        ();
+void log_thread_placement  (long thread_id, void *wc);
+
+void reset_ib_run ();
+
 int  setup_ib ();
 void close_ib_connection ();
 
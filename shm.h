@@ -0,0 +1,72 @@
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+/* ring slots kept free for control messages, as IB_SQ_CTL_RESERVE */
+#define SHM_CTL_RESERVE		4
+/* how long a client waits for the server's segments to appear */
+#define SHM_ATTACH_TIMEOUT_MS	10000
+#define SHM_MAGIC		0x53484d31	/* "SHM1" */
+
+/*
+ * shm backend: every (server, client) pair shares one segment,
+ * created by the server, holding a ring in each direction. A ring
+ * has one producer, the thread owning the peer on the sending side,
+ * and one consumer, the thread owning it on the receiving side. A
+ * send copies the message into the next slot, a flush publishes the
+ * tail once per batch; the receiver copies each message into the
+ * next buffer its thread posted, in posting order, as a SEND into
+ * an srq would.
+ */
+struct ShmSlotHdr {
+    uint32_t  len;
+    uint32_t  imm_data;         /* host order */
+};
+
+struct ShmRing {
+    uint64_t  head __attribute__((aligned(64)));  /* slots consumed, by the consumer */
+    uint64_t  tail __attribute__((aligned(64)));  /* slots filled, by the producer */
+    char      slots[] __attribute__((aligned(64)));
+};
+
+struct ShmSegment {
+    uint32_t  magic;            /* written last by the server */
+    uint32_t  attached;         /* written by the client */
+    uint32_t  num_slots;        /* power of two */
+    uint32_t  slot_size;
+    uint64_t  ring_size;        /* bytes of each ring, slots included */
+    char      rings[] __attribute__((aligned(64)));  /* [0]: to server, [1]: to client */
+};
+
+/* one side of a pair, owned by the thread the peer belongs to */
+struct ShmPeer {
+    struct ShmRing  *tx;
+    struct ShmRing  *rx;
+    uint64_t         tx_tail;   /* filled, published by flush */
+    uint64_t         tx_head;   /* last seen head of tx */
+    uint64_t         rx_head;   /* consumed, published after each poll */
+    uint64_t         rx_tail;   /* last seen tail of rx */
+    bool             tx_dirty;
+}__attribute__((aligned(64)));
+
+/* per worker thread: posted receive buffers and completions of */
+/* control sends, both handed out by poll                       */
+struct ShmThread {
+    char     **recv_buf;        /* fifo of posted buffers */
+    uint32_t   recv_mask;
+    uint64_t   recv_head;
+    uint64_t   recv_tail;
+
+    uint64_t  *ctl_wr_id;       /* fifo of control send completions */
+    uint32_t   ctl_mask;
+    uint64_t   ctl_head;
+    uint64_t   ctl_tail;
+
+    int       *dirty;           /* peers with unpublished sends */
+    int        num_dirty;
+    int        next_peer;       /* round-robin start of the next poll */
+}__attribute__((aligned(64)));
+
+#endif /* SHM_H_ */
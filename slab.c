@@ -0,0 +1,38 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "slab.h"
+
+int slab_init (struct SlabPool *s, char *base, uint32_t slot_size,
+	       uint32_t num_slots)
+{
+    uint32_t i = 0;
+
+    memset (s, 0, sizeof(struct SlabPool));
+    s->base      = base;
+    s->slot_size = slot_size;
+    s->num_slots = num_slots;
+
+    s->free = (char **) malloc (num_slots * sizeof(char *));
+    check (s->free != NULL, "Failed to allocate free list of %"PRIu32" slots",
+	   num_slots);
+
+    /* slot 0 on top */
+    for (i = 0; i < num_slots; i++) {
+	s->free[i] = base + (size_t)(num_slots - 1 - i) * slot_size;
+    }
+    s->num_free = num_slots;
+
+    return 0;
+ error:
+    return -1;
+}
+
+void slab_destroy (struct SlabPool *s)
+{
+    if (s->free != NULL) {
+	free (s->free);
+    }
+    memset (s, 0, sizeof(struct SlabPool));
+}
@@ -0,0 +1,52 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/*
+ * fixed-size slots carved out of registered memory, owned by one
+ * thread. The free list is a stack of slot addresses, so get and put
+ * are a single load or store; the slot freed last is handed out
+ * first while it is still in cache. Send payloads are copied into a
+ * slot and the slot is put back by the completion that retires its
+ * wr (see retire_send), never earlier.
+ */
+struct SlabPool {
+    char      *base;
+    uint32_t   slot_size;       /* multiple of the cache line */
+    uint32_t   num_slots;
+    uint32_t   num_free;
+    char     **free;
+
+    /* statistics */
+    long       num_empty;       /* gets that found every slot in use */
+};
+
+int  slab_init    (struct SlabPool *s, char *base, uint32_t slot_size,
+		   uint32_t num_slots);
+void slab_destroy (struct SlabPool *s);
+
+/* NULL if every slot is in use */
+static inline char *slab_get (struct SlabPool *s)
+{
+    if (s->num_free == 0) {
+	s->num_empty += 1;
+	return NULL;
+    }
+    return s->free[--s->num_free];
+}
+
+static inline void slab_put (struct SlabPool *s, char *slot)
+{
+    s->free[s->num_free++] = slot;
+}
+
+/* sends that skip the slab record their own buffer, which must */
+/* not end up on the free list                                  */
+static inline int slab_owns (struct SlabPool *s, char *p)
+{
+    return (p >= s->base) && (p < s->base + (size_t)s->num_slots * s->slot_size);
+}
+
+#endif /* SLAB_H_ */
@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 
 #include "debug.h"
 #include "sock.h"
@@ -141,14 +142,44 @@ int sock_create_connect (char *server_name, char *port)
     return -1;
 }
 
+int sock_set_nonblock (int sock_fd)
+{
+    int flags = fcntl(sock_fd, F_GETFL);
+
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+void qp_info_hton (struct QPInfo *net, struct QPInfo *host)
+{
+    net->lid       = htons(host->lid);
+    net->qp_num    = htonl(host->qp_num);
+    net->rank      = htonl(host->rank);
+    net->buf_addr  = htonll(host->buf_addr);
+    net->rkey      = htonl(host->rkey);
+    net->mtu       = host->mtu;
+    memcpy(net->gid, host->gid, sizeof(net->gid));
+}
+
+void qp_info_ntoh (struct QPInfo *host, struct QPInfo *net)
+{
+    host->lid       = ntohs(net->lid);
+    host->qp_num    = ntohl(net->qp_num);
+    host->rank      = ntohl(net->rank);
+    host->buf_addr  = ntohll(net->buf_addr);
+    host->rkey      = ntohl(net->rkey);
+    host->mtu       = net->mtu;
+    memcpy(host->gid, net->gid, sizeof(host->gid));
+}
+
 int sock_set_qp_info(int sock_fd, struct QPInfo *qp_info)
 {
     int n;
     struct QPInfo tmp_qp_info;
 
-    tmp_qp_info.lid       = htons(qp_info->lid);
-    tmp_qp_info.qp_num    = htonl(qp_info->qp_num);
-    tmp_qp_info.rank      = htonl(qp_info->rank);
+    qp_info_hton (&tmp_qp_info, qp_info);
 
     n = sock_write(sock_fd, (char *)&tmp_qp_info, sizeof(struct QPInfo));
     check(n==sizeof(struct QPInfo), "write qp_info to socket.");
@@ -167,10 +198,8 @@ int sock_get_qp_info(int sock_fd, struct QPInfo *qp_info)
     n = sock_read(sock_fd, (char *)&tmp_qp_info, sizeof(struct QPInfo));
     check(n==sizeof(struct QPInfo), "read qp_info from socket.");
 
-    qp_info->lid       = ntohs(tmp_qp_info.lid);
-    qp_info->qp_num    = ntohl(tmp_qp_info.qp_num);
-    qp_info->rank      = ntohl(tmp_qp_info.rank);
-    
+    qp_info_ntoh (qp_info, &tmp_qp_info);
+
     return 0;
 
  error:
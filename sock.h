@@ -13,6 +13,12 @@ ssize_t sock_write (int sock_fd, void *buffer, size_t len);
 int sock_create_bind (char *port);
 int sock_create_connect (char *server_name, char *port);
 
+int sock_set_nonblock (int sock_fd);
+
+/* QPInfo travels in network byte order */
+void qp_info_hton (struct QPInfo *net, struct QPInfo *host);
+void qp_info_ntoh (struct QPInfo *host, struct QPInfo *net);
+
 int sock_set_qp_info(int sock_fd, struct QPInfo *qp_info);
 int sock_get_qp_info(int sock_fd, struct QPInfo *qp_info);
 
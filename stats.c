@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "debug.h"
+#include "stats.h"
+
+void hist_init (struct LatHist *h)
+{
+    memset (h, 0, sizeof(struct LatHist));
+    h->min = UINT64_MAX;
+}
+
+void hist_merge (struct LatHist *dst, struct LatHist *src)
+{
+    int i = 0;
+
+    for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+	dst->bucket[i] += src->bucket[i];
+    }
+    dst->count += src->count;
+    dst->sum   += src->sum;
+    if (src->min < dst->min) {
+	dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+	dst->max = src->max;
+    }
+}
+
+/* midpoint of the bucket, clamped to the observed range */
+static uint64_t hist_bucket_value (int idx)
+{
+    uint64_t lo = 0, width = 1;
+
+    if (idx < HIST_SUB_COUNT) {
+	return (uint64_t)idx;
+    }
+
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    lo    = ((uint64_t)(idx & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT) << shift;
+    width = 1ULL << shift;
+    return lo + width / 2;
+}
+
+/*
+ *  hist_percentile:
+ *       p is in [0, 100]
+ *
+ *  return value:
+ *       the smallest recorded value v such that p% of the samples are <= v
+ */
+uint64_t hist_percentile (struct LatHist *h, double p)
+{
+    uint64_t target = 0, seen = 0, v = 0;
+    int      i      = 0;
+
+    if (h->count == 0) {
+	return 0;
+    }
+
+    target = (uint64_t)((p / 100.0) * h->count + 0.5);
+    if (target < 1) {
+	target = 1;
+    }
+
+    for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+	seen += h->bucket[i];
+	if (seen >= target) {
+	    break;
+	}
+    }
+
+    v = hist_bucket_value (i);
+    if (v < h->min) {
+	v = h->min;
+    }
+    if (v > h->max) {
+	v = h->max;
+    }
+    return v;
+}
+
+void hist_log (char *name, struct LatHist *h)
+{
+    if (h->count == 0) {
+	log ("%s: no samples", name);
+	return;
+    }
+
+    log ("%s: count = %"PRIu64", mean = %.2f, p50 = %.2f, p99 = %.2f, "
+	 "p99.9 = %.2f, p99.99 = %.2f, max = %.2f (us)",
+	 name, h->count,
+	 (double)h->sum / h->count / 1000.0,
+	 hist_percentile (h, 50.0)   / 1000.0,
+	 hist_percentile (h, 99.0)   / 1000.0,
+	 hist_percentile (h, 99.9)   / 1000.0,
+	 hist_percentile (h, 99.99)  / 1000.0,
+	 (double)h->max / 1000.0);
+}
@@ -0,0 +1,74 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <inttypes.h>
+#include <time.h>
+
+/* log-linear latency histogram: every power of two is split into */
+/* 2^HIST_SUB_BITS linear buckets, so the relative error is ~3%   */
+#define HIST_SUB_BITS		5
+#define HIST_SUB_COUNT		(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS		40	/* ~18 minutes in ns */
+#define HIST_NUM_BUCKETS	((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct LatHist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t bucket[HIST_NUM_BUCKETS];
+};
+
+static inline uint64_t get_time_ns ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* cpu time consumed by the calling thread */
+static inline uint64_t get_thread_cpu_ns ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline int hist_bucket_index (uint64_t v)
+{
+    int msb   = 0;
+    int shift = 0;
+
+    if (v < HIST_SUB_COUNT) {
+	return (int)v;
+    }
+    if (v >= (1ULL << HIST_MAX_BITS)) {
+	return HIST_NUM_BUCKETS - 1;
+    }
+
+    msb   = 63 - __builtin_clzll (v);
+    shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) - HIST_SUB_COUNT);
+}
+
+static inline void hist_record (struct LatHist *h, uint64_t v)
+{
+    h->bucket[hist_bucket_index (v)] += 1;
+    h->count += 1;
+    h->sum   += v;
+    if (v < h->min) {
+	h->min = v;
+    }
+    if (v > h->max) {
+	h->max = v;
+    }
+}
+
+void     hist_init       (struct LatHist *h);
+void     hist_merge      (struct LatHist *dst, struct LatHist *src);
+uint64_t hist_percentile (struct LatHist *h, double p);
+void     hist_log        (char *name, struct LatHist *h);
+
+#endif /* STATS_H_ */
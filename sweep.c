@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "debug.h"
+#include "config.h"
+#include "setup_ib.h"
+#include "stats.h"
+#include "client.h"
+#include "server.h"
+#include "sweep.h"
+
+/* an open-loop point achieving less of its offered load is saturated */
+#define SWEEP_SATURATED		0.95
+
+static void write_header (FILE *fp)
+{
+    if (config_info.sweep_format == SWEEP_JSON) {
+	fprintf (fp, "[\n");
+    } else {
+	fprintf (fp, "msg_size,window,offered_mops,mops,gbps,cpu_cores,"
+		 "p50_us,p99_us,p999_us,max_us\n");
+    }
+}
+
+static void write_footer (FILE *fp)
+{
+    if (config_info.sweep_format == SWEEP_JSON) {
+	fprintf (fp, "\n]\n");
+    }
+}
+
+/* latency columns are left empty (csv) or null (json) without samples, */
+/* so is offered_mops of a closed-loop run                               */
+static void write_row (FILE *fp, bool first, int msg_size, int window,
+		       double offered, double mops, double cpu_util,
+		       struct LatHist *h)
+{
+    double gbps   = mops * msg_size * 8 / 1000.0;
+    double lat[4] = {0.0};
+
+    if (h->count > 0) {
+	lat[0] = hist_percentile (h, 50.0) / 1000.0;
+	lat[1] = hist_percentile (h, 99.0) / 1000.0;
+	lat[2] = hist_percentile (h, 99.9) / 1000.0;
+	lat[3] = (double)h->max / 1000.0;
+    }
+
+    if (config_info.sweep_format == SWEEP_JSON) {
+	fprintf (fp, "%s  {\"msg_size\": %d, \"window\": %d", first ? "" : ",\n",
+		 msg_size, window);
+	if (offered > 0.0) {
+	    fprintf (fp, ", \"offered_mops\": %.4f", offered);
+	} else {
+	    fprintf (fp, ", \"offered_mops\": null");
+	}
+	fprintf (fp, ", \"mops\": %.4f, \"gbps\": %.4f, \"cpu_cores\": %.3f",
+		 mops, gbps, cpu_util);
+	if (h->count > 0) {
+	    fprintf (fp, ", \"p50_us\": %.3f, \"p99_us\": %.3f, "
+		     "\"p999_us\": %.3f, \"max_us\": %.3f}",
+		     lat[0], lat[1], lat[2], lat[3]);
+	} else {
+	    fprintf (fp, ", \"p50_us\": null, \"p99_us\": null, "
+		     "\"p999_us\": null, \"max_us\": null}");
+	}
+    } else {
+	fprintf (fp, "%d,%d,", msg_size, window);
+	if (offered > 0.0) {
+	    fprintf (fp, "%.4f", offered);
+	}
+	fprintf (fp, ",%.4f,%.4f,%.3f", mops, gbps, cpu_util);
+	if (h->count > 0) {
+	    fprintf (fp, ",%.3f,%.3f,%.3f,%.3f\n", lat[0], lat[1], lat[2], lat[3]);
+	} else {
+	    fprintf (fp, ",,,,\n");
+	}
+    }
+    fflush (fp);
+}
+
+/*
+ *  run_sweep:
+ *       one run per (msg_size, window, rate) point over the connected
+ *       qps, buffers were sized for the largest point by setup_ib;
+ *       both sides must walk the same lists. rows go to
+ *       server[rank].sweep.csv or client[rank].sweep.csv (.json).
+ *       an open-loop client logs every point whose achieved rate
+ *       falls short of the offered load as saturated
+ *
+ *  return value:
+ *       0 on success, -1 on error
+ */
+int run_sweep ()
+{
+    int             ret  = 0, s = 0, w = 0, r = 0, t = 0;
+    bool            first = true;
+    FILE           *fp   = NULL;
+    struct LatHist *hist = NULL;
+    char            fname[64] = {'\0'};
+
+    sprintf (fname, "%s[%d].sweep.%s",
+	     config_info.is_server ? "server" : "client", config_info.rank,
+	     (config_info.sweep_format == SWEEP_JSON) ? "json" : "csv");
+    fp = fopen (fname, "w");
+    check (fp != NULL, "Failed to open sweep output %s", fname);
+
+    hist = (struct LatHist *) malloc (sizeof(struct LatHist));
+    check (hist != NULL, "Failed to allocate sweep histogram");
+
+    write_header (fp);
+
+    for (s = 0; s < config_info.num_sweep_sizes; s++) {
+	for (w = 0; w < config_info.num_sweep_windows; w++) {
+	    for (r = 0; r < config_info.num_sweep_rates; r++) {
+		int    msg_size = config_info.sweep_sizes[s];
+		int    window   = config_info.sweep_windows[w];
+		int    rate     = config_info.sweep_rates[r];
+		double offered  = 0.0;
+		double mops     = 0.0;
+		double cpu_util = 0.0;
+
+		config_info.msg_size         = msg_size;
+		config_info.num_concurr_msgs = window;
+		config_info.latency_window   = window;
+		config_info.arrival_rate     = rate;
+		reset_ib_run ();
+
+		log (LOG_SUB_HEADER, "Sweep Point");
+		if (config_info.arrival != ARRIVAL_CLOSED) {
+		    offered = rate / 1000.0;
+		    log ("msg_size = %d, window = %d, offered = %d Kops/s",
+			 msg_size, window, rate);
+		} else {
+		    log ("msg_size = %d, window = %d", msg_size, window);
+		}
+
+		if (config_info.is_server) {
+		    ret = run_server ();
+		} else {
+		    ret = run_client ();
+		}
+		check (ret == 0, "Failed to run msg_size = %d, window = %d",
+		       msg_size, window);
+
+		hist_init (hist);
+		for (t = 0; t < ib_res.num_threads; t++) {
+		    struct ThreadRes *tres = &ib_res.thread_res[t];
+
+		    mops     += tres->throughput;
+		    cpu_util += tres->cpu_util;
+		    if ((config_info.mode == MODE_LATENCY) && (tres->lat_hist != NULL)) {
+			hist_merge (hist, &tres->lat_hist[tres->num_peers]);
+		    }
+		}
+
+		if ((config_info.is_server != true) && (offered > 0.0) &&
+		    (mops < offered * SWEEP_SATURATED)) {
+		    log ("saturated: offered = %.4f, achieved = %.4f (Mops/s)",
+			 offered, mops);
+		}
+		write_row (fp, first, msg_size, window, offered, mops, cpu_util, hist);
+		first = false;
+	    }
+	}
+    }
+
+    write_footer (fp);
+    free (hist);
+    fclose (fp);
+    return 0;
+
+ error:
+    if (hist != NULL) {
+	free (hist);
+    }
+    if (fp != NULL) {
+	fclose (fp);
+    }
+    return -1;
+}
@@ -0,0 +1,6 @@
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+int run_sweep ();
+
+#endif /* sweep.h */
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "topo.h"
+
+/*
+ *  parse_cpu_list:
+ *       a comma separated list of cpus and cpu ranges ("2-13,28-41"),
+ *       in the order given
+ *
+ *  return value:
+ *       the number of cpus in the list, -1 on error
+ */
+int parse_cpu_list (const char *list, int **cpus)
+{
+    const char *p     = list;
+    char       *next  = NULL;
+    long        first = 0, last = 0, c = 0;
+    int         num   = 0, cap = 64;
+    int        *buf   = NULL, *tmp = NULL;
+
+    buf = (int *) malloc (cap * sizeof(int));
+    check (buf != NULL, "Failed to allocate cpu list");
+
+    while ((*p != '\0') && (*p != '\n')) {
+	first = strtol (p, &next, 10);
+	check ((next != p) && (first >= 0), "Invalid cpu list entry: %s", p);
+	last = first;
+	if (*next == '-') {
+	    p    = next + 1;
+	    last = strtol (p, &next, 10);
+	    check ((next != p) && (last >= first), "Invalid cpu range: %s", p);
+	}
+	check (last < CPU_SETSIZE, "Invalid cpu: %ld", last);
+
+	for (c = first; c <= last; c++) {
+	    if (num == cap) {
+		cap *= 2;
+		tmp  = (int *) realloc (buf, cap * sizeof(int));
+		check (tmp != NULL, "Failed to allocate cpu list");
+		buf  = tmp;
+	    }
+	    buf[num++] = (int)c;
+	}
+	p = (*next == ',') ? next + 1 : next;
+    }
+    check (num > 0, "Invalid cpu list: %s", list);
+
+    *cpus = buf;
+    return num;
+ error:
+    if (buf != NULL) {
+	free (buf);
+    }
+    return -1;
+}
+
+/* numa node the device hangs off, -1 if sysfs does not say */
+int read_numa_node (struct ibv_device *dev)
+{
+    char  path[IBV_SYSFS_PATH_MAX + 32];
+    FILE *fp   = NULL;
+    int   node = -1;
+
+    snprintf (path, sizeof(path), "%s/device/numa_node", dev->ibdev_path);
+    fp = fopen (path, "r");
+    if (fp == NULL) {
+	return -1;
+    }
+    if (fscanf (fp, "%d", &node) != 1) {
+	node = -1;
+    }
+    fclose (fp);
+    return node;
+}
+
+/* the cpus of a numa node; 0 if the node is unknown */
+static int read_node_cpus (int node, cpu_set_t *set)
+{
+    char  path[64], list[1024];
+    FILE *fp   = NULL;
+    int  *cpus = NULL;
+    int   num  = 0, i = 0;
+
+    CPU_ZERO (set);
+    if (node < 0) {
+	return 0;
+    }
+    snprintf (path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    fp = fopen (path, "r");
+    if (fp == NULL) {
+	return 0;
+    }
+    if (fgets (list, sizeof(list), fp) == NULL) {
+	list[0] = '\0';
+    }
+    fclose (fp);
+
+    num = parse_cpu_list (list, &cpus);
+    if (num <= 0) {
+	return 0;
+    }
+    for (i = 0; i < num; i++) {
+	CPU_SET (cpus[i], set);
+    }
+    free (cpus);
+    return num;
+}
+
+/* the k-th cpu of a node, wrapping around; cpu 0 takes the irqs */
+/* and housekeeping of most systems and is only used if alone    */
+int node_cpu (int node, int k)
+{
+    cpu_set_t set;
+    int       num = read_node_cpus (node, &set);
+    int       c   = 0;
+
+    if (num == 0) {
+	return -1;
+    }
+    if ((num > 1) && CPU_ISSET (0, &set)) {
+	CPU_CLR (0, &set);
+	num -= 1;
+    }
+    k %= num;
+    for (c = 0; c < CPU_SETSIZE; c++) {
+	if (CPU_ISSET (c, &set) && (k-- == 0)) {
+	    return c;
+	}
+    }
+    return -1;
+}
+
+/* the node a cpu belongs to, by its sysfs nodeN link; -1 if none */
+int cpu_node (int cpu)
+{
+    char           path[64];
+    DIR           *dir  = NULL;
+    struct dirent *ent  = NULL;
+    int            node = -1;
+
+    snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir (path);
+    if (dir == NULL) {
+	return -1;
+    }
+    while ((ent = readdir (dir)) != NULL) {
+	if (sscanf (ent->d_name, "node%d", &node) == 1) {
+	    break;
+	}
+	node = -1;
+    }
+    closedir (dir);
+    return node;
+}
+
+/* run the calling thread on node, so what it touches or the provider */
+/* allocates from here on is placed there; unknown nodes are ignored  */
+void bind_to_node (int node)
+{
+    cpu_set_t set;
+
+    if (read_node_cpus (node, &set) > 0) {
+	sched_setaffinity (0, sizeof(cpu_set_t), &set);
+    }
+}
+
+/* where the page holding addr lives, -1 if unknown or not yet touched */
+int page_node (void *addr)
+{
+    void *page   = (void *)((uintptr_t)addr & ~((uintptr_t)sysconf (_SC_PAGESIZE) - 1));
+    int   status = -1;
+
+    if (syscall (SYS_move_pages, 0, 1UL, &page, NULL, &status, 0) != 0) {
+	return -1;
+    }
+    return (status >= 0) ? status : -1;
+}
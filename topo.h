@@ -0,0 +1,21 @@
+#ifndef TOPO_H_
+#define TOPO_H_
+
+#include <infiniband/verbs.h>
+
+/*
+ * cpu and numa topology from sysfs, for placing worker threads and
+ * their memory. Nothing here needs libnuma: memory is placed by
+ * first touch from a cpu of the wanted node, and page_node asks the
+ * kernel where a page actually ended up.
+ */
+
+int  parse_cpu_list (const char *list, int **cpus);
+
+int  read_numa_node (struct ibv_device *dev);
+int  node_cpu       (int node, int k);
+int  cpu_node       (int cpu);
+void bind_to_node   (int node);
+int  page_node      (void *addr);
+
+#endif /* TOPO_H_ */
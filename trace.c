@@ -0,0 +1,224 @@
+#ifdef TRACE
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "config.h"
+#include "trace.h"
+
+/* events timed at init to price one record */
+#define TRACE_CALIBRATE_EVENTS	(1 << 16)
+
+__thread struct TraceRing *trace_ring = NULL;
+
+static struct TraceRing       *rings       = NULL;
+static int                     num_rings   = 0;
+static char                    path[256];
+static struct TraceFileHeader  file_header;
+
+static void write_all (int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    ssize_t     n = 0;
+
+    while (len > 0) {
+	n = write (fd, p, len);
+	if (n <= 0) {
+	    return;
+	}
+	p   += n;
+	len -= n;
+    }
+}
+
+static void free_rings ()
+{
+    int t = 0;
+
+    for (t = 0; t < num_rings; t++) {
+	if (rings[t].ev != NULL) {
+	    free (rings[t].ev);
+	}
+    }
+    if (rings != NULL) {
+	free (rings);
+    }
+    rings     = NULL;
+    num_rings = 0;
+}
+
+/*
+ *  trace_dump:
+ *       write every ring to the trace file; only async-signal-safe
+ *       calls, as it also runs from the signal handler. A dump of a
+ *       running process may catch the newest events half written
+ *
+ *  return value:
+ *       0 on success, -1 if the file could not be opened
+ */
+static int trace_dump ()
+{
+    struct TraceFileHeader hdr = file_header;
+    struct timespec        ts;
+    int                    fd  = -1, t = 0;
+
+    fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	return -1;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    hdr.tsc_dump = trace_tsc ();
+    hdr.ns_dump  = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    write_all (fd, &hdr, sizeof(hdr));
+
+    for (t = 0; t < num_rings; t++) {
+	struct TraceRing        *r    = &rings[t];
+	uint64_t                 head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+	uint64_t                 num  = (head < TRACE_RING_EVENTS) ? head : TRACE_RING_EVENTS;
+	uint64_t                 first = (head - num) & (TRACE_RING_EVENTS - 1);
+	struct TraceThreadHeader th  = {
+	    .thread_id    = t,
+	    .num_events   = num,
+	    .num_recorded = head,
+	};
+
+	write_all (fd, &th, sizeof(th));
+	if (first + num <= TRACE_RING_EVENTS) {
+	    write_all (fd, &r->ev[first], num * sizeof(struct TraceEvent));
+	} else {
+	    write_all (fd, &r->ev[first],
+		       (TRACE_RING_EVENTS - first) * sizeof(struct TraceEvent));
+	    write_all (fd, &r->ev[0],
+		       (first + num - TRACE_RING_EVENTS) * sizeof(struct TraceEvent));
+	}
+    }
+
+    close (fd);
+    return 0;
+}
+
+/* SIGUSR1 takes a snapshot, SIGINT and SIGTERM a last one */
+static void trace_signal (int sig)
+{
+    trace_dump ();
+    if (sig != SIGUSR1) {
+	signal (sig, SIG_DFL);
+	raise (sig);
+    }
+}
+
+/* cost of one record, on a scratch ring of the calling thread */
+static double calibrate ()
+{
+    struct TraceRing  scratch = {0};
+    uint64_t          t0      = 0;
+    int               i       = 0;
+
+    scratch.ev = (struct TraceEvent *) calloc (TRACE_RING_EVENTS, sizeof(struct TraceEvent));
+    if (scratch.ev == NULL) {
+	return 0.0;
+    }
+    trace_ring = &scratch;
+    for (i = 0; i < TRACE_CALIBRATE_EVENTS; i++) {
+	trace_record (TRACE_SEND, 0, 0, 0);
+    }
+    t0 = get_time_ns ();
+    for (i = 0; i < TRACE_CALIBRATE_EVENTS; i++) {
+	trace_record (TRACE_SEND, i, i, i);
+    }
+    t0 = get_time_ns () - t0;
+    trace_ring = NULL;
+    free (scratch.ev);
+
+    return (double)t0 / TRACE_CALIBRATE_EVENTS;
+}
+
+int trace_init (int num_threads)
+{
+    struct sigaction sa;
+    int              t = 0;
+
+    if (config_info.trace_file == NULL) {
+	return 0;
+    }
+
+    snprintf (path, sizeof(path), "%s.%s%d", config_info.trace_file,
+	      config_info.is_server ? "server" : "client", config_info.rank);
+
+    /* ring pages are left untouched, the worker's first writes */
+    /* place them on its node                                    */
+    rings = (struct TraceRing *) calloc (num_threads, sizeof(struct TraceRing));
+    check (rings != NULL, "Failed to allocate trace rings");
+    num_rings = num_threads;
+    for (t = 0; t < num_threads; t++) {
+	rings[t].thread_id = t;
+	rings[t].ev = (struct TraceEvent *) malloc (TRACE_RING_EVENTS *
+						    sizeof(struct TraceEvent));
+	check (rings[t].ev != NULL, "Failed to allocate trace ring of thread[%d]", t);
+    }
+
+    memset (&file_header, 0, sizeof(file_header));
+    file_header.magic        = TRACE_MAGIC;
+    file_header.version      = TRACE_VERSION;
+    file_header.num_threads  = num_threads;
+    file_header.rank         = config_info.rank;
+    file_header.is_server    = config_info.is_server;
+    file_header.ns_per_event = calibrate ();
+    file_header.tsc_start    = trace_tsc ();
+    file_header.ns_start     = get_time_ns ();
+
+    memset (&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sigemptyset (&sa.sa_mask);
+    sigaction (SIGUSR1, &sa, NULL);
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+
+    log ("trace: %d rings of %d events to %s, %.1f ns per event",
+	 num_threads, TRACE_RING_EVENTS, path, file_header.ns_per_event);
+    return 0;
+
+ error:
+    free_rings ();
+    return -1;
+}
+
+/* from a worker, once it is pinned */
+void trace_thread_start (long thread_id)
+{
+    if ((rings != NULL) && (thread_id < num_rings)) {
+	trace_ring = &rings[thread_id];
+    }
+}
+
+/* the final dump, and what tracing cost each thread */
+void trace_finish ()
+{
+    int t = 0;
+
+    if (rings == NULL) {
+	return;
+    }
+
+    signal (SIGUSR1, SIG_DFL);
+    signal (SIGINT, SIG_DFL);
+    signal (SIGTERM, SIG_DFL);
+
+    if (trace_dump () != 0) {
+	log ("trace: failed to write %s", path);
+    }
+    for (t = 0; t < num_rings; t++) {
+	log ("thread[%d]: trace: %"PRIu64" events, %"PRIu64" kept, ~%.2f ms recording",
+	     t, rings[t].head,
+	     (rings[t].head < TRACE_RING_EVENTS) ? rings[t].head : TRACE_RING_EVENTS,
+	     rings[t].head * file_header.ns_per_event / 1e6);
+    }
+    free_rings ();
+}
+
+#endif /* TRACE */
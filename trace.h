@@ -0,0 +1,151 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <inttypes.h>
+
+#include "stats.h"
+
+/*
+ * per-thread flight recorder of the verbs hot path, built in by
+ * make trace (-DTRACE) and switched on by trace_file in the config.
+ * Every worker appends fixed-size events to its own preallocated
+ * ring and overwrites the oldest once it is full: no locks, no
+ * allocation, one tsc read and one 32-byte store per event. The
+ * rings are written to <trace_file>.<role><rank> at exit and on
+ * SIGUSR1 (SIGINT and SIGTERM dump, then terminate); trace-analyze
+ * turns that file into timelines. Without -DTRACE the hooks below
+ * compile to nothing.
+ */
+
+/* events per thread, a power of two; 32 MiB of ring each */
+#define TRACE_RING_EVENTS	(1 << 20)
+
+#define TRACE_MAGIC		0x3145434152544452ULL	/* "RDTRACE1" */
+#define TRACE_VERSION		1
+
+enum TraceType {
+    TRACE_SEND = 1,          /* send queued: peer, wr_id = payload, count = bytes */
+    TRACE_POST_SEND,         /* doorbell: peer, wr_id of the first wr, count = wrs */
+    TRACE_REPOST,            /* recv queued: wr_id = buffer */
+    TRACE_POST_RECV,         /* srq doorbell: count = wrs */
+    TRACE_POLL,              /* cq polled: count = wcs, 0 if it was empty */
+    TRACE_CQE,               /* completion: wr_id, count = opcode | status << 8; */
+                             /* peer = imm_data of a recv, the qp of a send    */
+};
+
+struct TraceEvent {
+    uint64_t  tsc;
+    uint64_t  wr_id;
+    uint32_t  peer;
+    uint32_t  count;
+    uint16_t  type;
+    uint16_t  thread_id;
+    uint32_t  reserved;
+};
+
+/* file layout: this header, then per thread a TraceThreadHeader */
+/* followed by its events, oldest first                          */
+struct TraceFileHeader {
+    uint64_t  magic;
+    uint32_t  version;
+    uint32_t  num_threads;
+    int32_t   rank;
+    uint32_t  is_server;
+    uint64_t  tsc_start;     /* a tsc and CLOCK_MONOTONIC pair at init */
+    uint64_t  ns_start;      /* and another at the dump, so ticks can  */
+    uint64_t  tsc_dump;      /* be converted to ns offline             */
+    uint64_t  ns_dump;
+    double    ns_per_event;  /* cost of one record, measured at init */
+};
+
+struct TraceThreadHeader {
+    uint32_t  thread_id;
+    uint32_t  num_events;    /* in the file */
+    uint64_t  num_recorded;  /* since init, overwritten ones included */
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline uint64_t trace_tsc ()
+{
+    return __rdtsc ();
+}
+#else
+static inline uint64_t trace_tsc ()
+{
+    return get_time_ns ();
+}
+#endif
+
+#ifdef TRACE
+
+#include <arpa/inet.h>
+#include <infiniband/verbs.h>
+
+struct TraceRing {
+    struct TraceEvent  *ev;
+    uint64_t            head;        /* events recorded */
+    uint16_t            thread_id;
+}__attribute__((aligned(64)));
+
+/* the calling worker's ring, NULL while tracing is off */
+extern __thread struct TraceRing *trace_ring;
+
+static inline void trace_record (uint16_t type, uint32_t peer, uint64_t wr_id,
+				 uint32_t count)
+{
+    struct TraceRing  *r = trace_ring;
+    struct TraceEvent *e = NULL;
+
+    if (r == NULL) {
+	return;
+    }
+    e = &r->ev[r->head & (TRACE_RING_EVENTS - 1)];
+    e->tsc       = trace_tsc ();
+    e->wr_id     = wr_id;
+    e->peer      = peer;
+    e->count     = count;
+    e->type      = type;
+    e->thread_id = r->thread_id;
+
+    /* a dump from a signal handler reads head */
+    __atomic_store_n (&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* a poll and each completion it returned */
+static inline void trace_poll (struct ibv_wc *wc, int n)
+{
+    int i = 0;
+
+    if ((trace_ring == NULL) || (n < 0)) {
+	return;
+    }
+    trace_record (TRACE_POLL, 0, 0, n);
+    for (i = 0; i < n; i++) {
+	uint32_t peer = (wc[i].opcode & IBV_WC_RECV) ?
+	    ntohl (wc[i].imm_data) : (uint32_t)(wc[i].wr_id >> 32) & 0x0FFFFFFF;
+
+	trace_record (TRACE_CQE, peer, wc[i].wr_id, wc[i].opcode | wc[i].status << 8);
+    }
+}
+
+int  trace_init         (int num_threads);
+void trace_thread_start (long thread_id);
+void trace_finish       ();
+
+#define TRACE_EVENT(type, peer, wr_id, count) \
+    trace_record ((type), (peer), (uint64_t)(wr_id), (count))
+#define TRACE_POLL(wc, n)		trace_poll ((wc), (n))
+
+#else
+
+static inline int  trace_init (int num_threads) { return 0; }
+static inline void trace_thread_start (long thread_id) { }
+static inline void trace_finish () { }
+
+#define TRACE_EVENT(type, peer, wr_id, count)	do { } while (0)
+#define TRACE_POLL(wc, n)			do { } while (0)
+
+#endif /* TRACE */
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "trace.h"
+
+/*
+ * trace-analyze: reads a dump written by a make trace build (see
+ * trace.h) and prints, per thread, how the cq was polled, how evenly
+ * completions arrived, and the timeline of every request it can pair
+ * up: client SEND -> doorbell -> reply CQE, server request CQE ->
+ * echo SEND -> doorbell. Requests are paired per peer in order, which
+ * is what rc delivers; a ring that wrapped starts mid-flight, so the
+ * first few pairs of each peer may be off.
+ */
+
+#define MAX_PEERS		65536
+#define BUCKET_NS		1000000ULL	/* completions are counted per ms */
+#define NUM_DIPS		5
+#define NUM_SLOWEST		5
+
+#define WC_RECV			128		/* IBV_WC_RECV */
+#define IMM_CTL_BASE		0xFFFF0000U	/* control messages, see ib.h */
+#define IMM_RANK_MASK		0xFFFF
+
+struct Request {
+    uint64_t  t_first;       /* client: send queued; server: request cqe */
+    uint64_t  t_send;        /* server: echo queued */
+    uint64_t  t_doorbell;
+    uint32_t  peer;
+    int       next;          /* of the peer's queue, -1 at its end */
+};
+
+struct Span {
+    uint64_t  total;
+    uint64_t  first;         /* t_first to t_send or t_doorbell */
+    uint64_t  second;        /* to t_doorbell or the reply cqe */
+    uint64_t  start;         /* since the thread's first event */
+    uint32_t  peer;
+};
+
+static double ns_per_tick = 1.0;
+
+static int cmp_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int cmp_span (const void *a, const void *b)
+{
+    uint64_t x = ((const struct Span *)a)->total, y = ((const struct Span *)b)->total;
+
+    return (y > x) - (y < x);
+}
+
+static uint64_t to_ns (uint64_t ticks)
+{
+    return (uint64_t)(ticks * ns_per_tick);
+}
+
+/* v is sorted */
+static uint64_t percentile (uint64_t *v, long n, double p)
+{
+    return (n > 0) ? v[(long)(p * (n - 1))] : 0;
+}
+
+static void print_dist (const char *name, uint64_t *v, long n)
+{
+    if (n == 0) {
+	return;
+    }
+    qsort (v, n, sizeof(uint64_t), cmp_u64);
+    printf ("  %-22s p50 %8"PRIu64"  p99 %8"PRIu64"  p99.9 %8"PRIu64"  max %8"PRIu64" ns\n",
+	    name, percentile (v, n, 0.50), percentile (v, n, 0.99),
+	    percentile (v, n, 0.999), v[n - 1]);
+}
+
+static void analyze_polls (struct TraceEvent *ev, uint32_t num)
+{
+    long     polls = 0, empty = 0, streaks = 0, streak_polls = 0, len = 0, max_len = 0;
+    uint64_t streak_start = 0, max_dur = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i < num; i++) {
+	if (ev[i].type != TRACE_POLL) {
+	    continue;
+	}
+	polls += 1;
+	if (ev[i].count == 0) {
+	    empty += 1;
+	    if (len == 0) {
+		streak_start = ev[i].tsc;
+	    }
+	    len += 1;
+	    continue;
+	}
+	if (len > 0) {
+	    streaks      += 1;
+	    streak_polls += len;
+	    if (len > max_len) {
+		max_len = len;
+	    }
+	    if (to_ns (ev[i].tsc - streak_start) > max_dur) {
+		max_dur = to_ns (ev[i].tsc - streak_start);
+	    }
+	    len = 0;
+	}
+    }
+
+    if (polls == 0) {
+	return;
+    }
+    printf ("  polls                  %ld, %.1f%% empty\n", polls, 100.0 * empty / polls);
+    if (streaks > 0) {
+	printf ("  empty streaks          %ld, mean %.1f polls, longest %ld polls / %"PRIu64" ns\n",
+		streaks, (double)streak_polls / streaks, max_len, max_dur);
+    }
+}
+
+static int analyze_cqes (struct TraceEvent *ev, uint32_t num)
+{
+    uint64_t *gaps    = NULL, *buckets = NULL;
+    uint64_t  t0      = ev[0].tsc, last = 0, sum = 0, min = UINT64_MAX, max = 0;
+    long      num_gaps = 0, num_buckets = 0, b = 0, d = 0;
+    uint32_t  i       = 0;
+
+    num_buckets = to_ns (ev[num - 1].tsc - t0) / BUCKET_NS;
+    gaps    = (uint64_t *) malloc (num * sizeof(uint64_t));
+    buckets = (uint64_t *) calloc (num_buckets + 1, sizeof(uint64_t));
+    if ((gaps == NULL) || (buckets == NULL)) {
+	fprintf (stderr, "Failed to allocate cqe stats\n");
+	free (gaps);
+	free (buckets);
+	return -1;
+    }
+
+    for (i = 0; i < num; i++) {
+	if (ev[i].type != TRACE_CQE) {
+	    continue;
+	}
+	if (last != 0) {
+	    gaps[num_gaps++] = to_ns (ev[i].tsc - last);
+	}
+	last = ev[i].tsc;
+	buckets[to_ns (ev[i].tsc - t0) / BUCKET_NS] += 1;
+    }
+    print_dist ("inter-cqe gap", gaps, num_gaps);
+
+    /* the last bucket is partial, the one it is cut at */
+    if (num_buckets > 0) {
+	for (b = 0; b < num_buckets; b++) {
+	    sum += buckets[b];
+	    min  = (buckets[b] < min) ? buckets[b] : min;
+	    max  = (buckets[b] > max) ? buckets[b] : max;
+	}
+	printf ("  cqes per ms            min %"PRIu64"  mean %.1f  max %"PRIu64"\n",
+		min, (double)sum / num_buckets, max);
+	printf ("  dips                  ");
+	for (d = 0; (d < NUM_DIPS) && (d < num_buckets); d++) {
+	    long lowest = 0;
+
+	    for (b = 1; b < num_buckets; b++) {
+		if (buckets[b] < buckets[lowest]) {
+		    lowest = b;
+		}
+	    }
+	    printf (" %"PRIu64" at %ld ms", buckets[lowest], lowest);
+	    buckets[lowest] = UINT64_MAX;
+	}
+	printf ("\n");
+    }
+
+    free (gaps);
+    free (buckets);
+    return 0;
+}
+
+static void queue_push (int *head, int *tail, struct Request *req, int r)
+{
+    uint32_t p = req[r].peer;
+
+    req[r].next = -1;
+    if (tail[p] < 0) {
+	head[p] = r;
+    } else {
+	req[tail[p]].next = r;
+    }
+    tail[p] = r;
+}
+
+static int queue_pop (int *head, int *tail, struct Request *req, uint32_t p)
+{
+    int r = head[p];
+
+    if (r >= 0) {
+	head[p] = req[r].next;
+	if (head[p] < 0) {
+	    tail[p] = -1;
+	}
+    }
+    return r;
+}
+
+/*
+ *  analyze_requests:
+ *       pair the events of each request. A doorbell rings every chain
+ *       of the flush, so it stamps every send queued since the last
+ *       one, whatever qp it went to
+ */
+static int analyze_requests (struct TraceEvent *ev, uint32_t num, int is_server)
+{
+    struct Request *req     = NULL;
+    struct Span    *span    = NULL;
+    uint64_t       *v       = NULL;
+    int            *head    = NULL, *tail = NULL, *undoorbelled = NULL;
+    int             num_req = 0, num_undoorbelled = 0, num_span = 0, r = 0, k = 0;
+    int             ret     = -1;
+    uint64_t        t0      = ev[0].tsc;
+    uint32_t        i       = 0, p = 0;
+
+    req          = (struct Request *) malloc (num * sizeof(struct Request));
+    span         = (struct Span *) malloc (num * sizeof(struct Span));
+    v            = (uint64_t *) malloc (num * sizeof(uint64_t));
+    undoorbelled = (int *) malloc (num * sizeof(int));
+    head         = (int *) malloc (MAX_PEERS * sizeof(int));
+    tail         = (int *) malloc (MAX_PEERS * sizeof(int));
+    if ((req == NULL) || (span == NULL) || (v == NULL) || (undoorbelled == NULL) ||
+	(head == NULL) || (tail == NULL)) {
+	fprintf (stderr, "Failed to allocate request timelines\n");
+	goto out;
+    }
+    memset (head, -1, MAX_PEERS * sizeof(int));
+    memset (tail, -1, MAX_PEERS * sizeof(int));
+
+    for (i = 0; i < num; i++) {
+	struct TraceEvent *e = &ev[i];
+
+	if (e->type == TRACE_SEND) {
+	    if (e->peer >= MAX_PEERS) {
+		continue;
+	    }
+	    if (is_server) {
+		r = queue_pop (head, tail, req, e->peer);
+		if (r < 0) {
+		    continue;
+		}
+	    } else {
+		r = num_req++;
+		req[r].t_first = e->tsc;
+		req[r].peer    = e->peer;
+		queue_push (head, tail, req, r);
+	    }
+	    req[r].t_send     = e->tsc;
+	    req[r].t_doorbell = 0;
+	    undoorbelled[num_undoorbelled++] = r;
+	} else if (e->type == TRACE_POST_SEND) {
+	    for (k = 0; k < num_undoorbelled; k++) {
+		struct Request *q = &req[undoorbelled[k]];
+
+		q->t_doorbell = e->tsc;
+		if (is_server) {
+		    span[num_span].total  = to_ns (q->t_doorbell - q->t_first);
+		    span[num_span].first  = to_ns (q->t_send - q->t_first);
+		    span[num_span].second = to_ns (q->t_doorbell - q->t_send);
+		    span[num_span].start  = to_ns (q->t_first - t0);
+		    span[num_span].peer   = q->peer;
+		    num_span += 1;
+		}
+	    }
+	    num_undoorbelled = 0;
+	} else if ((e->type == TRACE_CQE) && ((e->count & 0xFF) == WC_RECV) &&
+		   ((e->count >> 8) == 0) && (e->peer < IMM_CTL_BASE)) {
+	    p = e->peer & IMM_RANK_MASK;
+	    if (is_server) {
+		r = num_req++;
+		req[r].t_first = e->tsc;
+		req[r].peer    = p;
+		queue_push (head, tail, req, r);
+		continue;
+	    }
+	    r = queue_pop (head, tail, req, p);
+	    if ((r < 0) || (req[r].t_doorbell == 0)) {
+		continue;
+	    }
+	    span[num_span].total  = to_ns (e->tsc - req[r].t_first);
+	    span[num_span].first  = to_ns (req[r].t_doorbell - req[r].t_first);
+	    span[num_span].second = to_ns (e->tsc - req[r].t_doorbell);
+	    span[num_span].start  = to_ns (req[r].t_first - t0);
+	    span[num_span].peer   = p;
+	    num_span += 1;
+	}
+    }
+
+    printf ("  requests               %d timed\n", num_span);
+    if (num_span > 0) {
+	for (k = 0; k < num_span; k++) {
+	    v[k] = span[k].total;
+	}
+	print_dist (is_server ? "cqe -> doorbell" : "send -> reply cqe", v, num_span);
+	for (k = 0; k < num_span; k++) {
+	    v[k] = span[k].first;
+	}
+	print_dist (is_server ? "  cqe -> send" : "  send -> doorbell", v, num_span);
+	for (k = 0; k < num_span; k++) {
+	    v[k] = span[k].second;
+	}
+	print_dist (is_server ? "  send -> doorbell" : "  doorbell -> cqe", v, num_span);
+
+	qsort (span, num_span, sizeof(struct Span), cmp_span);
+	printf ("  slowest:\n");
+	for (k = 0; (k < NUM_SLOWEST) && (k < num_span); k++) {
+	    printf ("    peer %5"PRIu32" at %12"PRIu64" ns: %"PRIu64" ns (%"PRIu64" + %"PRIu64")\n",
+		    span[k].peer, span[k].start, span[k].total, span[k].first,
+		    span[k].second);
+	}
+    }
+
+    ret = 0;
+
+ out:
+    free (req);
+    free (span);
+    free (v);
+    free (undoorbelled);
+    free (head);
+    free (tail);
+    return ret;
+}
+
+int main (int argc, char *argv[])
+{
+    struct TraceFileHeader    hdr;
+    struct TraceThreadHeader  th;
+    struct TraceEvent        *ev  = NULL;
+    FILE                     *fp  = NULL;
+    uint32_t                  t   = 0;
+    int                       ret = 1;
+
+    if (argc != 2) {
+	printf ("Usage: %s trace_dump\n", argv[0]);
+	return 0;
+    }
+
+    fp = fopen (argv[1], "rb");
+    if (fp == NULL) {
+	fprintf (stderr, "Failed to open %s\n", argv[1]);
+	return 1;
+    }
+    if ((fread (&hdr, sizeof(hdr), 1, fp) != 1) || (hdr.magic != TRACE_MAGIC) ||
+	(hdr.version != TRACE_VERSION)) {
+	fprintf (stderr, "%s is not a version %d trace dump\n", argv[1], TRACE_VERSION);
+	goto out;
+    }
+    if (hdr.tsc_dump > hdr.tsc_start) {
+	ns_per_tick = (double)(hdr.ns_dump - hdr.ns_start) / (hdr.tsc_dump - hdr.tsc_start);
+    }
+
+    printf ("%s[%d]: %"PRIu32" threads, %.3f ns per tick, %.1f ns per event recorded\n",
+	    hdr.is_server ? "server" : "client", hdr.rank, hdr.num_threads,
+	    ns_per_tick, hdr.ns_per_event);
+
+    for (t = 0; t < hdr.num_threads; t++) {
+	uint64_t span_ns = 0;
+
+	if (fread (&th, sizeof(th), 1, fp) != 1) {
+	    fprintf (stderr, "Truncated dump at thread[%"PRIu32"]\n", t);
+	    goto out;
+	}
+	ev = (struct TraceEvent *) malloc ((th.num_events + 1) * sizeof(struct TraceEvent));
+	if (ev == NULL) {
+	    fprintf (stderr, "Failed to allocate %"PRIu32" events\n", th.num_events);
+	    goto out;
+	}
+	if (fread (ev, sizeof(struct TraceEvent), th.num_events, fp) != th.num_events) {
+	    fprintf (stderr, "Truncated dump at thread[%"PRIu32"]\n", t);
+	    goto out;
+	}
+
+	printf ("\nthread[%"PRIu32"]:\n", th.thread_id);
+	if (th.num_events == 0) {
+	    printf ("  no events\n");
+	    free (ev);
+	    ev = NULL;
+	    continue;
+	}
+	span_ns = to_ns (ev[th.num_events - 1].tsc - ev[0].tsc);
+	printf ("  events                 %"PRIu32" over %.3f ms, %"PRIu64" overwritten, "
+		"~%.2f%% spent recording\n",
+		th.num_events, span_ns / 1e6, th.num_recorded - th.num_events,
+		(span_ns > 0) ? 100.0 * th.num_events * hdr.ns_per_event / span_ns : 0.0);
+
+	analyze_polls (ev, th.num_events);
+	if ((analyze_cqes (ev, th.num_events) != 0) ||
+	    (analyze_requests (ev, th.num_events, hdr.is_server) != 0)) {
+	    goto out;
+	}
+	free (ev);
+	ev = NULL;
+    }
+    ret = 0;
+
+ out:
+    if (ev != NULL) {
+	free (ev);
+    }
+    fclose (fp);
+    return ret;
+}
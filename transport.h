@@ -0,0 +1,42 @@
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include "ib.h"
+
+/*
+ * what the echo threads run on. A PostBatch belongs to one worker
+ * thread and carries whatever the backend keeps per thread; wcs are
+ * struct ibv_wc for every backend. ib posts to the nic (send, recv
+ * and flush are batch_send, batch_recv and flush_post_batch), shm
+ * moves messages between two local processes over spsc rings.
+ * Buffers outside ib_buf (pool, mrcache) are registered through
+ * reg_mr. The one-sided workloads are verbs by nature and talk to
+ * the nic directly.
+ */
+struct TransportOps {
+    char  *name;
+
+    int  (*setup)      ();
+    void (*close)      ();
+
+    int  (*init_batch) (struct PostBatch *b, long thread_id);
+    int  (*send)       (struct PostBatch *b, uint32_t req_size,
+			uint32_t imm_data, uint32_t peer, char *buf);
+    int  (*recv)       (struct PostBatch *b, uint32_t req_size, char *buf);
+    int  (*flush)      (struct PostBatch *b);
+    int  (*poll)       (struct PostBatch *b, struct CQWaiter *w, int num_wc,
+			struct ibv_wc *wc);
+    /* zero-length, always signaled control message */
+    int  (*ctl_send)   (struct PostBatch *b, int peer, uint64_t wr_id,
+			uint32_t imm_data);
+    /* NULL on failure; shm reads plain memory and registers nothing */
+    struct ibv_mr *(*reg_mr)   (struct ibv_pd *pd, void *addr, size_t len,
+				int access);
+    void           (*dereg_mr) (struct ibv_mr *mr);
+};
+
+extern struct TransportOps *transport;
+extern struct TransportOps  ib_transport;
+extern struct TransportOps  shm_transport;
+
+#endif /* TRANSPORT_H_ */